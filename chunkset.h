@@ -0,0 +1,180 @@
+/*
+    WASTE - chunkset.h (Bitmap of file chunks)
+    Copyright (C) 2003 Nullsoft, Inc.
+
+    WASTE is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    WASTE  is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with WASTE; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _C_CHUNKSET_H_
+#define _C_CHUNKSET_H_
+
+// a set of chunk indices, kept 64 to a word with a running count so that
+// counting is free and looking for a missing chunk skips whole words.
+// indices past the end read as not set.
+
+#ifdef _MSC_VER
+typedef unsigned __int64 chunkword;
+#else
+typedef unsigned long long chunkword;
+#endif
+
+class C_ChunkSet
+{
+  public:
+    C_ChunkSet() { m_w=NULL; m_n=m_cnt=0; }
+    ~C_ChunkSet() { ::free(m_w); }
+
+    // empties the set and sizes it for n chunks, 0 on failure (the set is then empty)
+    int resize(unsigned int n)
+    {
+      ::free(m_w);
+      m_n=m_cnt=0;
+      m_w=n ? (chunkword *)::calloc(words(n),sizeof(chunkword)) : NULL;
+      if (m_w) m_n=n;
+      return m_w != NULL;
+    }
+    void release() { resize(0); }
+    void clear() { if (m_w) ::memset(m_w,0,words(m_n)*sizeof(chunkword)); m_cnt=0; }
+
+    int ok() const { return m_w != NULL; }
+    unsigned int size() const { return m_n; }
+    unsigned int count() const { return m_cnt; }
+    int full() const { return m_w && m_cnt >= m_n; }
+
+    int is(unsigned int x) const { return x < m_n && ((m_w[x>>6] >> (x&63)) & 1); }
+    int set(unsigned int x) // 1 if it wasn't already
+    {
+      if (x >= m_n || is(x)) return 0;
+      m_w[x>>6]|=(chunkword)1 << (x&63);
+      m_cnt++;
+      return 1;
+    }
+    int clr(unsigned int x) // 1 if it was set
+    {
+      if (!is(x)) return 0;
+      m_w[x>>6]&=~((chunkword)1 << (x&63));
+      m_cnt--;
+      return 1;
+    }
+    // these return how many changed
+    unsigned int setRange(unsigned int x, unsigned int n) { return range(x,n,1); }
+    unsigned int clrRange(unsigned int x, unsigned int n) { return range(x,n,0); }
+
+    // first index >= x that isn't set (and isn't set in also, if given).
+    // returns x if x is already past the end, size() if there is none.
+    unsigned int findClear(unsigned int x, const C_ChunkSet *also=NULL) const
+    {
+      if (x >= m_n) return x;
+      unsigned int i=x>>6, e=words(m_n);
+      chunkword w=~(m_w[i] | (also ? also->word(i) : 0)) & ((chunkword)-1 << (x&63));
+      while (!w)
+      {
+        if (++i >= e) return m_n;
+        w=~(m_w[i] | (also ? also->word(i) : 0));
+      }
+      x=(i<<6)+ctz(w);
+      return x < m_n ? x : m_n;
+    }
+    // first index >= x that is set, size() if there is none
+    unsigned int findSet(unsigned int x) const
+    {
+      if (x >= m_n) return m_n;
+      unsigned int i=x>>6, e=words(m_n);
+      chunkword w=m_w[i] & ((chunkword)-1 << (x&63));
+      while (!w)
+      {
+        if (++i >= e) return m_n;
+        w=m_w[i];
+      }
+      return (i<<6)+ctz(w);
+    }
+
+    // bit x of the set is bit x&7 of byte x>>3, as in the state file
+    void toBytes(unsigned char *out) const
+    {
+      unsigned int x, nb=(m_n+7)/8;
+      for (x = 0; x < nb; x ++) out[x]=(unsigned char)(m_w[x>>3] >> ((x&7)*8));
+    }
+    void fromBytes(const unsigned char *in)
+    {
+      unsigned int x, nb=(m_n+7)/8;
+      clear();
+      for (x = 0; x < nb; x ++) m_w[x>>3]|=(chunkword)in[x] << ((x&7)*8);
+      if (m_n&63) m_w[(m_n-1)>>6]&=((chunkword)1 << (m_n&63))-1; // junk past the end
+      for (x = 0; x < words(m_n); x ++) m_cnt+=popcount(m_w[x]);
+    }
+
+  protected:
+    chunkword *m_w;
+    unsigned int m_n, m_cnt;
+
+    static unsigned int words(unsigned int n) { return (n+63)>>6; }
+    chunkword word(unsigned int i) const { return i < words(m_n) ? m_w[i] : 0; }
+
+    unsigned int range(unsigned int x, unsigned int n, int on)
+    {
+      if (x >= m_n) return 0;
+      if (n > m_n-x) n=m_n-x;
+      unsigned int before=m_cnt, e=x+n;
+      while (x < e)
+      {
+        unsigned int b=x&63, l=64-b;
+        if (l > e-x) l=e-x;
+        chunkword mask=(l == 64 ? (chunkword)-1 : (((chunkword)1 << l)-1)) << b;
+        chunkword *w=m_w+(x>>6);
+        if (on)
+        {
+          m_cnt+=l-popcount(*w & mask);
+          *w|=mask;
+        }
+        else
+        {
+          m_cnt-=popcount(*w & mask);
+          *w&=~mask;
+        }
+        x+=l;
+      }
+      return on ? m_cnt-before : before-m_cnt;
+    }
+
+    static unsigned int popcount(chunkword w)
+    {
+#ifdef __GNUC__
+      return __builtin_popcountll(w);
+#else
+      w=w-((w>>1) & 0x5555555555555555);
+      w=(w & 0x3333333333333333)+((w>>2) & 0x3333333333333333);
+      w=(w+(w>>4)) & 0x0f0f0f0f0f0f0f0f;
+      return (unsigned int)((w*0x0101010101010101) >> 56);
+#endif
+    }
+    static unsigned int ctz(chunkword w) // w != 0
+    {
+#ifdef __GNUC__
+      return __builtin_ctzll(w);
+#else
+      unsigned int n=0;
+      if (!(w & 0xffffffff)) { n+=32; w>>=32; }
+      if (!(w & 0xffff)) { n+=16; w>>=16; }
+      if (!(w & 0xff)) { n+=8; w>>=8; }
+      if (!(w & 0xf)) { n+=4; w>>=4; }
+      if (!(w & 0x3)) { n+=2; w>>=2; }
+      if (!(w & 0x1)) n++;
+      return n;
+#endif
+    }
+};
+
+#endif//_C_CHUNKSET_H_
@@ -24,39 +24,58 @@
 #include "util.h"
 #include "srchwnd.h"
 
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
 #define SCAN_MAX_POS 0x60000000
 
 #ifdef _WIN32
 #define DB_LH_ALLOC(y) HeapAlloc(hHeap,0,y)
 #define DB_LH_REALLOC(x,y) HeapReAlloc(hHeap,0,x,y)
 #define DB_LH_FREE(x) HeapFree(hHeap,0,x)
-#define DB_LH_STRDUP(x) priv__strdup(hHeap,x)
-static char *priv__strdup(HANDLE hHeap, char *str)
-{
-  char *t=(char *) DB_LH_ALLOC(strlen(str)+1);
-  strcpy(t,str);
-  return t;
-}
 #else
 #define DB_LH_ALLOC(y) malloc(y)
 #define DB_LH_REALLOC(x,y) realloc(x,y)
 #define DB_LH_FREE(x) free(x)
-#define DB_LH_STRDUP(x) strdup(x)
 #endif
 
+#define FILEDB_NOSTR 0xFFFFFFFF
+
 C_FileDB::C_FileDB()
 {
   m_use_oldidx=0;
   m_scanidx_gpos=0;
-  m_database=NULL;
   m_database_used=m_database_size=0;
+  m_db_name=NULL;
+  m_db_namelen=NULL;
+  m_db_dir=NULL;
+  m_db_meta=NULL;
+  m_db_length_low=m_db_length_high=NULL;
+  m_db_time=NULL;
+  m_db_vindex=NULL;
+  m_db_sha=m_db_shaok=NULL;
+  m_db_tree=NULL;
+  m_hash_pos=0;
+  m_hash_fp=NULL;
   m_database_mb=0;
   m_database_xbytes=0;
   m_database_newesttime=0;
   m_scan_stack=NULL;
-  m_dir_index=NULL;
+  m_dir_name=NULL;
+  m_dir_base_len=NULL;
   m_dir_index_size=0;
   m_dir_index_used=0;
+  memset(&m_names,0,sizeof(m_names));
+  memset(&m_lnames,0,sizeof(m_lnames));
+  memset(&m_metas,0,sizeof(m_metas));
+  memset(&m_dirstrs,0,sizeof(m_dirstrs));
+  memset(&m_ldirstrs,0,sizeof(m_ldirstrs));
+  memset(&m_trees,0,sizeof(m_trees));
+  m_dirhash=m_filehash=NULL;
+  m_dirhash_mask=m_filehash_mask=0;
+  m_map=NULL;
+  m_map_len=0;
 #ifdef _WIN32
   hHeap=HeapCreate(HEAP_NO_SERIALIZE,0,0);
 #endif
@@ -121,37 +140,57 @@ void C_FileDB::Scan(char *pathlist)
     m_scan_stack->Push(i);
 //    debug_printf("Adding directory: '%s'\n",i.cur_path);
   }
-  m_oldscan_lastpos=0;
-  m_oldscan_lastdirpos=0;
+  m_oldscan_dir=-1;
   m_oldscan_dirstate=0;
 }
 
 void C_FileDB::clearDBs()
 {
-  if (m_database) 
+  if (m_database_size) 
   {
-    int x;
-    for (x = 0; x < m_database_used; x ++)
-    {
-      DB_LH_FREE(m_database[x].meta);
-      DB_LH_FREE(m_database[x].file);
-    } 
-    DB_LH_FREE(m_database);
+    DB_LH_FREE(m_db_name);
+    DB_LH_FREE(m_db_namelen);
+    DB_LH_FREE(m_db_dir);
+    DB_LH_FREE(m_db_meta);
+    DB_LH_FREE(m_db_length_low);
+    DB_LH_FREE(m_db_length_high);
+    DB_LH_FREE(m_db_time);
+    DB_LH_FREE(m_db_vindex);
   }
-
-  if (m_dir_index) 
+  if (m_db_sha) DB_LH_FREE(m_db_sha);
+  if (m_db_shaok) DB_LH_FREE(m_db_shaok);
+  if (m_db_tree) DB_LH_FREE(m_db_tree);
+  if (m_hash_fp) fclose(m_hash_fp);
+  m_hash_fp=NULL;
+  m_hash_pos=0;
+  if (m_dir_index_size) 
   {
-    int x;
-    for (x = 0; x < m_dir_index_used; x ++)
-    {
-      DB_LH_FREE(m_dir_index[x].dirname);
-    } 
-    DB_LH_FREE(m_dir_index);
+    DB_LH_FREE(m_dir_name);
+    DB_LH_FREE(m_dir_base_len);
   }
-  m_dir_index=NULL;
+  arena_free(&m_names);
+  arena_free(&m_lnames);
+  arena_free(&m_metas);
+  arena_free(&m_dirstrs);
+  arena_free(&m_ldirstrs);
+  arena_free(&m_trees);
+  m_hash_tree.reset();
+  freeLookup();
+  unmapDB();
+
+  m_dir_name=NULL;
+  m_dir_base_len=NULL;
   m_dir_index_size=0;
   m_dir_index_used=0;
-  m_database=0;
+  m_db_name=NULL;
+  m_db_namelen=NULL;
+  m_db_dir=NULL;
+  m_db_meta=NULL;
+  m_db_length_low=m_db_length_high=NULL;
+  m_db_time=NULL;
+  m_db_vindex=NULL;
+  m_db_sha=m_db_shaok=NULL;
+  m_db_tree=NULL;
   m_database_size=0;
   m_database_used=0;
   m_database_xbytes=0;
@@ -159,6 +198,64 @@ void C_FileDB::clearDBs()
   m_database_mb=0;
 }
 
+void C_FileDB::arena_free(StrArena *a)
+{
+  if (a->size) DB_LH_FREE(a->buf);
+  a->buf=NULL;
+  a->used=a->size=0;
+}
+
+unsigned int C_FileDB::arena_add(StrArena *a, char *str, int len)
+{
+  if (a->used+len+1 > a->size)
+  {
+    unsigned int ns=a->size ? a->size*2 : 65536;
+    while (ns < a->used+len+1) ns*=2;
+    char *nb=(char *) (a->buf ? DB_LH_REALLOC(a->buf,ns) : DB_LH_ALLOC(ns));
+    if (!nb) return 0xFFFFFFFF;
+    a->buf=nb;
+    a->size=ns;
+  }
+  unsigned int offs=a->used;
+  memcpy(a->buf+offs,str,len);
+  a->buf[offs+len]=0;
+  a->used+=len+1;
+  return offs;
+}
+
+// adds str to a, and its lowercased copy to lc_a at the same offset
+unsigned int C_FileDB::add_name(StrArena *a, StrArena *lc_a, char *str, int len)
+{
+  unsigned int offs=arena_add(a,str,len);
+  if (offs == 0xFFFFFFFF) return offs;
+  if (arena_add(lc_a,str,len) != offs) return 0xFFFFFFFF;
+  char *p=lc_a->buf+offs;
+  while (*p)
+  {
+    if (*p >= 'A' && *p <= 'Z') *p+='a'-'A';
+    p++;
+  }
+  return offs;
+}
+
+// builds out as a lowercased copy of in (for databases read without one)
+int C_FileDB::arena_lowercase(StrArena *out, StrArena *in)
+{
+  arena_free(out);
+  if (!in->used) return 0;
+  out->buf=(char *)DB_LH_ALLOC(in->used);
+  if (!out->buf) return 1;
+  out->used=out->size=in->used;
+  unsigned int x;
+  for (x = 0; x < in->used; x ++)
+  {
+    char c=in->buf[x];
+    if (c >= 'A' && c <= 'Z') c+='a'-'A';
+    out->buf[x]=c;
+  }
+  return 0;
+}
+
 C_FileDB::~C_FileDB()
 {
   delete m_scan_stack;
@@ -248,6 +345,18 @@ int C_FileDB::substr_search(char *bigtext1, char *bigtext2, char *littletext_lis
   return 1;  
 }
 
+// like substr_search(), but bigtext1/bigtext2 are already lowercase
+int C_FileDB::substr_search_lc(char *bigtext1, char *bigtext2, char *littletext_list)
+{ 
+  while (*littletext_list)
+  {
+    if (!strstr(bigtext1,littletext_list) && !strstr(bigtext2,littletext_list)) return 0;
+    while (*littletext_list) littletext_list++;
+    littletext_list++;
+  }
+  return 1;  
+}
+
 
 void C_FileDB::Search(char *ss, C_MessageSearchReply *repl, C_MessageQueueList *mqueuesend, T_Message *srcmessage, void (*gm)(T_Message *message, C_MessageQueueList *_this, C_Connection *cn))
 {
@@ -335,15 +444,15 @@ void C_FileDB::Search(char *ss, C_MessageSearchReply *repl, C_MessageQueueList *
       if (sslen) for (x = 0; x < m_database_used; x ++)
       {
         char buf[2048];
-        char *d=m_dir_index[m_database[x].dir_index].dirname;
-        unsigned int l=m_dir_index[m_database[x].dir_index].base_len+1;
+        char *d=dir_name(m_db_dir[x]);
+        unsigned int l=m_dir_base_len[m_db_dir[x]]+1;
 
         int a=l-2;
         while (a>0 && d[a]!='/' && d[a]!='\\') a--;
         if (a > 0) l=a+1;
         d+=l;
 
-        sprintf(buf,"%s/%s",d,m_database[x].file);
+        sprintf(buf,"%s/%s",d,db_file(x));
         char *f=buf;
         while (*f)
         {
@@ -357,7 +466,7 @@ void C_FileDB::Search(char *ss, C_MessageSearchReply *repl, C_MessageQueueList *
           while (f >= buf && *f != '/') f--;
           f++;
 
-          if (!repl->would_fit(f,m_database[x].meta)) 
+          if (!repl->would_fit(f,db_meta(x))) 
           {
 			      T_Message msg={0,};
 			      if (srcmessage) msg.message_guid=srcmessage->message_guid;
@@ -376,7 +485,7 @@ void C_FileDB::Search(char *ss, C_MessageSearchReply *repl, C_MessageQueueList *
 			      }
             repl->clear_items();
           }
-          repl->add_item(m_database[x].v_index,f,m_database[x].meta,m_database[x].length_low,m_database[x].length_high,m_database[x].file_time);
+          repl->add_item(m_db_vindex[x],f,db_meta(x),m_db_length_low[x],m_db_length_high[x],m_db_time[x]);
         }
       } // tree loop
     }
@@ -393,15 +502,15 @@ void C_FileDB::Search(char *ss, C_MessageSearchReply *repl, C_MessageQueueList *
       for (x = 0; x < m_database_used; x ++)
       {
         char buf[2048];
-        char *d=m_dir_index[m_database[x].dir_index].dirname;
-        unsigned int l=m_dir_index[m_database[x].dir_index].base_len+1;
+        char *d=dir_name(m_db_dir[x]);
+        unsigned int l=m_dir_base_len[m_db_dir[x]]+1;
 
         int a=l-2;
         while (a>0 && d[a]!='/' && d[a]!='\\') a--;
         if (a > 0) l=a+1;
         d+=l;
 
-        char *f=m_database[x].file;
+        char *f=db_file(x);
         sprintf(buf,"%s\\%s",d,f);
         f=buf;
         while (*f)
@@ -426,7 +535,7 @@ void C_FileDB::Search(char *ss, C_MessageSearchReply *repl, C_MessageQueueList *
           if (stricmp(++f,last))
           {
             strcpy(last,f);
-            if (!repl->would_fit(f,is_dir?(char*)DIRECTORY_STRING:m_database[x].meta)) 
+            if (!repl->would_fit(f,is_dir?(char*)DIRECTORY_STRING:db_meta(x))) 
             {
 			        T_Message msg={0,};
 			        if (srcmessage) msg.message_guid=srcmessage->message_guid;
@@ -445,26 +554,26 @@ void C_FileDB::Search(char *ss, C_MessageSearchReply *repl, C_MessageQueueList *
 			        }
               repl->clear_items();
             }
-            int poosize=m_database[x].length_high;
+            int poosize=m_db_length_high[x];
             if (is_dir)
             {
               unsigned int o=dbsize_errcnt;
-              dbsize_errcnt += m_database[x].length_low & 0xFFFFF;
+              dbsize_errcnt += m_db_length_low[x] & 0xFFFFF;
               dbsize_errcnt &= 0xFFFFF;
-              poosize=(m_database[x].length_high * 4096)+(m_database[x].length_low>>20) + (dbsize_errcnt < o);
+              poosize=(m_db_length_high[x] * 4096)+(m_db_length_low[x]>>20) + (dbsize_errcnt < o);
             }
 
-            repl->add_item(is_dir?-1:m_database[x].v_index,f,is_dir?(char*)DIRECTORY_STRING:m_database[x].meta,
-              is_dir?1:m_database[x].length_low,poosize,m_database[x].file_time);
+            repl->add_item(is_dir?-1:m_db_vindex[x],f,is_dir?(char*)DIRECTORY_STRING:db_meta(x),
+              is_dir?1:m_db_length_low[x],poosize,m_db_time[x]);
             dbsize_errcnt=0;
           }
           else
           {
             unsigned int o=dbsize_errcnt;
-            dbsize_errcnt += m_database[x].length_low & 0xFFFFF;
+            dbsize_errcnt += m_db_length_low[x] & 0xFFFFF;
             dbsize_errcnt &= 0xFFFFF;
 
-            repl->addlastsize(1,(m_database[x].length_high * 4096)+(m_database[x].length_low>>20) + (dbsize_errcnt < o),m_database[x].file_time); // if dbsize_errcnt wraps, then we should tack another mb on there
+            repl->addlastsize(1,(m_db_length_high[x] * 4096)+(m_db_length_low[x]>>20) + (dbsize_errcnt < o),m_db_time[x]); // if dbsize_errcnt wraps, then we should tack another mb on there
           }
         }
       }
@@ -495,24 +604,32 @@ void C_FileDB::Search(char *ss, C_MessageSearchReply *repl, C_MessageQueueList *
   char ssout[1024+1024];
   parselist(ssout,searchstring);
 
+  // entries of a directory are contiguous, so only look up the (lowercase)
+  // part of the path below the share root when the directory changes
+  int lastdir=-1;
+  char *ld=(char*)"";
   for (x = 0; x < m_database_used; x ++)
   {
-    char *d=m_dir_index[m_database[x].dir_index].dirname;
-    unsigned int l=m_dir_index[m_database[x].dir_index].base_len+1;
-    if (l >= strlen(d)) d=(char*)"";
-    else d+=l;
-    if (substr_search(m_database[x].file,d,ssout))
+    if (m_db_dir[x] != lastdir)
+    {
+      lastdir=m_db_dir[x];
+      ld=m_ldirstrs.buf+m_dir_name[lastdir];
+      unsigned int l=m_dir_base_len[lastdir]+1;
+      if (l >= strlen(ld)) ld=(char*)"";
+      else ld+=l;
+    }
+    if (substr_search_lc(m_lnames.buf+m_db_name[x],ld,ssout))
     {
       char buf[2048];
-      char *d=m_dir_index[m_database[x].dir_index].dirname;
-      unsigned int l=m_dir_index[m_database[x].dir_index].base_len+1;
+      char *d=dir_name(m_db_dir[x]);
+      unsigned int l=m_dir_base_len[m_db_dir[x]]+1;
 
       int a=l-2;
       while (a>0 && d[a]!='/' && d[a]!='\\') a--;
       if (a > 0) l=a+1;
       d+=l;
 
-      char *f=m_database[x].file;
+      char *f=db_file(x);
       sprintf(buf,"/%s/%s/%s",g_regnick[0]?g_regnick:"?",d,f);
       f=buf;
       while (*f)
@@ -521,8 +638,8 @@ void C_FileDB::Search(char *ss, C_MessageSearchReply *repl, C_MessageQueueList *
         f++;
       }
 
-      if (!repl->would_fit(buf,m_database[x].meta)) break;
-      repl->add_item(m_database[x].v_index,buf,m_database[x].meta,m_database[x].length_low,m_database[x].length_high,m_database[x].file_time);
+      if (!repl->would_fit(buf,db_meta(x))) break;
+      repl->add_item(m_db_vindex[x],buf,db_meta(x),m_db_length_low[x],m_db_length_high[x],m_db_time[x]);
     }
   }
 
@@ -548,22 +665,16 @@ void C_FileDB::Search(char *ss, C_MessageSearchReply *repl, C_MessageQueueList *
 
 }
 
+#define DB_GROW(p,type,n) (p) = (type *) ((p) ? DB_LH_REALLOC((p),(n)*sizeof(type)) : DB_LH_ALLOC((n)*sizeof(type)))
+
 void C_FileDB::alloc_dir_index(void)
 {
   if (m_dir_index_used >= m_dir_index_size)
   {
-    if (m_dir_index) 
-    {
-      m_dir_index_size+=512;
-      if (m_dir_index_size < m_dir_index_used) m_dir_index_size=m_dir_index_used+512;
-      m_dir_index= (DirIndexType*) DB_LH_REALLOC(m_dir_index,m_dir_index_size*sizeof(DirIndexType));
-    }
-    else 
-    {
-      m_dir_index_size=512;
-      if (m_dir_index_size < m_dir_index_used) m_dir_index_size=m_dir_index_used+512;
-      m_dir_index = (DirIndexType*) DB_LH_ALLOC(m_dir_index_size*sizeof(DirIndexType));
-    }
+    m_dir_index_size+=512;
+    if (m_dir_index_size < m_dir_index_used) m_dir_index_size=m_dir_index_used+512;
+    DB_GROW(m_dir_name,unsigned int,m_dir_index_size);
+    DB_GROW(m_dir_base_len,int,m_dir_index_size);
   }
 }
 
@@ -571,18 +682,19 @@ void C_FileDB::alloc_entry(void)
 {
   if (m_database_used >= m_database_size)
   {
-    if (m_database) 
-    {
-      m_database_size+=2048;
-      if (m_database_size < m_database_used) m_database_size=m_database_used+2048;
-      m_database = (dbType *) DB_LH_REALLOC(m_database,m_database_size*sizeof(dbType));
-    }
-    else 
-    {
-      m_database_size=2048;
-      if (m_database_size < m_database_used) m_database_size=m_database_used+2048;
-      m_database = (dbType *) DB_LH_ALLOC(m_database_size*sizeof(dbType));
-    }
+    m_database_size+=2048;
+    if (m_database_size < m_database_used) m_database_size=m_database_used+2048;
+    DB_GROW(m_db_name,unsigned int,m_database_size);
+    DB_GROW(m_db_namelen,unsigned short,m_database_size);
+    DB_GROW(m_db_dir,int,m_database_size);
+    DB_GROW(m_db_meta,unsigned int,m_database_size);
+    DB_GROW(m_db_length_low,int,m_database_size);
+    DB_GROW(m_db_length_high,int,m_database_size);
+    DB_GROW(m_db_time,int,m_database_size);
+    DB_GROW(m_db_vindex,int,m_database_size);
+    DB_GROW(m_db_sha,unsigned char,m_database_size*SHA_OUTSIZE);
+    DB_GROW(m_db_shaok,unsigned char,m_database_size);
+    DB_GROW(m_db_tree,unsigned int,m_database_size);
   }
 }
 
@@ -597,39 +709,223 @@ int C_FileDB::in_list(char *list, char *v)
   return 0;
 }
 
-int C_FileDB::GetFile(int index, char *file, char *meta, int *length_low, int *length_high, char **sharebaseptr)
+// FNV-1a
+unsigned int C_FileDB::hashstr(char *str, int len)
 {
-  if (index < 0) return 1;
+  unsigned int h=0x811C9DC5;
+  while (len-- > 0) h=(h ^ (unsigned char)*str++) * 0x01000193;
+  return h;
+}
+
+// builds the name lookups used by findDir() and findFile().  this is only
+// needed on the old database during a rescan, so it's done on first use.
+void C_FileDB::buildLookup()
+{
+  freeLookup();
   int x;
-  for (x = 0; x < m_database_used && m_database[x].v_index != index; x ++);
-  if (x == m_database_used) return 1;
 
-  if (file) sprintf(file,"%s%c%s",m_dir_index[m_database[x].dir_index].dirname,DIRCHAR,m_database[x].file);
+  m_dirhash_mask=1023;
+  while (m_dirhash_mask < m_dir_index_used*2) m_dirhash_mask=m_dirhash_mask*2+1;
+  m_dirhash=(int *)DB_LH_ALLOC((m_dirhash_mask+1)*sizeof(int));
+  m_filehash_mask=4095;
+  while (m_filehash_mask < m_database_used*2) m_filehash_mask=m_filehash_mask*2+1;
+  m_filehash=(int *)DB_LH_ALLOC((m_filehash_mask+1)*sizeof(int));
+  if (!m_dirhash || !m_filehash)
+  {
+    freeLookup();
+    return;
+  }
+  memset(m_dirhash,0,(m_dirhash_mask+1)*sizeof(int));
+  memset(m_filehash,0,(m_filehash_mask+1)*sizeof(int));
+
+  // slots hold index+1, 0 is empty
+  for (x = 0; x < m_dir_index_used; x ++)
+  {
+    char *d=dir_name(x);
+    unsigned int h=hashstr(d,strlen(d));
+    while (m_dirhash[h&m_dirhash_mask]) h++;
+    m_dirhash[h&m_dirhash_mask]=x+1;
+  }
+  for (x = 0; x < m_database_used; x ++)
+  {
+    unsigned int h=hashstr(db_file(x),m_db_namelen[x]) ^ (m_db_dir[x]*0x9E3779B1);
+    while (m_filehash[h&m_filehash_mask]) h++;
+    m_filehash[h&m_filehash_mask]=x+1;
+  }
+}
+
+void C_FileDB::freeLookup()
+{
+  if (m_dirhash) DB_LH_FREE(m_dirhash);
+  if (m_filehash) DB_LH_FREE(m_filehash);
+  m_dirhash=m_filehash=NULL;
+  m_dirhash_mask=m_filehash_mask=0;
+}
+
+// returns the directory index of dirname, or -1
+int C_FileDB::findDir(char *dirname)
+{
+  if (!m_dirhash) buildLookup();
+  if (!m_dirhash) return -1;
+  unsigned int h=hashstr(dirname,strlen(dirname));
+  int v;
+  while ((v=m_dirhash[h&m_dirhash_mask]))
+  {
+    if (!strcmp(dir_name(v-1),dirname)) return v-1;
+    h++;
+  }
+  return -1;
+}
+
+// returns the position of file name in directory dir_index, or -1
+int C_FileDB::findFile(int dir_index, char *name, int namelen)
+{
+  if (!m_filehash) buildLookup();
+  if (!m_filehash) return -1;
+  unsigned int h=hashstr(name,namelen) ^ (dir_index*0x9E3779B1);
+  int v;
+  while ((v=m_filehash[h&m_filehash_mask]))
+  {
+    v--;
+    if (m_db_dir[v] == dir_index && m_db_namelen[v] == namelen && !memcmp(db_file(v),name,namelen)) return v;
+    h++;
+  }
+  return -1;
+}
+
+int C_FileDB::findPos(int index)
+{
+  if (index < 0) return -1;
+  int x;
+  for (x = 0; x < m_database_used && m_db_vindex[x] != index; x ++);
+  if (x == m_database_used) return -1;
+  return x;
+}
+
+int C_FileDB::GetFile(int index, char *file, char *meta, int *length_low, int *length_high, char **sharebaseptr)
+{
+  int x=findPos(index);
+  if (x < 0) return 1;
+
+  if (file) sprintf(file,"%s%c%s",dir_name(m_db_dir[x]),DIRCHAR,db_file(x));
   if (meta)
   {
-    if (m_database[x].meta) strcpy(meta,m_database[x].meta);
+    if (db_meta(x)) strcpy(meta,db_meta(x));
     else meta[0]=0;
   }
-  if (length_low) *length_low=m_database[x].length_low;
-  if (length_high) *length_high=m_database[x].length_high;
-  if (sharebaseptr&&file) *sharebaseptr = file+m_dir_index[m_database[x].dir_index].base_len+1;
+  if (length_low) *length_low=m_db_length_low[x];
+  if (length_high) *length_high=m_db_length_high[x];
+  if (sharebaseptr&&file) *sharebaseptr = file+m_dir_base_len[m_db_dir[x]]+1;
   return 0;
 }
 
+int C_FileDB::GetFileHash(int index, int *length_low, int *length_high, int *file_time, unsigned char *hash)
+{
+  int x=findPos(index);
+  if (x < 0 || !m_db_shaok || !m_db_shaok[x]) return 1;
+  *length_low=m_db_length_low[x];
+  *length_high=m_db_length_high[x];
+  *file_time=m_db_time[x];
+  memcpy(hash,m_db_sha+x*SHA_OUTSIZE,SHA_OUTSIZE);
+  return 0;
+}
+
+void C_FileDB::SetFileHash(int index, int length_low, int length_high, int file_time, unsigned char *hash,
+                           unsigned char *leaves, int nleaves)
+{
+  int x=findPos(index);
+  if (x < 0 || !m_db_shaok ||
+      m_db_length_low[x] != length_low || m_db_length_high[x] != length_high || m_db_time[x] != file_time) return;
+  memcpy(m_db_sha+x*SHA_OUTSIZE,hash,SHA_OUTSIZE);
+  m_db_shaok[x]=1;
+  m_db_tree[x]=FILEDB_NOSTR;
+  if (leaves && nleaves > 1 && nleaves == FileTree_NumLeaves(length_low,length_high))
+    m_db_tree[x]=arena_add(&m_trees,(char *)leaves,nleaves*SHA_OUTSIZE);
+}
+
+unsigned char *C_FileDB::GetFileTree(int index, int *nleaves)
+{
+  int x=findPos(index);
+  if (x < 0 || !m_db_shaok || !m_db_shaok[x]) return NULL;
+  *nleaves=FileTree_NumLeaves(m_db_length_low[x],m_db_length_high[x]);
+  if (*nleaves == 1) return m_db_sha+x*SHA_OUTSIZE; // the one leaf is the file's hash
+  if (m_db_tree[x] == FILEDB_NOSTR) return NULL;
+  return (unsigned char *)m_trees.buf+m_db_tree[x];
+}
+
+int C_FileDB::HashStep(int maxtime, unsigned int maxsize)
+{
+  unsigned int endt=GetTickCount()+maxtime;
+  if (!m_db_shaok || m_scan_stack) return 0;
+  while (GetTickCount() < endt)
+  {
+    if (!m_hash_fp)
+    {
+      while (m_hash_pos < m_database_used &&
+             (m_db_shaok[m_hash_pos] || m_db_length_high[m_hash_pos] || (unsigned int)m_db_length_low[m_hash_pos] >= maxsize))
+        m_hash_pos++;
+      if (m_hash_pos >= m_database_used) return 0;
+
+      char fn[2048];
+      sprintf(fn,"%s%c%s",dir_name(m_db_dir[m_hash_pos]),DIRCHAR,db_file(m_hash_pos));
+      m_hash_fp=fopen(fn,"rb");
+      if (!m_hash_fp)
+      {
+        m_hash_pos++;
+        continue;
+      }
+      m_hash_ctx.reset();
+      m_hash_tree.reset();
+    }
+
+    unsigned char buf[32768];
+    int l=fread(buf,1,sizeof(buf),m_hash_fp);
+    if (l > 0)
+    {
+      m_hash_ctx.add(buf,l);
+      m_hash_tree.add(buf,l);
+      continue;
+    }
+
+    // only keep it if the file is still what we scanned
+    int ok=0;
+#ifdef _WIN32
+    ok = ftell(m_hash_fp) == m_db_length_low[m_hash_pos];
+#else
+    struct stat st;
+    ok = !fstat(fileno(m_hash_fp),&st) && st.st_size == m_db_length_low[m_hash_pos] && st.st_mtime == m_db_time[m_hash_pos];
+#endif
+    if (ok)
+    {
+      m_hash_ctx.final(m_db_sha+m_hash_pos*SHA_OUTSIZE);
+      m_db_shaok[m_hash_pos]=1;
+      unsigned char *leaves;
+      int n=m_hash_tree.final(&leaves);
+      if (n > 1 && n == FileTree_NumLeaves(m_db_length_low[m_hash_pos],m_db_length_high[m_hash_pos]))
+        m_db_tree[m_hash_pos]=arena_add(&m_trees,(char *)leaves,n*SHA_OUTSIZE);
+      free(leaves);
+    }
+    fclose(m_hash_fp);
+    m_hash_fp=NULL;
+    m_hash_pos++;
+  }
+  return 1;
+}
+
 // Get file by array position (0 to GetNumFiles()-1) instead of v_index
 int C_FileDB::GetFileByPosition(int pos, char *file, char *meta, int *length_low, int *length_high, int *v_index)
 {
   if (pos < 0 || pos >= m_database_used) return 1;
 
-  if (file) sprintf(file,"%s%c%s",m_dir_index[m_database[pos].dir_index].dirname,DIRCHAR,m_database[pos].file);
+  if (file) sprintf(file,"%s%c%s",dir_name(m_db_dir[pos]),DIRCHAR,db_file(pos));
   if (meta)
   {
-    if (m_database[pos].meta) strcpy(meta,m_database[pos].meta);
+    if (db_meta(pos)) strcpy(meta,db_meta(pos));
     else meta[0]=0;
   }
-  if (length_low) *length_low=m_database[pos].length_low;
-  if (length_high) *length_high=m_database[pos].length_high;
-  if (v_index) *v_index=m_database[pos].v_index;
+  if (length_low) *length_low=m_db_length_low[pos];
+  if (length_high) *length_high=m_db_length_high[pos];
+  if (v_index) *v_index=m_db_vindex[pos];
   return 0;
 }
 
@@ -764,38 +1060,45 @@ int C_FileDB::DoScan(int maxtime, C_FileDB *oldDB)
               {
                 alloc_dir_index();
                 s.dir_index=m_dir_index_used;
-                m_dir_index[m_dir_index_used].dirname=DB_LH_STRDUP(s.cur_path);
-                m_dir_index[m_dir_index_used].base_len=s.base_len;
+                m_dir_name[m_dir_index_used]=add_name(&m_dirstrs,&m_ldirstrs,s.cur_path,strlen(s.cur_path));
+                m_dir_base_len[m_dir_index_used]=s.base_len;
                 m_dir_index_used++;
                 m_oldscan_dirstate=0;
               }
               alloc_entry();
-              m_database[m_database_used].meta=0;
-              m_database[m_database_used].dir_index=s.dir_index;
+              int e=m_database_used;
+              m_db_meta[e]=FILEDB_NOSTR;
+              m_db_shaok[e]=0;
+              m_db_tree[e]=FILEDB_NOSTR;
+              m_db_dir[e]=s.dir_index;
 #ifdef _WIN32
-              m_database[m_database_used].file=DB_LH_STRDUP(d.cFileName);
-              m_database[m_database_used].length_high=d.nFileSizeHigh;
-              m_database[m_database_used].length_low=d.nFileSizeLow;
+              char *fn=d.cFileName;
+              m_db_length_high[e]=d.nFileSizeHigh;
+              m_db_length_low[e]=d.nFileSizeLow;
               
-              m_database[m_database_used].file_time=FileTimeToUnixTime(&d.ftLastWriteTime);
+              m_db_time[e]=FileTimeToUnixTime(&d.ftLastWriteTime);
 #else
-              m_database[m_database_used].file=DB_LH_STRDUP(d->d_name);
-        
+              char *fn=d->d_name;
 
-              m_database[m_database_used].length_high=0; // fucko64 for bsd
+              m_db_length_high[e]=0; // fucko64 for bsd
               {
                 char buf[4096]; 
                 sprintf(buf,"%s/%s",s.cur_path,d->d_name);
                 struct stat s;
                 stat(buf,&s);
-                 m_database[m_database_used].file_time=s.st_mtime;
-                if (!fsize) m_database[m_database_used].length_low=s.st_size;
-                else m_database[m_database_used].length_low=fsize;
+                m_db_time[e]=s.st_mtime;
+                if (!fsize) m_db_length_low[e]=s.st_size;
+                else m_db_length_low[e]=fsize;
               }
 #endif
+              int fnlen=strlen(fn);
+              if (fnlen > 0xFFFF) fnlen=0xFFFF;
+              m_db_name[e]=add_name(&m_names,&m_lnames,fn,fnlen);
+              m_db_namelen[e]=fnlen;
+              if (m_db_name[e] == FILEDB_NOSTR || m_dir_name[s.dir_index] == FILEDB_NOSTR) continue; // out of memory
                               
-              if (m_database[m_database_used].file_time > m_database_newesttime) 
-                m_database_newesttime=m_database[m_database_used].file_time;
+              if (m_db_time[e] > m_database_newesttime) 
+                m_database_newesttime=m_db_time[e];
 
               int needidx=1;
               int needmeta=1;
@@ -803,62 +1106,35 @@ int C_FileDB::DoScan(int maxtime, C_FileDB *oldDB)
               if (oldDB)
               {
                 if (!m_oldscan_dirstate)
-                // search for our directory
+                // look up our directory
                 {
-                  int x;
-                  int v=m_oldscan_lastdirpos;
-                  int lastidx=0x7FFFFFFF;
-                  m_oldscan_dirstate=1;
-
-                  for (x = 0; x < oldDB->m_database_used; x ++)
-                  {
-                    int thisidx=oldDB->m_database[v].dir_index;
-                    if (thisidx != lastidx) 
-                    {
-                      lastidx=thisidx;
-                      if (!strcmp(
-                            oldDB->m_dir_index[thisidx].dirname,
-                            m_dir_index[m_database[m_database_used].dir_index].dirname)
-                          )
-                      {
-                        m_oldscan_dirstate=2;
-                        m_oldscan_lastdirpos=v;
-                        break;
-                      }
-                    }
-                    v++;
-                    if (v == oldDB->m_database_used) v=0;
-                  }
+                  m_oldscan_dir=oldDB->findDir(dir_name(s.dir_index));
+                  m_oldscan_dirstate=m_oldscan_dir >= 0 ? 2 : 1;
                 }
 
                 if (m_oldscan_dirstate==2)
                 {
-                  int pos;
-                  int lastidx=oldDB->m_database[m_oldscan_lastdirpos].dir_index;
-                  for (pos = 0; pos < oldDB->m_database_used; pos ++)
+                  int a=oldDB->findFile(m_oldscan_dir,db_file(e),fnlen);
+                  if (a >= 0 &&
+                      m_db_length_low[e] == oldDB->m_db_length_low[a] && m_db_length_high[e] == oldDB->m_db_length_high[a] &&
+                      m_db_time[e] == oldDB->m_db_time[a])
                   {
-                    int a=pos+m_oldscan_lastdirpos;
-                    if (a > oldDB->m_database_used) break;
-
-                    dbType *dbp=oldDB->m_database+a;
-                    if (lastidx != dbp->dir_index) break;
-
-                    if (!strcmp(m_database[m_database_used].file,dbp->file))
+                    if (m_use_oldidx)
+                    {
+                      m_db_vindex[e]=oldDB->m_db_vindex[a];
+                      needidx=0;
+                    }
+                    //debug_printf("got cached metadata for '%s'='%s'\n",db_file(e),oldDB->db_meta(a));
+                    char *om=oldDB->db_meta(a);
+                    if (om) m_db_meta[e]=arena_add(&m_metas,om,strlen(om));
+                    needmeta=0;
+                    if (oldDB->m_db_shaok && oldDB->m_db_shaok[a])
                     {
-                      if (m_database[m_database_used].length_low == dbp->length_low && m_database[m_database_used].length_high == dbp->length_high &&
-                          m_database[m_database_used].file_time == dbp->file_time)
-                      {
-                        if (m_use_oldidx)
-                        {
-                          m_database[m_database_used].v_index=dbp->v_index;
-                          needidx=0;
-                        }
-                        //debug_printf("got cached metadata for '%s'='%s'\n",m_database[m_database_used].file,dbp->meta);
-                        if (dbp->meta) m_database[m_database_used].meta=DB_LH_STRDUP(dbp->meta);
-                        needmeta=0;
-                      }
-                      m_oldscan_lastpos=a+1;
-                      break;
+                      memcpy(m_db_sha+e*SHA_OUTSIZE,oldDB->m_db_sha+a*SHA_OUTSIZE,SHA_OUTSIZE);
+                      m_db_shaok[e]=1;
+                      if (oldDB->m_db_tree[a] != FILEDB_NOSTR)
+                        m_db_tree[e]=arena_add(&m_trees,oldDB->m_trees.buf+oldDB->m_db_tree[a],
+                                               FileTree_NumLeaves(m_db_length_low[e],m_db_length_high[e])*SHA_OUTSIZE);
                     }
                   }
                 }
@@ -866,51 +1142,48 @@ int C_FileDB::DoScan(int maxtime, C_FileDB *oldDB)
 
               if (needmeta) 
               {
-#ifdef _WIN32
-                char *t=extension(d.cFileName);
-#else
-                char *t=extension(d->d_name);
-#endif
+                char *t=extension(fn);
                 int ismp3=!stricmp(t,"mp3") || !stricmp(t,"mp2") || !stricmp(t,"mp1");
                 int isjpg=!stricmp(t,"jpg")||!stricmp(t,"jpeg")|!stricmp(t,"jfif");
                 if (ismp3||isjpg)
                 {
                   char str[1024];
 #ifdef _WIN32
-                  ::sprintf(str,"%s\\%s",s.cur_path,d.cFileName);
+                  ::sprintf(str,"%s\\%s",s.cur_path,fn);
                   HANDLE hf=::CreateFile(str,GENERIC_READ,FILE_SHARE_READ,NULL,OPEN_EXISTING,0,NULL);
                   if (hf != INVALID_HANDLE_VALUE)
 #else
-                  ::sprintf(str,"%s/%s",s.cur_path,d->d_name);
+                  ::sprintf(str,"%s/%s",s.cur_path,fn);
                   FILE *hf=fopen(str,"rb");
                   if (hf)
 #endif
                   {
                     char mbuf[256];
-                    if (ismp3) mp3_getmetainfo(hf,mbuf,m_database[m_database_used].length_low);
-                    else if (isjpg) jpg_getmetainfo(hf,mbuf,m_database[m_database_used].length_low);
+                    mbuf[0]=0;
+                    if (ismp3) mp3_getmetainfo(hf,mbuf,m_db_length_low[e]);
+                    else if (isjpg) jpg_getmetainfo(hf,mbuf,m_db_length_low[e]);
                     mbuf[63]=0;
-                    if (mbuf[0]) m_database[m_database_used].meta=DB_LH_STRDUP(mbuf);
+                    if (mbuf[0]) m_db_meta[e]=arena_add(&m_metas,mbuf,strlen(mbuf));
 #ifdef _WIN32
                     CloseHandle(hf);
 #else
                     fclose(hf);
 #endif
                   }
-                  //debug_printf("read metadata for '%s'='%s'\n",m_database[m_database_used].file,m_database[m_database_used].meta);
+                  //debug_printf("read metadata for '%s'='%s'\n",db_file(e),db_meta(e));
                 }
               }
               if (needidx)
               {
-                m_database[m_database_used].v_index=m_scanidx_gpos++;
+                m_db_vindex[e]=m_scanidx_gpos++;
               }
 
               int o=m_database_xbytes;
-              m_database_xbytes+=m_database[m_database_used].length_low&0xFFFFF;
+              m_database_xbytes+=m_db_length_low[e]&0xFFFFF;
               m_database_xbytes &= 0xFFFFF;
               if (m_database_xbytes < 0) m_database_mb++;
 
-              m_database_mb+=(m_database[m_database_used].length_high*4096) + (m_database[m_database_used].length_low>>20);
+              m_database_mb+=(m_db_length_high[e]*4096) + (m_db_length_low[e]>>20);
 
               m_database_used++;
             }
@@ -1203,72 +1476,171 @@ void C_FileDB::mp3_getmetainfo(FILE *fp,char *meta, int filelen)
 }
 
 
-void C_FileDB::writeOut(char *fn)
+// share database file format
+//
+// the old format (FILEDB_MAGIC_LEGACY) was a pile of fixed width records (a 1028
+// byte record per directory, a 340ish byte record per file), which we had to
+// fread and strdup one by one.  It is still understood by readIn() so old
+// .pr2 files migrate on the next writeOut().
+//
+// the current format is a header, a section table, and sections that are
+// the in-memory tables and string arenas verbatim (strings are offsets into
+// the arenas).  readIn() maps the file and points the tables into it.
+// all values are host order, sections are 8 byte aligned, unknown sections
+// are skipped.
+
+#define FILEDB_MAGIC_LEGACY 0xDBDBF11B
+#define FILEDB_MAGIC        0xDBDBF12C
+#define FILEDB_VERSION      1
+
+// sections, one per table / arena
+#define FILEDB_SECT_DNAM 0x4D414E44 // 'DNAM' unsigned int[num_dirs]
+#define FILEDB_SECT_DBAS 0x53414244 // 'DBAS' int[num_dirs]
+#define FILEDB_SECT_ENAM 0x4D414E45 // 'ENAM' unsigned int[num_entries]
+#define FILEDB_SECT_ELEN 0x4E454C45 // 'ELEN' unsigned short[num_entries]
+#define FILEDB_SECT_EDIR 0x52494445 // 'EDIR' int[num_entries]
+#define FILEDB_SECT_EMET 0x54454D45 // 'EMET' unsigned int[num_entries]
+#define FILEDB_SECT_ELLO 0x4F4C4C45 // 'ELLO' int[num_entries]
+#define FILEDB_SECT_ELHI 0x49484C45 // 'ELHI' int[num_entries]
+#define FILEDB_SECT_ETIM 0x4D495445 // 'ETIM' int[num_entries]
+#define FILEDB_SECT_EVIX 0x58495645 // 'EVIX' int[num_entries]
+#define FILEDB_SECT_DSTR 0x52545344 // 'DSTR' directory names
+#define FILEDB_SECT_LDST 0x5453444C // 'LDST' lowercased DSTR (search index)
+#define FILEDB_SECT_NSTR 0x5254534E // 'NSTR' file names
+#define FILEDB_SECT_LNST 0x54534E4C // 'LNST' lowercased NSTR (search index)
+#define FILEDB_SECT_MSTR 0x5254534D // 'MSTR' metadata
+#define FILEDB_SECT_ESHA 0x41485345 // 'ESHA' unsigned char[num_entries][SHA_OUTSIZE]
+#define FILEDB_SECT_ESHV 0x56485345 // 'ESHV' unsigned char[num_entries], ESHA valid
+#define FILEDB_SECT_ETRO 0x4F525445 // 'ETRO' unsigned int[num_entries], into TREE
+#define FILEDB_SECT_TREE 0x45455254 // 'TREE' hash tree leaves
+#define FILEDB_MAX_SECTS 32
+
+#define FILEDB_ALIGN(x) (((x)+7)&~7)
+
+typedef struct
 {
-  struct
+  unsigned int magic;
+  unsigned int version;
+  unsigned int file_len;
+  unsigned int num_sections;
+  int database_mb;
+  int database_xbytes;
+  int database_newesttime;
+  int scanidx_gpos;
+  int num_dirs;
+  int num_entries;
+} dbFileHdr;
+
+typedef struct
+{
+  unsigned int tag;
+  unsigned int offset;
+  unsigned int length;
+  unsigned int reserved;
+} dbFileSect;
+
+void C_FileDB::unmapDB()
+{
+  if (m_map)
   {
 #ifdef _WIN32
-    char file[MAX_PATH];
+    DB_LH_FREE(m_map);
 #else
-    char file[256];
+    munmap(m_map,m_map_len);
 #endif
-    char meta[64];
-    int dir_index;
-    int length_low;
-    int length_high;
-    int file_time;
-    int v_index;
-  } db;
+  }
+  m_map=NULL;
+  m_map_len=0;
+}
+
+void C_FileDB::writeOut(char *fn)
+{
   struct
   {
-    char dirname[1024];
-    int base_len;
-  } di;
+    unsigned int tag;
+    void *data;
+    unsigned int len;
+  } out[]=
+  {
+    { FILEDB_SECT_DNAM, m_dir_name, (unsigned int)(m_dir_index_used*sizeof(unsigned int)) },
+    { FILEDB_SECT_DBAS, m_dir_base_len, (unsigned int)(m_dir_index_used*sizeof(int)) },
+    { FILEDB_SECT_ENAM, m_db_name, (unsigned int)(m_database_used*sizeof(unsigned int)) },
+    { FILEDB_SECT_ELEN, m_db_namelen, (unsigned int)(m_database_used*sizeof(unsigned short)) },
+    { FILEDB_SECT_EDIR, m_db_dir, (unsigned int)(m_database_used*sizeof(int)) },
+    { FILEDB_SECT_EMET, m_db_meta, (unsigned int)(m_database_used*sizeof(unsigned int)) },
+    { FILEDB_SECT_ELLO, m_db_length_low, (unsigned int)(m_database_used*sizeof(int)) },
+    { FILEDB_SECT_ELHI, m_db_length_high, (unsigned int)(m_database_used*sizeof(int)) },
+    { FILEDB_SECT_ETIM, m_db_time, (unsigned int)(m_database_used*sizeof(int)) },
+    { FILEDB_SECT_EVIX, m_db_vindex, (unsigned int)(m_database_used*sizeof(int)) },
+    { FILEDB_SECT_DSTR, m_dirstrs.buf, m_dirstrs.used },
+    { FILEDB_SECT_LDST, m_ldirstrs.buf, m_ldirstrs.used },
+    { FILEDB_SECT_NSTR, m_names.buf, m_names.used },
+    { FILEDB_SECT_LNST, m_lnames.buf, m_lnames.used },
+    { FILEDB_SECT_MSTR, m_metas.buf, m_metas.used },
+    { FILEDB_SECT_ESHA, m_db_sha, (unsigned int)(m_database_used*SHA_OUTSIZE) },
+    { FILEDB_SECT_ESHV, m_db_shaok, (unsigned int)m_database_used },
+    { FILEDB_SECT_ETRO, m_db_tree, (unsigned int)(m_database_used*sizeof(unsigned int)) },
+    { FILEDB_SECT_TREE, m_trees.buf, m_trees.used },
+  };
+  const int nsect=sizeof(out)/sizeof(out[0]);
+  dbFileHdr hdr;
+  dbFileSect sect[nsect];
+  int x;
 
-  FILE *fp=fopen(fn,"wb");
-  if (fp)
+  memset(&hdr,0,sizeof(hdr));
+  memset(sect,0,sizeof(sect));
+  hdr.magic=FILEDB_MAGIC;
+  hdr.version=FILEDB_VERSION;
+  hdr.num_sections=nsect;
+  hdr.database_mb=m_database_mb;
+  hdr.database_xbytes=m_database_xbytes;
+  hdr.database_newesttime=m_database_newesttime;
+  hdr.scanidx_gpos=m_scanidx_gpos;
+  hdr.num_dirs=m_dir_index_used;
+  hdr.num_entries=m_database_used;
+
+  unsigned int offs=FILEDB_ALIGN(sizeof(hdr)+sizeof(sect));
+  for (x = 0; x < nsect; x ++)
   {
-    unsigned int d=0xDBDBF11B;
-    fwrite(&d,1,4,fp);
-    d=4 + 4 + 4 + 4 + 4 + 4 + sizeof(db)*m_database_used + sizeof(di) * m_dir_index_used;
-    fwrite(&d,1,4,fp);
-    fwrite(&m_database_mb,1,4,fp);
-    fwrite(&m_database_xbytes,1,4,fp);
-    fwrite(&m_database_newesttime,1,4,fp);
-    fwrite(&m_dir_index_used,1,4,fp);
-    fwrite(&m_scanidx_gpos,1,4,fp);    
-    if (m_dir_index && m_dir_index_used) 
-    {
-      int x;
-      for (x = 0; x < m_dir_index_used; x ++)
-      {
-        safe_strncpy(di.dirname,m_dir_index[x].dirname,sizeof(di.dirname));
-        di.base_len=m_dir_index[x].base_len;
-        fwrite(&di,sizeof(di),1,fp);
-      }
-    }
-    fwrite(&m_database_used,1,4,fp);
-    if (m_database && m_database_used) 
-    {
-       int x;
-       for (x = 0; x < m_database_used; x ++)
-       {
-         safe_strncpy(db.file,m_database[x].file,sizeof(db.file));
-         memset(db.meta,0,sizeof(db.meta));
-         if (m_database[x].meta) safe_strncpy(db.meta,m_database[x].meta,sizeof(db.meta));
-         db.dir_index=m_database[x].dir_index;
-         db.length_low=m_database[x].length_low;
-         db.length_high=m_database[x].length_high;
-         db.file_time=m_database[x].file_time;
-         db.v_index=m_database[x].v_index;
-         fwrite(&db,sizeof(db),1,fp);
-       }
-    }
-    fclose(fp);
+    sect[x].tag=out[x].tag;
+    sect[x].offset=offs;
+    sect[x].length=out[x].len;
+    offs=FILEDB_ALIGN(offs+out[x].len);
+  }
+  hdr.file_len=offs;
+
+  // write to a temp file and rename it over, since we may be writing out
+  // the very file that is currently mapped by readIn().
+  char tmpfn[1024+16];
+  sprintf(tmpfn,"%s.tmp",fn);
+  FILE *fp=fopen(tmpfn,"wb");
+  if (!fp) return;
+
+  static const char zeros[8]={0,};
+  fwrite(&hdr,1,sizeof(hdr),fp);
+  fwrite(sect,1,sizeof(sect),fp);
+  fwrite(zeros,1,sect[0].offset-sizeof(hdr)-sizeof(sect),fp);
+  for (x = 0; x < nsect; x ++)
+  {
+    if (out[x].len) fwrite(out[x].data,1,out[x].len,fp);
+    if (out[x].len&7) fwrite(zeros,1,8-(out[x].len&7),fp);
   }
+
+  int err=ferror(fp);
+  if (fclose(fp) || err)
+  {
+    DeleteFile(tmpfn);
+    return;
+  }
+#ifdef _WIN32
+  DeleteFile(fn);
+  MoveFile(tmpfn,fn);
+#else
+  if (rename(tmpfn,fn)) DeleteFile(tmpfn);
+#endif
 }
 
-int C_FileDB::readIn(char *fn)
+int C_FileDB::readInLegacy(FILE *fp, int flen)
 {
   struct
   {
@@ -1290,67 +1662,225 @@ int C_FileDB::readIn(char *fn)
     int base_len;
   } di;
 
+  unsigned int len;
+  if (fread(&len,1,4,fp) != 4 || len+8 != (unsigned int)flen) return 0;
+
+  int ndirs=0, nents=0;
+  fread(&m_database_mb,1,4,fp);
+  fread(&m_database_xbytes,1,4,fp);
+  fread(&m_database_newesttime,1,4,fp);
+  fread(&ndirs,1,4,fp);
+  fread(&m_scanidx_gpos,1,4,fp);
+
+  if (ndirs <= 0) return 0;
+  int x;
+  for (x = 0; x < ndirs; x ++)
+  {
+    if (fread(&di,sizeof(di),1,fp) != 1) return 0;
+    di.dirname[sizeof(di.dirname)-1]=0;
+    alloc_dir_index();
+    m_dir_name[x]=add_name(&m_dirstrs,&m_ldirstrs,di.dirname,strlen(di.dirname));
+    m_dir_base_len[x]=di.base_len;
+    m_dir_index_used++;
+  }
+  fread(&nents,1,4,fp);
+  if (nents <= 0) return 0;
+  for (x = 0; x < nents; x ++)
+  {
+    if (fread(&db,sizeof(db),1,fp) != 1) return 0;
+    db.file[sizeof(db.file)-1]=0;
+    db.meta[sizeof(db.meta)-1]=0;
+    if (db.dir_index < 0 || db.dir_index >= ndirs) return 0;
+    alloc_entry();
+    m_db_namelen[x]=strlen(db.file);
+    m_db_name[x]=add_name(&m_names,&m_lnames,db.file,m_db_namelen[x]);
+    m_db_meta[x]=db.meta[0]?arena_add(&m_metas,db.meta,strlen(db.meta)):FILEDB_NOSTR;
+    m_db_dir[x]=db.dir_index;
+    m_db_vindex[x]=db.v_index;
+    m_db_length_low[x]=db.length_low;
+    m_db_length_high[x]=db.length_high;
+    m_db_time[x]=db.file_time;
+    m_db_shaok[x]=0;
+    m_db_tree[x]=FILEDB_NOSTR;
+    m_database_used++;
+  }
+  return 1;
+}
+
+static char *readInFindSect(char *map, unsigned int tag, unsigned int minlen, unsigned int *len=NULL)
+{
+  dbFileHdr *hdr=(dbFileHdr *)map;
+  dbFileSect *sect=(dbFileSect *)(hdr+1);
+  unsigned int x;
+  for (x = 0; x < hdr->num_sections; x ++)
+  {
+    if (sect[x].tag == tag && sect[x].length >= minlen)
+    {
+      if (len) *len=sect[x].length;
+      return map+sect[x].offset;
+    }
+  }
+  return NULL;
+}
+
+// points an arena at section tag of the map, which must be nul terminated
+int C_FileDB::readInArena(unsigned int tag, StrArena *a)
+{
+  unsigned int len=0;
+  char *p=readInFindSect(m_map,tag,0,&len);
+  if (!p) return 1;
+  if (len && p[len-1]) return 1;
+  a->buf=len ? p : NULL;
+  a->used=len;
+  a->size=0;
+  return 0;
+}
+
+int C_FileDB::readIn(char *fn)
+{
+  clearDBs();
+
   FILE *fp=fopen(fn,"rb");
+  if (!fp) return 0;
 
-  if (fp)
+  fseek(fp,0,SEEK_END);
+  int flen=ftell(fp);
+  fseek(fp,0,SEEK_SET);
+  unsigned int d=0;
+  fread(&d,1,4,fp);
+
+  if (d == FILEDB_MAGIC_LEGACY)
+  {
+    int ret=readInLegacy(fp,flen);
+    fclose(fp);
+    if (!ret) clearDBs();
+    return ret;
+  }
+  if (d != FILEDB_MAGIC || flen < (int)sizeof(dbFileHdr))
   {
-    fseek(fp,0,SEEK_END);
-    int flen=ftell(fp);
+    fclose(fp);
+    return 0;
+  }
+
+#ifdef _WIN32
+  m_map=(char *)DB_LH_ALLOC(flen);
+  if (m_map)
+  {
+    m_map_len=flen;
     fseek(fp,0,SEEK_SET);
-    unsigned int d;
-    
+    if (fread(m_map,1,flen,fp) != (size_t)flen) unmapDB();
+  }
+  fclose(fp);
+#else
+  m_map=(char *)mmap(NULL,flen,PROT_READ,MAP_SHARED,fileno(fp),0);
+  fclose(fp);
+  if (m_map == (char *)MAP_FAILED) m_map=NULL;
+  else m_map_len=flen;
+#endif
+  if (!m_map) return 0;
+
+  dbFileHdr *hdr=(dbFileHdr *)m_map;
+  dbFileSect *sect=(dbFileSect *)(hdr+1);
+  unsigned int x;
+
+  if (hdr->version != FILEDB_VERSION || hdr->file_len != m_map_len ||
+      hdr->num_sections > FILEDB_MAX_SECTS ||
+      sizeof(dbFileHdr)+hdr->num_sections*sizeof(dbFileSect) > m_map_len ||
+      hdr->num_dirs < 0 || hdr->num_entries < 0 ||
+      (unsigned int)hdr->num_dirs > m_map_len/sizeof(int) ||
+      (unsigned int)hdr->num_entries > m_map_len/sizeof(unsigned short))
+  {
     clearDBs();
+    return 0;
+  }
+  for (x = 0; x < hdr->num_sections; x ++)
+  {
+    if (sect[x].offset > m_map_len || sect[x].length > m_map_len - sect[x].offset || (sect[x].offset&7))
+    {
+      clearDBs();
+      return 0;
+    }
+  }
+
+  // point the tables straight into the map
+  unsigned int nd=hdr->num_dirs, ne=hdr->num_entries;
+  m_dir_name=(unsigned int *)readInFindSect(m_map,FILEDB_SECT_DNAM,nd*sizeof(unsigned int));
+  m_dir_base_len=(int *)readInFindSect(m_map,FILEDB_SECT_DBAS,nd*sizeof(int));
+  m_db_name=(unsigned int *)readInFindSect(m_map,FILEDB_SECT_ENAM,ne*sizeof(unsigned int));
+  m_db_namelen=(unsigned short *)readInFindSect(m_map,FILEDB_SECT_ELEN,ne*sizeof(unsigned short));
+  m_db_dir=(int *)readInFindSect(m_map,FILEDB_SECT_EDIR,ne*sizeof(int));
+  m_db_meta=(unsigned int *)readInFindSect(m_map,FILEDB_SECT_EMET,ne*sizeof(unsigned int));
+  m_db_length_low=(int *)readInFindSect(m_map,FILEDB_SECT_ELLO,ne*sizeof(int));
+  m_db_length_high=(int *)readInFindSect(m_map,FILEDB_SECT_ELHI,ne*sizeof(int));
+  m_db_time=(int *)readInFindSect(m_map,FILEDB_SECT_ETIM,ne*sizeof(int));
+  m_db_vindex=(int *)readInFindSect(m_map,FILEDB_SECT_EVIX,ne*sizeof(int));
+  int bad = !m_dir_name || !m_dir_base_len || !m_db_name || !m_db_namelen || !m_db_dir ||
+            !m_db_meta || !m_db_length_low || !m_db_length_high || !m_db_time || !m_db_vindex ||
+            readInArena(FILEDB_SECT_DSTR,&m_dirstrs) ||
+            readInArena(FILEDB_SECT_NSTR,&m_names) ||
+            readInArena(FILEDB_SECT_MSTR,&m_metas);
+  
+  // the lowercase copies are only an index, rebuild them if they're missing
+  if (!bad && (readInArena(FILEDB_SECT_LDST,&m_ldirstrs) || m_ldirstrs.used != m_dirstrs.used))
+    bad=arena_lowercase(&m_ldirstrs,&m_dirstrs);
+  if (!bad && (readInArena(FILEDB_SECT_LNST,&m_lnames) || m_lnames.used != m_names.used))
+    bad=arena_lowercase(&m_lnames,&m_names);
+
+  for (x = 0; x < nd && !bad; x ++)
+    if (m_dir_name[x] >= m_dirstrs.used) bad=1;
+  for (x = 0; x < ne && !bad; x ++)
+  {
+    if (m_db_name[x] >= m_names.used || m_db_namelen[x] >= m_names.used - m_db_name[x] ||
+        m_names.buf[m_db_name[x]+m_db_namelen[x]] ||
+        (m_db_meta[x] != FILEDB_NOSTR && m_db_meta[x] >= m_metas.used) ||
+        m_db_dir[x] < 0 || m_db_dir[x] >= (int)nd) bad=1;
+  }
 
-    if (fread(&d,1,4,fp) == 4 && d == 0xDBDBF11B)
+  // the hash cache gets filled in as we go, so it can't live in the map
+  if (!bad && ne)
+  {
+    m_db_sha=(unsigned char *)DB_LH_ALLOC(ne*SHA_OUTSIZE);
+    m_db_shaok=(unsigned char *)DB_LH_ALLOC(ne);
+    m_db_tree=(unsigned int *)DB_LH_ALLOC(ne*sizeof(unsigned int));
+    if (!m_db_sha || !m_db_shaok || !m_db_tree) bad=1;
+    else
     {
-      unsigned int len;
-      if (fread(&len,1,4,fp) == 4 && len+8 == (unsigned int)flen)
+      unsigned char *sha=(unsigned char *)readInFindSect(m_map,FILEDB_SECT_ESHA,ne*SHA_OUTSIZE);
+      unsigned char *shaok=(unsigned char *)readInFindSect(m_map,FILEDB_SECT_ESHV,ne);
+      if (sha && shaok)
       {
-        fread(&m_database_mb,1,4,fp);
-        fread(&m_database_xbytes,1,4,fp);
-        fread(&m_database_newesttime,1,4,fp);
-        fread(&m_dir_index_used,1,4,fp);
-        fread(&m_scanidx_gpos,1,4,fp);
-
-        if (m_dir_index_used)
+        memcpy(m_db_sha,sha,ne*SHA_OUTSIZE);
+        memcpy(m_db_shaok,shaok,ne);
+      }
+      else memset(m_db_shaok,0,ne);
+
+      // trees are only kept for hashes we have, and must fit in the arena
+      unsigned int tlen=0;
+      unsigned int *tree=(unsigned int *)readInFindSect(m_map,FILEDB_SECT_ETRO,ne*sizeof(unsigned int));
+      char *trees=readInFindSect(m_map,FILEDB_SECT_TREE,0,&tlen);
+      if (!tree || !trees || !tlen || arena_add(&m_trees,trees,tlen-1) != 0) tree=NULL;
+      for (x = 0; x < ne; x ++)
+      {
+        m_db_tree[x]=FILEDB_NOSTR;
+        if (tree && tree[x] != FILEDB_NOSTR && m_db_shaok[x])
         {
-          alloc_dir_index();
-          if (m_dir_index)
-          {
-            int x;
-            for (x = 0; x < m_dir_index_used; x ++)
-            {
-              fread(&di,sizeof(di),1,fp);
-              m_dir_index[x].dirname=DB_LH_STRDUP(di.dirname);
-              m_dir_index[x].base_len=di.base_len;
-            }
-            fread(&m_database_used,1,4,fp);
-            if (m_database_used)
-            {
-              alloc_entry();        
-              if (m_database)
-              {
-                int x; 
-                for (x = 0; x < m_database_used; x ++)
-                {
-                  fread(&db,sizeof(db),1,fp);
-                  m_database[x].file=DB_LH_STRDUP(db.file);
-                  m_database[x].meta=db.meta[0]?DB_LH_STRDUP(db.meta):0;
-                  m_database[x].dir_index=db.dir_index;
-                  m_database[x].v_index=db.v_index;
-                  m_database[x].length_low=db.length_low;
-                  m_database[x].length_high=db.length_high;
-                  m_database[x].file_time=db.file_time;
-                }
-                fclose(fp);
-                return 1;
-              }
-            }
-          }
+          unsigned int l=FileTree_NumLeaves(m_db_length_low[x],m_db_length_high[x])*SHA_OUTSIZE;
+          if (tree[x] < tlen && l < tlen - tree[x]) m_db_tree[x]=tree[x];
         }
       }
     }
-    fclose(fp);
   }
-  return 0;
+  if (bad)
+  {
+    clearDBs();
+    return 0;
+  }
+  m_dir_index_used=nd;
+  m_database_used=ne;
+
+  m_database_mb=hdr->database_mb;
+  m_database_xbytes=hdr->database_xbytes;
+  m_database_newesttime=hdr->database_newesttime;
+  m_scanidx_gpos=hdr->scanidx_gpos;
+  return 1;
 }
@@ -22,8 +22,10 @@
 
 #include "mqueuelist.h"
 #include "m_search.h"
+#include "m_file.h"
 #include "itemstack.h"
 #include "itemlist.h"
+#include "sha.h"
 
 #ifndef _WIN32
 #include <sys/types.h>
@@ -49,6 +51,15 @@ class C_FileDB
     int GetNumMB(void) { return m_database_mb; }
     int GetLatestTime() { return m_database_newesttime; }
 
+    // content hash cache. an entry's hash is only good for the size and
+    // modification time it was computed at, GetFileHash() returns those too.
+    int GetFileHash(int index, int *length_low, int *length_high, int *file_time, unsigned char *hash); // 0 if found
+    void SetFileHash(int index, int length_low, int length_high, int file_time, unsigned char *hash,
+                     unsigned char *leaves=NULL, int nleaves=0);
+    // hash tree leaves that go with the hash above, NULL if we don't have them
+    unsigned char *GetFileTree(int index, int *nleaves);
+    int HashStep(int maxtime, unsigned int maxsize); // hashes unhashed files in the background, returns 0 when there are none left
+
     void writeOut(char *fn);
     int readIn(char *fn);
 
@@ -63,19 +74,18 @@ class C_FileDB
     static void parselist(char *out, char *in);
     static inline int in_string(char *string, char *substring);
     static int substr_search(char *bigtext1, char *bigtext2, char *littletext_list);
+    static int substr_search_lc(char *bigtext1, char *bigtext2, char *littletext_list);
 
   protected:
     void clearDBs();
 
+    // strings live in arenas and are referred to by offset.  an arena with
+    // size==0 does not own buf (it points into m_map).
     typedef struct
     {
-      char *file;//[MAX_PATH];
-      char *meta;//[64];
-      int dir_index;
-      int length_low, length_high;
-      int file_time; // unix time format
-      int v_index;
-    } dbType;
+      char *buf;
+      unsigned int used, size;
+    } StrArena;
     typedef struct
     {
 #ifdef _WIN32
@@ -87,25 +97,71 @@ class C_FileDB
       int base_len;
       char cur_path[1024];
     } ScanType;
-    typedef struct
-    {
-      char *dirname;//[1024];
-      int base_len;
-    } DirIndexType;
 
+    unsigned int arena_add(StrArena *a, char *str, int len);
+    void arena_free(StrArena *a);
+    int arena_lowercase(StrArena *out, StrArena *in);
+    unsigned int add_name(StrArena *a, StrArena *lc_a, char *str, int len);
+
+    char *db_file(int x) { return m_names.buf+m_db_name[x]; }
+    char *db_meta(int x) { return m_db_meta[x]==0xFFFFFFFF ? (char*)NULL : m_metas.buf+m_db_meta[x]; }
+    char *dir_name(int d) { return m_dirstrs.buf+m_dir_name[d]; }
 
     C_ItemStack<ScanType> *m_scan_stack;
-    DirIndexType *m_dir_index;
-    int m_dir_index_size,m_dir_index_used;
+
+    // directory table
+    unsigned int *m_dir_name; // into m_dirstrs / m_ldirstrs
+    int *m_dir_base_len;
+    int m_dir_index_size,m_dir_index_used; // size==0: tables are in m_map
     void alloc_dir_index(void);
 
-    dbType *m_database;
-    int m_database_used,m_database_size;
+    // file table, one array per field.  Search() walks the first three.
+    unsigned int *m_db_name; // into m_names / m_lnames
+    unsigned short *m_db_namelen;
+    int *m_db_dir;
+    unsigned int *m_db_meta; // into m_metas, or 0xFFFFFFFF
+    int *m_db_length_low, *m_db_length_high;
+    int *m_db_time; // unix time format
+    int *m_db_vindex;
+    unsigned char *m_db_sha; // SHA_OUTSIZE per entry, always heap (not mapped)
+    unsigned char *m_db_shaok; // m_db_sha[x] is valid
+    unsigned int *m_db_tree; // hash tree leaves for m_db_sha[x], into m_trees, or 0xFFFFFFFF. always heap
+    int m_database_used,m_database_size; // size==0: tables are in m_map
     int m_database_mb;
     int m_database_xbytes; // bytes unaccounted for in _mb
     int m_database_newesttime;
 
-    int m_oldscan_lastpos,m_oldscan_lastdirpos, m_oldscan_dirstate;
+    // m_lnames/m_ldirstrs are lowercased copies of m_names/m_dirstrs at the
+    // same offsets, so searches can compare without folding case.
+    StrArena m_names, m_lnames, m_metas, m_dirstrs, m_ldirstrs;
+    StrArena m_trees; // leaves, SHA_OUTSIZE each. always heap
+
+    int findPos(int index);
+
+    // HashStep() state
+    int m_hash_pos;
+    FILE *m_hash_fp;
+    SHAify m_hash_ctx;
+    C_FileTreeHasher m_hash_tree;
+
+    int m_oldscan_dir, m_oldscan_dirstate; // directory of oldDB we're rescanning
+
+    // name lookups (open addressing, slots hold index+1), built on first use
+    int *m_dirhash, m_dirhash_mask;
+    int *m_filehash, m_filehash_mask;
+    static unsigned int hashstr(char *str, int len);
+    void buildLookup();
+    void freeLookup();
+    int findDir(char *dirname);
+    int findFile(int dir_index, char *name, int namelen);
+
+    // backing store of a database loaded by readIn(), tables and arenas
+    // that point into it are not ours to free or grow.
+    char *m_map;
+    unsigned int m_map_len;
+    void unmapDB();
+    int readInLegacy(FILE *fp, int flen);
+    int readInArena(unsigned int tag, StrArena *a);
 
     int m_scanidx_gpos;
     int m_use_oldidx;
@@ -33,6 +33,7 @@ C_FileSendRequest::C_FileSendRequest()
   memset(m_nick,0,32);
   m_idx=-1;
   m_abort=0;
+  m_caps=0;
 }
 
 
@@ -46,6 +47,7 @@ C_FileSendRequest::C_FileSendRequest(C_SHBuf *in)
   memset(m_nick,0,32);
   m_idx=-1;
   m_abort=0;
+  m_caps=0;
 
   unsigned char *data=(unsigned char *)in->Get();
   int datalen=in->GetLength();
@@ -84,7 +86,7 @@ C_FileSendRequest::C_FileSendRequest(C_SHBuf *in)
   data+=2;
   datalen-=2;
 
-  while (datalen>4 && m_need_chunks_used < FILE_MAX_CHUNKS_PER_REQ)
+  while (datalen>4)
   {
     int offs=data[0]|(data[1]<<8)|(data[2]<<16)|(data[3]<<24);
     int len=(int)data[4]+1;
@@ -97,6 +99,10 @@ C_FileSendRequest::C_FileSendRequest(C_SHBuf *in)
       m_need_chunks_offs[m_need_chunks_used++]=offs++; // rle decompress
     }
   }
+  if (datalen == 4) // caps trailer
+  {
+    m_caps=data[0]|(data[1]<<8)|(data[2]<<16)|(data[3]<<24);
+  }
 }
 
 C_SHBuf *C_FileSendRequest::Make(void)
@@ -112,9 +118,11 @@ C_SHBuf *C_FileSendRequest::Make(void)
     // send dc ip/port (6 bytes, can be 0)
       // if request table
          // send request table
+      // if caps
+         // send caps (4 bytes)
   int x;
   int size=16+16;
-  if (!m_abort) size+=4+SHA_OUTSIZE+31+6+m_need_chunks_indexused*5;
+  if (!m_abort) size+=4+SHA_OUTSIZE+31+6+m_need_chunks_indexused*5+(m_caps?4:0);
   if (m_abort == 2) size++;
 
   C_SHBuf *p=new C_SHBuf(size);
@@ -154,6 +162,13 @@ C_SHBuf *C_FileSendRequest::Make(void)
     data[4]=m_need_chunks_len[x];
     data+=5;
   }
+  if (m_caps)
+  {
+    data[0]=m_caps&0xff; 
+    data[1]=(m_caps>>8)&0xff; 
+    data[2]=(m_caps>>16)&0xff; 
+    data[3]=(m_caps>>24)&0xff; 
+  }
   return p;
 }
 
@@ -194,9 +209,12 @@ C_FileSendReply::C_FileSendReply()
   m_create_date=m_mod_date=0;
   m_chunkcnt=0;
   m_port=m_ip=0;
+  m_caps=0;
+  memset(m_tree_root,0,SHA_OUTSIZE);
 
+  m_data=0;
   m_data_len=0;
-
+  m_data_buf=0;
 }
 
 
@@ -206,12 +224,16 @@ C_FileSendReply::C_FileSendReply(C_SHBuf *in)
 
   m_index=0;
   m_port=m_ip=0;
+  m_caps=0;
+  memset(m_tree_root,0,SHA_OUTSIZE);
 
   m_file_len_low=m_file_len_high=0;
   m_create_date=m_mod_date=0;
   m_chunkcnt=0;
 
+  m_data=0;
   m_data_len=0;
+  m_data_buf=0;
 
  
   unsigned char *data=(unsigned char *)in->Get();
@@ -226,14 +248,16 @@ C_FileSendReply::C_FileSendReply(C_SHBuf *in)
   if (m_index != 0xFFFFFFFF) // woohoo we get data now
   {
     m_data_len=datalen;
-    if (m_data_len < 0 || m_data_len > FILE_CHUNKSIZE)
+    if (m_data_len < 0 || m_data_len > FILE_CHUNKSIZE*FILE_MAX_MULTICHUNK)
     {
       debug_printf("filesendreply: data length out of range, %d\n",m_data_len);
       m_data_len=0;
     }
     if (m_data_len) 
     {
-      memcpy(m_data,data,m_data_len);
+      m_data=data;
+      m_data_buf=in;
+      in->Lock();
     }
   }
   else // header parsing
@@ -268,11 +292,42 @@ C_FileSendReply::C_FileSendReply(C_SHBuf *in)
     m_port= data[0]|(data[1]<<8); 
     data+=2;
     datalen-=2;
+
+    if (datalen >= 4)
+    {
+      m_caps = data[0]|(data[1]<<8)|(data[2]<<16)|(data[3]<<24); 
+      data+=4;
+      datalen-=4;
+    }
+    if (m_caps & FILE_CAP_TREE)
+    {
+      if (datalen >= SHA_OUTSIZE) memcpy(m_tree_root,data,SHA_OUTSIZE);
+      else m_caps&=~FILE_CAP_TREE;
+    }
   }
 }
 
 C_FileSendReply::~C_FileSendReply()
 {
+  if (m_data_buf) m_data_buf->Unlock();
+}
+
+C_FileSendReply *C_FileSendReply::Copy()
+{
+  C_FileSendReply *r=new C_FileSendReply;
+  r->m_index=m_index;
+  r->m_error=m_error;
+  memcpy(r->m_hash,m_hash,SHA_OUTSIZE);
+  r->m_file_len_low=m_file_len_low;
+  r->m_file_len_high=m_file_len_high;
+  r->m_create_date=m_create_date;
+  r->m_mod_date=m_mod_date;
+  r->m_chunkcnt=m_chunkcnt;
+  r->m_ip=m_ip;
+  r->m_port=m_port;
+  r->m_caps=m_caps;
+  memcpy(r->m_tree_root,m_tree_root,SHA_OUTSIZE);
+  return r;
 }
 
 C_SHBuf *C_FileSendReply::Make(void)
@@ -283,32 +338,35 @@ C_SHBuf *C_FileSendReply::Make(void)
   //   dates 8 bytes
   //   count of max chunks coming 4 bytes
   //   file md5 16 bytes
+  //   dc ip/port 6 bytes
+  //   caps 4 bytes (if any)
+  //   hash tree root SHA_OUTSIZE bytes (if caps has FILE_CAP_TREE)
   // else
-  //   FILE_CHUNKSIZE bytes of data :)
+  //   FILE_CHUNKSIZE bytes of data :) (or several chunks' worth, if asked for)
   C_SHBuf *p;
 
   if (m_error) return new C_SHBuf(m_error>3?3:m_error);
 
   if (m_index!=0xFFFFFFFF)
   {
-    if (m_data_len > FILE_CHUNKSIZE)
+    if (m_data_len > FILE_CHUNKSIZE*FILE_MAX_MULTICHUNK)
     {
       debug_printf("filesendreply::make() data length = %d\n",m_data_len);
       return new C_SHBuf(0);
     }
 
-    p=new C_SHBuf(4+m_data_len);
+    p=C_SHBuf::New(4+m_data_len);
     unsigned char *data=(unsigned char *)p->Get();
     data[0]=m_index&0xff; 
     data[1]=(m_index>>8)&0xff; 
     data[2]=(m_index>>16)&0xff; 
     data[3]=(m_index>>24)&0xff; 
     data+=4;
-    memcpy(data,m_data,m_data_len);
+    if (m_data_len) memcpy(data,m_data,m_data_len);
   }
   else
   {
-    p=new C_SHBuf(4+8+8+4+SHA_OUTSIZE+6);
+    p=new C_SHBuf(4+8+8+4+SHA_OUTSIZE+6+(m_caps?4:0)+((m_caps&FILE_CAP_TREE)?SHA_OUTSIZE:0));
     unsigned char *data=(unsigned char *)p->Get();
     data[0]=m_index&0xff; 
     data[1]=(m_index>>8)&0xff; 
@@ -351,6 +409,20 @@ C_SHBuf *C_FileSendReply::Make(void)
     data[0]=m_port&0xff; 
     data[1]=(m_port>>8)&0xff; 
     data+=2;
+
+    if (m_caps)
+    {
+      data[0]=m_caps&0xff; 
+      data[1]=(m_caps>>8)&0xff; 
+      data[2]=(m_caps>>16)&0xff; 
+      data[3]=(m_caps>>24)&0xff; 
+      data+=4;
+    }
+    if (m_caps & FILE_CAP_TREE)
+    {
+      memcpy(data,m_tree_root,SHA_OUTSIZE);
+      data+=SHA_OUTSIZE;
+    }
   }
   return p;
 }
@@ -364,11 +436,93 @@ void C_FileSendReply::set_file_len(unsigned int file_len_low, unsigned int file_
 
 void C_FileSendReply::set_data(unsigned char *buf, int len) 
 { 
-  if (len < 0 || len > FILE_CHUNKSIZE)
+  if (len < 0 || len > FILE_CHUNKSIZE*FILE_MAX_MULTICHUNK)
   {
     debug_printf("filesendreply::set_data() data length out of range, %d\n",len);
     return;
   }
+  m_data=buf;
   m_data_len=len;
-  memcpy(m_data,buf,len);
+}
+
+
+int FileTree_NumLeaves(unsigned int len_l, unsigned int len_h)
+{
+  unsigned int chunks=(len_l+FILE_CHUNKSIZE-1)/FILE_CHUNKSIZE + (len_h * ((1<<30)/FILE_CHUNKSIZE) * 4);
+  int n=(chunks+FILE_TREE_BLOCK-1)/FILE_TREE_BLOCK;
+  return n<1 ? 1 : n;
+}
+
+void FileTree_Root(unsigned char *leaves, int nleaves, unsigned char root[SHA_OUTSIZE])
+{
+  if (nleaves < 1) { memset(root,0,SHA_OUTSIZE); return; }
+  unsigned char *lvl=(unsigned char *)malloc(nleaves*SHA_OUTSIZE);
+  if (!lvl) { memset(root,0,SHA_OUTSIZE); return; }
+  memcpy(lvl,leaves,nleaves*SHA_OUTSIZE);
+  while (nleaves > 1) // combine pairs in place, level by level
+  {
+    int x, n=0;
+    for (x = 0; x+1 < nleaves; x += 2)
+    {
+      SHAify c;
+      c.add(lvl+x*SHA_OUTSIZE,SHA_OUTSIZE*2);
+      c.final(lvl+n++*SHA_OUTSIZE);
+    }
+    if (x < nleaves) memmove(lvl+n++*SHA_OUTSIZE,lvl+x*SHA_OUTSIZE,SHA_OUTSIZE);
+    nleaves=n;
+  }
+  memcpy(root,lvl,SHA_OUTSIZE);
+  free(lvl);
+}
+
+void C_FileTreeHasher::reset()
+{
+  free(m_leaves);
+  m_leaves=0;
+  m_used=m_size=0;
+  m_inblock=0;
+  m_failed=0;
+  m_ctx.reset();
+}
+
+void C_FileTreeHasher::add(unsigned char *data, int len)
+{
+  while (len > 0)
+  {
+    int l=FILE_TREE_BLOCK*FILE_CHUNKSIZE-m_inblock;
+    if (l > len) l=len;
+    m_ctx.add(data,l);
+    m_inblock+=l;
+    data+=l;
+    len-=l;
+    if (m_inblock == FILE_TREE_BLOCK*FILE_CHUNKSIZE) addLeaf();
+  }
+}
+
+void C_FileTreeHasher::addLeaf()
+{
+  if (m_used >= m_size)
+  {
+    int ns=m_size ? m_size*2 : 64;
+    unsigned char *nl=(unsigned char *)realloc(m_leaves,ns*SHA_OUTSIZE);
+    if (!nl) m_failed=1;
+    else
+    {
+      m_leaves=nl;
+      m_size=ns;
+    }
+  }
+  if (m_used < m_size) m_ctx.final(m_leaves+m_used++*SHA_OUTSIZE);
+  else m_ctx.reset();
+  m_inblock=0;
+}
+
+int C_FileTreeHasher::final(unsigned char **leaves)
+{
+  if (m_inblock || !m_used) addLeaf(); // the short last block, or the empty file's only leaf
+  int n=m_failed ? 0 : m_used;
+  *leaves=n ? m_leaves : NULL;
+  if (n) m_leaves=0;
+  reset();
+  return n;
 }
@@ -26,6 +26,46 @@
 #define FILE_CHUNKSIZE 4096
 #define FILE_MAX_CHUNKS_PER_REQ 64
 
+// capability bits, sent as a 4 byte trailer on requests and header replies.
+// older clients never look past the fields they know.
+#define FILE_CAP_PIPELINE 1 // request: queue these after what's pending. reply: sender does that
+#define FILE_CAP_MULTICHUNK 2 // request: data replies may carry up to FILE_MAX_MULTICHUNK consecutive chunks
+#define FILE_CAP_TREE 4 // request: can use the hash tree. reply: header carries its root
+
+// (4+7*4096 fits in MESSAGE_MAX_PAYLOAD_ROUTE). chunk indices, the valid
+// bitmap and resume state all stay in FILE_CHUNKSIZE units.
+#define FILE_MAX_MULTICHUNK 7
+
+// hash tree: a leaf is the SHA of FILE_TREE_BLOCK chunks of the file (the
+// last one may be short), a node is the SHA of its two children, and an odd
+// node out moves up a level as is.  a receiver asks for leaves as chunk
+// FILE_TREE_INDEX+page and gets FILE_TREE_LEAVES_PER_MSG of them back per
+// page, at that same index.
+#define FILE_TREE_BLOCK 64
+#define FILE_TREE_INDEX 0xFF000000
+#define FILE_TREE_LEAVES_PER_MSG ((FILE_CHUNKSIZE*FILE_MAX_MULTICHUNK)/SHA_OUTSIZE)
+
+int FileTree_NumLeaves(unsigned int len_l, unsigned int len_h);
+void FileTree_Root(unsigned char *leaves, int nleaves, unsigned char root[SHA_OUTSIZE]);
+
+// collects the leaves of a file fed through it from the start
+class C_FileTreeHasher
+{
+  public:
+    C_FileTreeHasher() { m_leaves=0; reset(); }
+    ~C_FileTreeHasher() { free(m_leaves); }
+    void reset();
+    void add(unsigned char *data, int len);
+    int final(unsigned char **leaves); // returns the leaf count, *leaves is malloc()ed and yours
+
+  private:
+    SHAify m_ctx;
+    unsigned int m_inblock;
+    unsigned char *m_leaves;
+    int m_used, m_size, m_failed;
+    void addLeaf();
+};
+
 class C_FileSendRequest
 {
   public:
@@ -69,6 +109,9 @@ class C_FileSendRequest
     void set_nick(char *nick) { safe_strncpy(m_nick,nick,32); }
     char *get_nick() { return m_nick; }
 
+    void set_caps(int caps) { m_caps=caps; }
+    int get_caps() { return m_caps; }
+
     void clear_need_chunks()
     {
       m_need_chunks_used=0;
@@ -89,6 +132,7 @@ class C_FileSendRequest
     int m_ip,m_port;
     unsigned char m_fnhash[SHA_OUTSIZE];
     char m_nick[32];
+    int m_caps;
 
 
     // on write side, this stores some nifty RLE stuff.
@@ -106,6 +150,7 @@ class C_FileSendReply
     C_FileSendReply();
     C_FileSendReply(C_SHBuf *in);
     ~C_FileSendReply();
+    C_FileSendReply *Copy(); // a header to keep, data is left out
 
     C_SHBuf *Make(void);
 
@@ -127,6 +172,13 @@ class C_FileSendReply
     void set_chunkcount(int cnt) { m_chunkcnt=cnt; }
     int get_chunkcount() { return m_chunkcnt; }
 
+    void set_caps(int caps) { m_caps=caps; }
+    int get_caps() { return m_caps; }
+
+    // with FILE_CAP_TREE
+    void get_tree_root(unsigned char root[SHA_OUTSIZE]) { memcpy(root,m_tree_root,SHA_OUTSIZE); }
+    void set_tree_root(unsigned char root[SHA_OUTSIZE]) { memcpy(m_tree_root,root,SHA_OUTSIZE); }
+
     void set_dc_ipport(int ip, int port)
     {
       m_ip=ip;
@@ -138,7 +190,9 @@ class C_FileSendReply
       *ip=m_ip;
     }
 
-    // data only fields
+    // data only fields. the data covers chunks index..index+(len-1)/FILE_CHUNKSIZE.
+    // neither side copies it: set_data() only points at buf, which has to stay
+    // put until Make(), and a parsed reply points into (and holds) the message.
     void set_data(unsigned char *buf, int len);
     unsigned char *get_data() { return m_data; }
     int get_data_len() { return m_data_len; }
@@ -155,10 +209,17 @@ class C_FileSendReply
     unsigned int m_mod_date;
     unsigned int m_chunkcnt;
     int m_ip,m_port;
+    int m_caps;
+    unsigned char m_tree_root[SHA_OUTSIZE];
 
     // data only
-    unsigned char m_data[FILE_CHUNKSIZE];
+    unsigned char *m_data;
     int m_data_len;
+    C_SHBuf *m_data_buf; // what m_data is in, if it came in a message
+
+  private:
+    C_FileSendReply(const C_FileSendReply &);
+    C_FileSendReply &operator=(const C_FileSendReply &);
 
 
 };
@@ -28,6 +28,11 @@
 
 #define MLC_SATURATION 0x0100 // the value defines whether or not the host should be saturated (low bit anyway so far)
 #define MLC_BANDWIDTH  0x0200 // the value defines the buffer size that the remote would like you to use for sending to it (clamped to 64b->32kb)
+#define MLC_BULK       0x0400 // nonzero: the link only carries file transfers between its two ends (see NetKern_ConnectBulk)
+#define MLC_CLIENTID   0x0800 // 0x0800-0x0803: the sender's client id, 4 bytes each. only sent on bulk links
+#define MLC_STREAMS    0x0404 // bulk links the sender will use in parallel to the same host
+#define MLC_DEFLATE    0x1000 // nonzero: the sender can take a compressed stream (see C_MessageQueue::start_deflate)
+#define MLC_HDRV2      0x2000 // 0x2000-0x2001: the sender can take v2 headers, checksummed with this key (0x2000 is nonzero)
 
 class C_MessageLocalCaps
 {
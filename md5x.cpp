@@ -0,0 +1,257 @@
+/*
+    WASTE - md5x.cpp (MD5 of several buffers at once)
+    Copyright (C) 2003 Nullsoft, Inc.
+
+    WASTE is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    WASTE  is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with WASTE; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "platform.h"
+#include "md5x.h"
+
+// each buffer gets a lane, and the lanes go through the md5 rounds side by
+// side: 8 at a time with AVX2, 4 with SSE2, 4 in plain C otherwise (which
+// is no faster than one at a time, but gives the same answers).
+#if defined(__AVX2__)
+#define MD5X_AVX2
+#define MD5X_LANES 8
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MD5X_SSE2
+#define MD5X_LANES 4
+#else
+#define MD5X_LANES 4
+#endif
+
+#if defined(MD5X_AVX2)
+#include <immintrin.h>
+typedef __m256i md5v;
+#define V_ADD(a,b) _mm256_add_epi32(a,b)
+#define V_AND(a,b) _mm256_and_si256(a,b)
+#define V_OR(a,b) _mm256_or_si256(a,b)
+#define V_XOR(a,b) _mm256_xor_si256(a,b)
+#define V_ANDNOT(a,b) _mm256_andnot_si256(a,b) // ~a & b
+#define V_ROT(x,n) V_OR(_mm256_slli_epi32(x,n),_mm256_srli_epi32(x,32-(n)))
+#define V_SET1(c) _mm256_set1_epi32((int)(c))
+#define V_LOAD(p) _mm256_loadu_si256((const __m256i *)(p))
+#define V_STORE(p,v) _mm256_storeu_si256((__m256i *)(p),v)
+#elif defined(MD5X_SSE2)
+#include <emmintrin.h>
+typedef __m128i md5v;
+#define V_ADD(a,b) _mm_add_epi32(a,b)
+#define V_AND(a,b) _mm_and_si128(a,b)
+#define V_OR(a,b) _mm_or_si128(a,b)
+#define V_XOR(a,b) _mm_xor_si128(a,b)
+#define V_ANDNOT(a,b) _mm_andnot_si128(a,b)
+#define V_ROT(x,n) V_OR(_mm_slli_epi32(x,n),_mm_srli_epi32(x,32-(n)))
+#define V_SET1(c) _mm_set1_epi32((int)(c))
+#define V_LOAD(p) _mm_loadu_si128((const __m128i *)(p))
+#define V_STORE(p,v) _mm_storeu_si128((__m128i *)(p),v)
+#else
+typedef struct { unsigned int l[MD5X_LANES]; } md5v;
+static md5v v_op(md5v a, md5v b, int op)
+{
+  int x;
+  for (x = 0; x < MD5X_LANES; x ++) switch (op)
+  {
+    case 0: a.l[x]+=b.l[x]; break;
+    case 1: a.l[x]&=b.l[x]; break;
+    case 2: a.l[x]|=b.l[x]; break;
+    case 3: a.l[x]^=b.l[x]; break;
+    case 4: a.l[x]=~a.l[x] & b.l[x]; break;
+  }
+  return a;
+}
+static md5v v_rot(md5v a, int n)
+{
+  int x;
+  for (x = 0; x < MD5X_LANES; x ++) a.l[x]=(a.l[x] << n) | (a.l[x] >> (32-n));
+  return a;
+}
+static md5v v_set1(unsigned int c)
+{
+  md5v a;
+  int x;
+  for (x = 0; x < MD5X_LANES; x ++) a.l[x]=c;
+  return a;
+}
+#define V_ADD(a,b) v_op(a,b,0)
+#define V_AND(a,b) v_op(a,b,1)
+#define V_OR(a,b) v_op(a,b,2)
+#define V_XOR(a,b) v_op(a,b,3)
+#define V_ANDNOT(a,b) v_op(a,b,4)
+#define V_ROT(x,n) v_rot(x,n)
+#define V_SET1(c) v_set1(c)
+#define V_LOAD(p) (*(const md5v *)(p))
+#define V_STORE(p,v) (*(md5v *)(p)=(v))
+#endif
+
+// the usual md5 round functions, see rsa/md5c.c
+#define V_F(x,y,z) V_OR(V_AND(x,y),V_ANDNOT(x,z))
+#define V_G(x,y,z) V_OR(V_AND(x,z),V_ANDNOT(z,y))
+#define V_H(x,y,z) V_XOR(V_XOR(x,y),z)
+#define V_I(x,y,z) V_XOR(y,V_OR(x,V_XOR(z,V_SET1(0xffffffff))))
+#define V_STEP(f,a,b,c,d,k,s,t) \
+  a=V_ADD(b,V_ROT(V_ADD(V_ADD(a,f(b,c,d)),V_ADD(X[k],V_SET1(t))),s))
+
+// st[word][lane], blk[lane] is that lane's next 64 bytes
+static void md5x_transform(unsigned int st[4][MD5X_LANES], const unsigned char *blk[MD5X_LANES])
+{
+  unsigned int w[16][MD5X_LANES];
+  md5v X[16];
+  int i,l;
+  for (l = 0; l < MD5X_LANES; l ++)
+  {
+    const unsigned char *p=blk[l];
+    for (i = 0; i < 16; i ++, p+=4) w[i][l]=p[0]|(p[1]<<8)|(p[2]<<16)|((unsigned int)p[3]<<24);
+  }
+  for (i = 0; i < 16; i ++) X[i]=V_LOAD(w[i]);
+
+  md5v a=V_LOAD(st[0]), b=V_LOAD(st[1]), c=V_LOAD(st[2]), d=V_LOAD(st[3]);
+  md5v aa=a, bb=b, cc=c, dd=d;
+
+  V_STEP(V_F,a,b,c,d, 0, 7,0xd76aa478); V_STEP(V_F,d,a,b,c, 1,12,0xe8c7b756);
+  V_STEP(V_F,c,d,a,b, 2,17,0x242070db); V_STEP(V_F,b,c,d,a, 3,22,0xc1bdceee);
+  V_STEP(V_F,a,b,c,d, 4, 7,0xf57c0faf); V_STEP(V_F,d,a,b,c, 5,12,0x4787c62a);
+  V_STEP(V_F,c,d,a,b, 6,17,0xa8304613); V_STEP(V_F,b,c,d,a, 7,22,0xfd469501);
+  V_STEP(V_F,a,b,c,d, 8, 7,0x698098d8); V_STEP(V_F,d,a,b,c, 9,12,0x8b44f7af);
+  V_STEP(V_F,c,d,a,b,10,17,0xffff5bb1); V_STEP(V_F,b,c,d,a,11,22,0x895cd7be);
+  V_STEP(V_F,a,b,c,d,12, 7,0x6b901122); V_STEP(V_F,d,a,b,c,13,12,0xfd987193);
+  V_STEP(V_F,c,d,a,b,14,17,0xa679438e); V_STEP(V_F,b,c,d,a,15,22,0x49b40821);
+
+  V_STEP(V_G,a,b,c,d, 1, 5,0xf61e2562); V_STEP(V_G,d,a,b,c, 6, 9,0xc040b340);
+  V_STEP(V_G,c,d,a,b,11,14,0x265e5a51); V_STEP(V_G,b,c,d,a, 0,20,0xe9b6c7aa);
+  V_STEP(V_G,a,b,c,d, 5, 5,0xd62f105d); V_STEP(V_G,d,a,b,c,10, 9,0x02441453);
+  V_STEP(V_G,c,d,a,b,15,14,0xd8a1e681); V_STEP(V_G,b,c,d,a, 4,20,0xe7d3fbc8);
+  V_STEP(V_G,a,b,c,d, 9, 5,0x21e1cde6); V_STEP(V_G,d,a,b,c,14, 9,0xc33707d6);
+  V_STEP(V_G,c,d,a,b, 3,14,0xf4d50d87); V_STEP(V_G,b,c,d,a, 8,20,0x455a14ed);
+  V_STEP(V_G,a,b,c,d,13, 5,0xa9e3e905); V_STEP(V_G,d,a,b,c, 2, 9,0xfcefa3f8);
+  V_STEP(V_G,c,d,a,b, 7,14,0x676f02d9); V_STEP(V_G,b,c,d,a,12,20,0x8d2a4c8a);
+
+  V_STEP(V_H,a,b,c,d, 5, 4,0xfffa3942); V_STEP(V_H,d,a,b,c, 8,11,0x8771f681);
+  V_STEP(V_H,c,d,a,b,11,16,0x6d9d6122); V_STEP(V_H,b,c,d,a,14,23,0xfde5380c);
+  V_STEP(V_H,a,b,c,d, 1, 4,0xa4beea44); V_STEP(V_H,d,a,b,c, 4,11,0x4bdecfa9);
+  V_STEP(V_H,c,d,a,b, 7,16,0xf6bb4b60); V_STEP(V_H,b,c,d,a,10,23,0xbebfbc70);
+  V_STEP(V_H,a,b,c,d,13, 4,0x289b7ec6); V_STEP(V_H,d,a,b,c, 0,11,0xeaa127fa);
+  V_STEP(V_H,c,d,a,b, 3,16,0xd4ef3085); V_STEP(V_H,b,c,d,a, 6,23,0x04881d05);
+  V_STEP(V_H,a,b,c,d, 9, 4,0xd9d4d039); V_STEP(V_H,d,a,b,c,12,11,0xe6db99e5);
+  V_STEP(V_H,c,d,a,b,15,16,0x1fa27cf8); V_STEP(V_H,b,c,d,a, 2,23,0xc4ac5665);
+
+  V_STEP(V_I,a,b,c,d, 0, 6,0xf4292244); V_STEP(V_I,d,a,b,c, 7,10,0x432aff97);
+  V_STEP(V_I,c,d,a,b,14,15,0xab9423a7); V_STEP(V_I,b,c,d,a, 5,21,0xfc93a039);
+  V_STEP(V_I,a,b,c,d,12, 6,0x655b59c3); V_STEP(V_I,d,a,b,c, 3,10,0x8f0ccc92);
+  V_STEP(V_I,c,d,a,b,10,15,0xffeff47d); V_STEP(V_I,b,c,d,a, 1,21,0x85845dd1);
+  V_STEP(V_I,a,b,c,d, 8, 6,0x6fa87e4f); V_STEP(V_I,d,a,b,c,15,10,0xfe2ce6e0);
+  V_STEP(V_I,c,d,a,b, 6,15,0xa3014314); V_STEP(V_I,b,c,d,a,13,21,0x4e0811a1);
+  V_STEP(V_I,a,b,c,d, 4, 6,0xf7537e82); V_STEP(V_I,d,a,b,c,11,10,0xbd3af235);
+  V_STEP(V_I,c,d,a,b, 2,15,0x2ad7d2bb); V_STEP(V_I,b,c,d,a, 9,21,0xeb86d391);
+
+  V_STORE(st[0],V_ADD(a,aa));
+  V_STORE(st[1],V_ADD(b,bb));
+  V_STORE(st[2],V_ADD(c,cc));
+  V_STORE(st[3],V_ADD(d,dd));
+}
+
+static int md5x_blocks(T_MD5XJob *j) // including the padding
+{
+  return (j->len[0]+j->len[1]+8)/64+1;
+}
+
+// block b of the job, straight from the data when it can be
+static const unsigned char *md5x_block(T_MD5XJob *j, int b, unsigned char buf[64])
+{
+  int off=b*64, l0=j->len[0], l=l0+j->len[1];
+  if (off+64 <= l0) return j->part[0]+off;
+  if (off >= l0 && off+64 <= l) return j->part[1]+(off-l0);
+
+  int n=0;
+  if (off < l0)
+  {
+    n=l0-off;
+    memcpy(buf,j->part[0]+off,n);
+  }
+  if (n < 64 && off+n < l)
+  {
+    int a=min(64-n,l-(off+n));
+    memcpy(buf+n,j->part[1]+(off+n-l0),a);
+    n+=a;
+  }
+  if (n < 64)
+  {
+    if (off+n == l) buf[n++]=0x80;
+    memset(buf+n,0,64-n);
+  }
+  if (b == md5x_blocks(j)-1) // bit count, little endian
+  {
+    unsigned int bits=(unsigned int)l<<3;
+    buf[56]=bits&0xff;
+    buf[57]=(bits>>8)&0xff;
+    buf[58]=(bits>>16)&0xff;
+    buf[59]=(bits>>24)&0xff;
+    buf[60]=((unsigned int)l>>29)&0xff;
+    buf[61]=buf[62]=buf[63]=0;
+  }
+  return buf;
+}
+
+void MD5Multi(T_MD5XJob *jobs, int n)
+{
+  static const unsigned char idle[64]={0,};
+  unsigned int st[4][MD5X_LANES], nst[4][MD5X_LANES];
+  unsigned char buf[MD5X_LANES][64];
+  const unsigned char *blk[MD5X_LANES];
+  T_MD5XJob *job[MD5X_LANES];
+  int pos[MD5X_LANES], nblk[MD5X_LANES];
+  int next=0, busy=0, l, i;
+
+  for (l = 0; l < MD5X_LANES; l ++) job[l]=NULL;
+  for (;;)
+  {
+    for (l = 0; l < MD5X_LANES; l ++)
+    {
+      if (!job[l] && next < n) // start the next one
+      {
+        job[l]=jobs+next++;
+        pos[l]=0;
+        nblk[l]=md5x_blocks(job[l]);
+        st[0][l]=0x67452301;
+        st[1][l]=0xefcdab89;
+        st[2][l]=0x98badcfe;
+        st[3][l]=0x10325476;
+        busy++;
+      }
+      blk[l]=job[l] ? md5x_block(job[l],pos[l],buf[l]) : idle;
+    }
+    if (!busy) break;
+
+    memcpy(nst,st,sizeof(st));
+    md5x_transform(nst,blk);
+    for (l = 0; l < MD5X_LANES; l ++)
+    {
+      if (!job[l]) continue;
+      for (i = 0; i < 4; i ++) st[i][l]=nst[i][l];
+      if (++pos[l] < nblk[l]) continue;
+
+      unsigned char *o=job[l]->out;
+      for (i = 0; i < 4; i ++, o+=4)
+      {
+        o[0]=st[i][l]&0xff;
+        o[1]=(st[i][l]>>8)&0xff;
+        o[2]=(st[i][l]>>16)&0xff;
+        o[3]=(st[i][l]>>24)&0xff;
+      }
+      job[l]=NULL;
+      busy--;
+    }
+  }
+}
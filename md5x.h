@@ -0,0 +1,36 @@
+/*
+    WASTE - md5x.h (MD5 of several buffers at once)
+    Copyright (C) 2003 Nullsoft, Inc.
+
+    WASTE is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    WASTE  is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with WASTE; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _MD5X_H_
+#define _MD5X_H_
+
+// each buffer gets a lane, and the lanes go through the md5 rounds side by
+// side. how many lanes there are depends on how md5x.cpp was built.
+typedef struct
+{
+  // the data is part[0] followed by part[1], either can be empty
+  const unsigned char *part[2];
+  int len[2];
+  unsigned char *out; // 16 bytes
+} T_MD5XJob;
+
+// any number of jobs, a lane is given the next one as soon as it's free
+void MD5Multi(T_MD5XJob *jobs, int n);
+
+#endif//_MD5X_H_
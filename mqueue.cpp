@@ -25,6 +25,10 @@ extern "C" {
 #include "rsa/r_random.h"
 };
 #include "mqueue.h"
+#include "md5x.h"
+#ifndef NO_ZLIB
+#include <zlib.h>
+#endif
 
 
 #define PAD8(x) (((x)+7)&(~7))
@@ -34,6 +38,29 @@ C_MessageQueue::C_MessageQueue(C_Connection *con, int maxmsg, int maxroute)
   m_stat_send=0;
   m_stat_recv=0;
   m_stat_drop=0;
+  m_bulk=0;
+  memset(&m_bulk_peer,0,sizeof(m_bulk_peer));
+  m_ping_pending=0;
+  m_bulk_seen=0;
+  m_bulk_time=time(NULL);
+  m_zsend=0;
+  m_zs=m_zr=NULL;
+  m_zout=m_zin=m_zraw=NULL;
+  m_zout_pos=m_zout_len=0;
+  m_zin_pos=m_zin_kind=m_zin_raw=0;
+  m_zin_len=-1;
+  m_zraw_pos=m_zraw_len=0;
+  m_zskip[0]=m_zskip[1]=m_zback[0]=m_zback[1]=0;
+  m_stat_zraw=m_stat_zsent=0;
+  m_v2send=m_v2recv=0;
+  m_v2key_send[0]=m_v2key_send[1]=0;
+  R_GenerateBytes((unsigned char *)m_v2key_recv,sizeof(m_v2key_recv),&g_random);
+  if (!m_v2key_recv[0]) m_v2key_recv[0]=1; // 0 would mean no v2 in the caps
+  memset(&m_v2guid_send,0,sizeof(m_v2guid_send));
+  memset(&m_v2guid_recv,0,sizeof(m_v2guid_recv));
+  m_v2hdr_got=0;
+  m_newmsg_sum=0;
+  m_ready_cnt=m_ready_pos=0;
   m_newmsg_pos=-1;
   memset(&m_newmsg,0,sizeof(m_newmsg));
   m_con=con;
@@ -81,6 +108,20 @@ C_MessageQueue::~C_MessageQueue()
   {
     m_newmsg.data->Unlock();
   }
+  while (m_ready_pos < m_ready_cnt)
+  {
+    if (m_ready[m_ready_pos].data) m_ready[m_ready_pos].data->Unlock();
+    m_ready_pos++;
+  }
+#ifndef NO_ZLIB
+  if (m_zs) deflateEnd(m_zs);
+  if (m_zr) inflateEnd(m_zr);
+#endif
+  ::free(m_zs);
+  ::free(m_zr);
+  ::free(m_zout);
+  ::free(m_zin);
+  ::free(m_zraw);
   if (m_con) 
   {
     delete m_con;
@@ -105,6 +146,69 @@ void C_MessageQueue::calc_md5(T_Message *msg, unsigned char buf[16])
   MD5Final(buf,&ctx);
 }
 
+// what calc_md5() hashes is pre (filled in here) followed by the payload
+static void md5_job(T_Message *msg, T_MD5XJob *job, unsigned char pre[23], unsigned char *out)
+{
+  pre[0]=msg->message_type&0xff;
+  pre[1]=(msg->message_type>>8)&0xff;
+  pre[2]=(msg->message_type>>16)&0xff;
+  pre[3]=(msg->message_type>>24)&0xff;
+  pre[4]=msg->message_prio;
+  pre[5]=msg->message_length&0xff;
+  pre[6]=(msg->message_length>>8)&0xff;
+  memcpy(pre+7,&msg->message_guid,16);
+  job->part[0]=pre;
+  job->len[0]=23;
+  job->part[1]=(unsigned char *)(msg->data?msg->data->Get():0);
+  job->len[1]=job->part[1] ? msg->message_length : 0;
+  job->out=out;
+}
+
+// most queued messages fill_md5() works out along with the one it needs
+#define MQ_MD5_BATCH 8
+
+void C_MessageQueue::fill_md5(T_Message *msg)
+{
+  T_Message *m[MQ_MD5_BATCH];
+  T_MD5XJob jobs[MQ_MD5_BATCH];
+  unsigned char pre[MQ_MD5_BATCH][23];
+  int x, n=0;
+  m[n++]=msg;
+  for (x = 0; x < m_msg_used && n < MQ_MD5_BATCH; x ++)
+  {
+    if (m_msg+x != msg && m_msg[x].message_nomd5) m[n++]=m_msg+x;
+  }
+  for (x = 0; x < n; x ++) md5_job(m[x],jobs+x,pre[x],m[x]->message_md5);
+  MD5Multi(jobs,n);
+  for (x = 0; x < n; x ++) m[x]->message_nomd5=0;
+}
+
+int C_MessageQueue::check_ready()
+{
+  T_MD5XJob jobs[MQ_RECV_BATCH];
+  unsigned char pre[MQ_RECV_BATCH][23], out[MQ_RECV_BATCH][16];
+  int x, n=0, idx[MQ_RECV_BATCH];
+  for (x = m_ready_pos; x < m_ready_cnt; x ++)
+  {
+    // v2 messages were checked already, and empty ones never were
+    if (m_ready[x].message_nomd5 || !m_ready[x].message_length) continue;
+    md5_job(m_ready+x,jobs+n,pre[n],out[n]);
+    idx[n++]=x;
+  }
+  if (!n) return 1;
+  MD5Multi(jobs,n);
+  for (x = 0; x < n; x ++)
+  {
+    T_Message *m=m_ready+idx[x];
+    if (memcmp(out[x],m->message_md5,16))
+    {
+      debug_printf("queue::run() got bad message (MD5 differs) type=%d, prio=%d, ttl=%d, len=%d\n", m->message_type,m->message_prio,m->message_ttl,m->message_length);        
+      return 0;
+    }
+  }
+  return 1;
+}
+
 int C_MessageQueue::send_message(T_Message *msg)
 {
   // if m_msg_bsent<0 then its safe to modify the first message
@@ -131,12 +235,10 @@ int C_MessageQueue::send_message(T_Message *msg)
 
 int C_MessageQueue::recv_message(T_Message *msg)
 {
-  if (m_newmsg_pos>=PAD8(m_newmsg.message_length))
+  if (m_ready_pos<m_ready_cnt)
   {
-    ::memcpy(msg,&m_newmsg,sizeof(m_newmsg));
-    ::memset(&m_newmsg,0,sizeof(m_newmsg));
+    ::memcpy(msg,&m_ready[m_ready_pos++],sizeof(T_Message));
     m_stat_recv++;
-    m_newmsg_pos=-1;
     return 0;
   }
   return 1;
@@ -167,23 +269,251 @@ void C_MessageQueue::saturate(int satsize)
 }
 
 
+#ifdef _MSC_VER
+typedef unsigned __int64 sumword;
+#else
+typedef unsigned long long sumword;
+#endif
+#define SUM_MUL ((sumword)0x9e3779b97f4a7c15ULL)
+
+static inline sumword sumget(const unsigned char *p) // little endian whatever we run on
+{
+  return (sumword)p[0] | ((sumword)p[1]<<8) | ((sumword)p[2]<<16) | ((sumword)p[3]<<24) |
+         ((sumword)p[4]<<32) | ((sumword)p[5]<<40) | ((sumword)p[6]<<48) | ((sumword)p[7]<<56);
+}
+
+// not md5, just enough to catch a link going bad. the link is already
+// encrypted and the key is the receiver's, so it can't be made to match either.
+unsigned int C_MessageQueue::calc_sum(T_Message *msg, unsigned int key[2])
+{
+  unsigned char t[24];
+  t[0]=msg->message_type&0xff;
+  t[1]=(msg->message_type>>8)&0xff;
+  t[2]=(msg->message_type>>16)&0xff;
+  t[3]=(msg->message_type>>24)&0xff;
+  t[4]=msg->message_prio;
+  t[5]=msg->message_length&0xff;
+  t[6]=(msg->message_length>>8)&0xff;
+  t[7]=msg->message_ttl;
+  memcpy(t+8,&msg->message_guid,16);
+
+  sumword h=(((sumword)key[1]<<32)|key[0]) ^ ((sumword)msg->message_length*SUM_MUL);
+  int x;
+  for (x = 0; x < 24; x += 8)
+  {
+    h=(h^sumget(t+x))*SUM_MUL;
+    h^=h>>29;
+  }
+  unsigned char *d=(unsigned char *)(msg->data?msg->data->Get():0);
+  int len=msg->message_length;
+  for (x = 0; x+8 <= len; x += 8)
+  {
+    h=(h^sumget(d+x))*SUM_MUL;
+    h^=h>>29;
+  }
+  if (x < len)
+  {
+    unsigned char last[8]={0,};
+    memcpy(last,d+x,len-x);
+    h=(h^sumget(last))*SUM_MUL;
+    h^=h>>29;
+  }
+  h=(h^key[1])*SUM_MUL;
+  return (unsigned int)(h^(h>>32));
+}
+
+static unsigned char *putvar(unsigned char *p, unsigned int v)
+{
+  while (v >= 0x80)
+  {
+    *p++=(unsigned char)(v|0x80);
+    v>>=7;
+  }
+  *p++=(unsigned char)v;
+  return p;
+}
+
+static unsigned char *getvar(unsigned char *p, unsigned char *end, unsigned int *v, int maxbytes)
+{
+  int s=0;
+  *v=0;
+  while (p < end && maxbytes-- > 0)
+  {
+    *v|=(unsigned int)(*p&0x7f)<<s;
+    if (!(*p++&0x80)) return p;
+    s+=7;
+  }
+  return NULL;
+}
+
+int C_MessageQueue::put_header(T_Message *msg, unsigned char t[40])
+{
+  if (m_v2send != 2)
+  {
+    if (msg->message_nomd5) fill_md5(msg);
+    memcpy(t,&msg->message_md5,16);
+    t[16]=msg->message_type&0xff;
+    t[17]=(msg->message_type>>8)&0xff;
+    t[18]=(msg->message_type>>16)&0xff;
+    t[19]=(msg->message_type>>24)&0xff;
+    t[20]=msg->message_prio;
+    t[21]=msg->message_length&0xff;
+    t[22]=(msg->message_length>>8)&0xff;
+    t[23]=msg->message_ttl;
+    memcpy(t+24,&msg->message_guid,16);
+    return 40;
+  }
+
+  unsigned char *p=putvar(t+5,msg->message_type);
+  p=putvar(p,msg->message_length);
+  *p++=msg->message_prio;
+  *p++=msg->message_ttl;
+  int same=!memcmp(&msg->message_guid,&m_v2guid_send,16);
+  if (!same)
+  {
+    memcpy(p,&msg->message_guid,16);
+    p+=16;
+    m_v2guid_send=msg->message_guid;
+  }
+  int hl=PAD8(p-t);
+  while (p < t+hl) *p++=0;
+  unsigned int s=calc_sum(msg,m_v2key_send);
+  t[0]=(hl/8)|(same ? MQV2_SAMEGUID : 0);
+  t[1]=s&0xff;
+  t[2]=(s>>8)&0xff;
+  t[3]=(s>>16)&0xff;
+  t[4]=(s>>24)&0xff;
+  return hl;
+}
+
+int C_MessageQueue::get_header()
+{
+  if (!m_v2recv)
+  {
+    if (recv_avail() < 40) return 0;
+    unsigned char t[8];
+    recv_get(&m_newmsg.message_md5,16);
+    recv_get(t,8);
+    m_newmsg.message_type=t[0]|(t[1]<<8)|(t[2]<<16)|(t[3]<<24);
+    m_newmsg.message_prio=t[4];
+    m_newmsg.message_length=t[5]|(t[6]<<8);
+    m_newmsg.message_ttl=t[7];
+    recv_get(&m_newmsg.message_guid,16);
+    return 1;
+  }
+
+  if (!m_v2hdr_got)
+  {
+    if (recv_avail() < 8) return 0;
+    recv_get(m_v2hdr,8);
+    m_v2hdr_got=8;
+  }
+  int hl=(m_v2hdr[0]&7)*8;
+  if (hl < 16 || hl > MQV2_MAXHDR) return -1;
+  if (m_v2hdr_got < hl)
+  {
+    if (recv_avail() < hl-m_v2hdr_got) return 0;
+    recv_get(m_v2hdr+m_v2hdr_got,hl-m_v2hdr_got);
+  }
+  m_v2hdr_got=0;
+
+  unsigned int type,len;
+  unsigned char *end=m_v2hdr+hl;
+  unsigned char *p=getvar(m_v2hdr+5,end,&type,5);
+  if (p) p=getvar(p,end,&len,3);
+  if (!p || p+2 > end || len > 0xffff) return -1;
+  m_newmsg.message_type=type;
+  m_newmsg.message_length=len;
+  m_newmsg.message_prio=*p++;
+  m_newmsg.message_ttl=*p++;
+  if (!(m_v2hdr[0]&MQV2_SAMEGUID))
+  {
+    if (p+16 > end) return -1;
+    memcpy(&m_v2guid_recv,p,16);
+  }
+  m_newmsg.message_guid=m_v2guid_recv;
+  m_newmsg.message_nomd5=1;
+  m_newmsg_sum=m_v2hdr[1]|(m_v2hdr[2]<<8)|(m_v2hdr[3]<<16)|((unsigned int)m_v2hdr[4]<<24);
+  return 1;
+}
+
+int C_MessageQueue::check_msg(T_Message *msg)
+{
+  if (m_v2recv) return calc_sum(msg,m_v2key_recv) == m_newmsg_sum;
+  unsigned char buf[16];
+  calc_md5(msg,buf);
+  return !memcmp(buf,msg->message_md5,16);
+}
+
+void C_MessageQueue::put_marker(int type)
+{
+  T_Message msg={0,};
+  msg.message_type=type;
+  msg.message_ttl=1;
+  CreateID128(&msg.message_guid);
+  calc_md5(&msg,msg.message_md5);
+  insert(m_msg_bsent>=0,&msg); // ahead of anything not started yet
+}
+
+void C_MessageQueue::start_hdrv2(unsigned int key[2])
+{
+  if (m_v2send) return;
+  m_v2key_send[0]=key[0];
+  m_v2key_send[1]=key[1];
+  put_marker(MESSAGE_LOCAL_HDRV2);
+  m_v2send=1;
+}
+
+int C_MessageQueue::recv_avail()
+{
+  if (!m_zr) return m_con->recv_bytes_available();
+  if (m_zraw_pos >= m_zraw_len)
+  {
+    int r=zunpack();
+    if (r < 0)
+    {
+      debug_printf("queue::run() got bad compressed block\n");
+      m_zraw_pos=m_zraw_len=0;
+      m_con->close(1);
+    }
+    if (r <= 0) return 0;
+  }
+  return m_zraw_len-m_zraw_pos;
+}
+
+void C_MessageQueue::recv_get(void *data, int len)
+{
+  if (!m_zr) 
+  {
+    m_con->recv_bytes(data,len);
+    return;
+  }
+  memcpy(data,m_zraw+m_zraw_pos,len);
+  m_zraw_pos+=len;
+}
+
 void C_MessageQueue::run(int isrecv, int maxbytesend)
 {
   // recieve message
   if (isrecv)
   {
-    if (m_newmsg_pos==-1)
+    if (m_ready_pos < m_ready_cnt) return; // the last lot hasn't all been taken yet
+    m_ready_pos=m_ready_cnt=0;
+
+    int bad=0;
+    while (m_ready_cnt < MQ_RECV_BATCH) // take what's there, then check the md5s all at once
     {
-      if (m_con->recv_bytes_available() >= 40)
+      if (m_newmsg_pos==-1)
       {
-        unsigned char t[8];
-        m_con->recv_bytes(&m_newmsg.message_md5,16);
-        m_con->recv_bytes(t,8);
-        m_newmsg.message_type=t[0]|(t[1]<<8)|(t[2]<<16)|(t[3]<<24);
-        m_newmsg.message_prio=t[4];
-        m_newmsg.message_length=t[5]|(t[6]<<8);
-        m_newmsg.message_ttl=t[7];
-        m_con->recv_bytes(&m_newmsg.message_guid,16);
+        int r=get_header();
+        if (r < 0)
+        {
+          debug_printf("queue::run() got bad v2 header\n");
+          m_newmsg.message_length=0;
+          bad=1;
+          break;
+        }
+        if (!r) break;
 
         if (!m_newmsg.message_type ||
             m_newmsg.message_ttl > G_MAX_TTL ||
@@ -195,90 +525,140 @@ void C_MessageQueue::run(int isrecv, int maxbytesend)
         {       
           debug_printf("queue::run() got bad message type=%d, prio=%d, ttl=%d, len=%d\n", m_newmsg.message_type,m_newmsg.message_prio,m_newmsg.message_ttl,m_newmsg.message_length);        
           m_newmsg.message_length=0;
-          m_con->close(1);
-          return;
+          bad=1;
+          break;
+        }
+        if (m_newmsg.message_type == MESSAGE_LOCAL_DEFLATE || m_newmsg.message_type == MESSAGE_LOCAL_HDRV2) // the rest comes differently
+        {
+          if (m_newmsg.message_length || !check_msg(&m_newmsg) ||
+              (m_newmsg.message_type == MESSAGE_LOCAL_DEFLATE ? !start_inflate() : m_v2recv))
+          {
+            debug_printf("queue::run() got bad switch type=%d\n",m_newmsg.message_type);
+            m_newmsg.message_length=0;
+            bad=1;
+            break;
+          }
+          if (m_newmsg.message_type == MESSAGE_LOCAL_HDRV2)
+          {
+            m_v2recv=1;
+            memset(&m_v2guid_recv,0,sizeof(m_v2guid_recv));
+          }
+          memset(&m_newmsg,0,sizeof(m_newmsg));
+          continue;
+        }
+        if (m_v2recv && !m_newmsg.message_length && !check_msg(&m_newmsg))
+        {
+          debug_printf("queue::run() got bad message (checksum differs) type=%d\n",m_newmsg.message_type);
+          m_newmsg.message_length=0;
+          bad=1;
+          break;
         }
-        m_newmsg.data=new C_SHBuf(m_newmsg.message_length);
+        m_newmsg.data=C_SHBuf::New(m_newmsg.message_length);
         if (!m_newmsg.data->Get())
         {
           delete m_newmsg.data;
+          m_newmsg.data=NULL;
           m_newmsg.message_length=0;
-          m_con->close(1);
-          return;
+          bad=1;
+          break;
         }
         m_newmsg.data->Lock();
         m_newmsg_pos=0;
       }
-    }
 
-    int padlen=PAD8(m_newmsg.message_length);
-    if (m_newmsg_pos >= 0 && m_newmsg_pos < padlen)
-    {
-      int len=padlen-m_newmsg_pos;
-      int len2=m_con->recv_bytes_available();
-      if (len > len2) len=len2;
-      if (len > 0)
-      {
-        m_con->recv_bytes((char*)m_newmsg.data->Get()+m_newmsg_pos,len);
-        m_newmsg_pos+=len;
-      }
-      if (m_newmsg_pos >= padlen) // finish crc calculation
+      int padlen=PAD8(m_newmsg.message_length);
+      if (m_newmsg_pos < padlen)
       {
-        unsigned char buf[16];
-        calc_md5(&m_newmsg,buf);
-        if (memcmp(buf,m_newmsg.message_md5,16))
+        int len=padlen-m_newmsg_pos;
+        int len2=recv_avail();
+        if (len > len2) len=len2;
+        if (len > 0)
         {
-          debug_printf("queue::run() got bad message (MD5 differs) type=%d, prio=%d, ttl=%d, len=%d\n", m_newmsg.message_type,m_newmsg.message_prio,m_newmsg.message_ttl,m_newmsg.message_length);        
-          m_newmsg.message_length=0;
-          m_newmsg_pos=-1;
-          m_con->close(1);
-          return;
+          recv_get((char*)m_newmsg.data->Get()+m_newmsg_pos,len);
+          m_newmsg_pos+=len;
         }
+        if (m_newmsg_pos < padlen) break;
       }
+      // v2 checksums are cheap, they're done here. md5s are left for check_ready()
+      if (m_v2recv && m_newmsg.message_length && !check_msg(&m_newmsg))
+      {
+        debug_printf("queue::run() got bad message (checksum differs) type=%d, prio=%d, ttl=%d, len=%d\n", m_newmsg.message_type,m_newmsg.message_prio,m_newmsg.message_ttl,m_newmsg.message_length);        
+        bad=1;
+        break;
+      }
+      m_ready[m_ready_cnt++]=m_newmsg;
+      memset(&m_newmsg,0,sizeof(m_newmsg));
+      m_newmsg_pos=-1;
+    }
+
+    if (bad || !check_ready())
+    {
+      if (m_newmsg.data) m_newmsg.data->Unlock();
+      memset(&m_newmsg,0,sizeof(m_newmsg));
+      m_newmsg_pos=-1;
+      while (m_ready_cnt > 0) 
+      {
+        T_Message *m=&m_ready[--m_ready_cnt];
+        if (m->data) m->data->Unlock();
+      }
+      m_con->close(1);
     }
   }
   else
   {
-    int do_saturate=(g_throttle_flag&32) && (m_con->get_saturatemode()&1);
+    int do_saturate=(g_throttle_flag&32) && (m_con->get_saturatemode()&1) && !m_bulk; // bulk links idle out
     int satsize=min(m_con->getMaxSendSize()/64,216);
     if (satsize < 4) satsize=4;
     if (!m_msg_used && do_saturate && m_con->send_bytes_in_queue() < 40+satsize*2 && (maxbytesend < 0 || m_con->send_bytes_in_queue()+40+satsize < maxbytesend)) saturate(satsize);
 
     while (m_msg_used>0 && (maxbytesend<0 || m_con->send_bytes_in_queue() < maxbytesend))
     {
-      if (m_msg_bsent<0)
+      int done=0, len2;
+      if (m_zsend == 2) // compressed, the whole message goes into m_zout first
       {
-        if (m_con->send_bytes_available() >= 40)
+        if (m_msg_bsent<0)
         {
-          unsigned char t[8];
-          m_con->send_bytes(&m_msg->message_md5,16);
-          t[0]=m_msg->message_type&0xff;
-          t[1]=(m_msg->message_type>>8)&0xff;
-          t[2]=(m_msg->message_type>>16)&0xff;
-          t[3]=(m_msg->message_type>>24)&0xff;
-          t[4]=m_msg->message_prio;
-          t[5]=m_msg->message_length&0xff;
-          t[6]=(m_msg->message_length>>8)&0xff;
-          t[7]=m_msg->message_ttl;
-          m_con->send_bytes(t,8);
-          m_con->send_bytes(&m_msg->message_guid,16);
-          m_msg_bsent=0;
-          if (MESSAGE_TYPE_BCAST(m_msg->message_type) &&
-              m_msg->message_length > MESSAGE_MAX_PAYLOAD_BCAST)
+          if (!zpack(m_msg))
           {
-            debug_printf("queue::run() send bcast payload length of %d too large\n",m_msg->message_length);
-          }
-          else if (m_msg->message_length > MESSAGE_MAX_PAYLOAD_ROUTE)
-          {
-            debug_printf("queue::run() send route/local payload length of %d too large\n",m_msg->message_length);
+            debug_printf("queue::run() couldn't compress message\n");
+            m_con->close(1);
+            return;
           }
+          m_msg_bsent=0;
         }
-        else break;
+        int len=m_zout_len-m_zout_pos;
+        len2=m_con->send_bytes_available();
+        if (len > len2) len=len2;
+        if (len >= 8)
+        {
+          m_con->send_bytes(m_zout+m_zout_pos,len);
+          m_zout_pos += len;
+        }
+        done=m_zout_pos >= m_zout_len;
       }
-      if (m_msg_bsent>=0)
+      else
       {
+        if (m_msg_bsent<0)
+        {
+          if (m_con->send_bytes_available() >= 40)
+          {
+            unsigned char t[40];
+            m_con->send_bytes(t,put_header(m_msg,t));
+            m_msg_bsent=0;
+            if (MESSAGE_TYPE_BCAST(m_msg->message_type) &&
+                m_msg->message_length > MESSAGE_MAX_PAYLOAD_BCAST)
+            {
+              debug_printf("queue::run() send bcast payload length of %d too large\n",m_msg->message_length);
+            }
+            else if (m_msg->message_length > MESSAGE_MAX_PAYLOAD_ROUTE)
+            {
+              debug_printf("queue::run() send route/local payload length of %d too large\n",m_msg->message_length);
+            }
+          }
+          else break;
+        }
         int len=PAD8(m_msg->message_length)-m_msg_bsent;
-        int len2=m_con->send_bytes_available();
+        len2=m_con->send_bytes_available();
         if (len > len2) len=len2;
 
         if (len >= 8)
@@ -286,19 +666,179 @@ void C_MessageQueue::run(int isrecv, int maxbytesend)
           m_con->send_bytes((char*)m_msg->data->Get()+m_msg_bsent,len);
           m_msg_bsent += len;
         }
-        if (m_msg_bsent >= m_msg->message_length)
+        done=m_msg_bsent >= m_msg->message_length;
+      }
+      if (done)
+      {
+        int type=m_msg->message_type;
+        m_msg_bsent=-1;
+        removefirst();
+        if (type == MESSAGE_LOCAL_DEFLATE) m_zsend=2; // everything after it is compressed
+        else if (type == MESSAGE_LOCAL_HDRV2) // everything after it has v2 headers
         {
-          m_msg_bsent=-1;
-          removefirst();
-          if (!m_msg_used && do_saturate && m_con->send_bytes_available() >= 40+satsize && m_con->send_bytes_in_queue() < 40+satsize*2 && (maxbytesend < 0 || m_con->send_bytes_in_queue()+40+satsize < maxbytesend)) saturate(satsize);
+          m_v2send=2;
+          memset(&m_v2guid_send,0,sizeof(m_v2guid_send));
         }
+        if (!m_msg_used && do_saturate && m_con->send_bytes_available() >= 40+satsize && m_con->send_bytes_in_queue() < 40+satsize*2 && (maxbytesend < 0 || m_con->send_bytes_in_queue()+40+satsize < maxbytesend)) saturate(satsize);
+      }
+
+      if (len2 < 8) break;
+    }
+  }
+}
+
+int C_MessageQueue::can_deflate()
+{
+#ifndef NO_ZLIB
+  return 1;
+#else
+  return 0;
+#endif
+}
 
-        if (len2 < 8) break;
+#ifndef NO_ZLIB
+
+int C_MessageQueue::start_deflate()
+{
+  if (m_zsend) return 1;
+  m_zs=(z_stream *)::calloc(1,sizeof(z_stream));
+  m_zout=(unsigned char *)::malloc(MQZ_HDR+PAD8(MQZ_MAXZ));
+  if (m_zs && m_zout && deflateInit2(m_zs,Z_DEFAULT_COMPRESSION,Z_DEFLATED,-15,8,Z_DEFAULT_STRATEGY) == Z_OK)
+  {
+    debug_printf("queue: compressing link\n");
+    put_marker(MESSAGE_LOCAL_DEFLATE);
+    m_zsend=1;
+    return 1;
+  }
+  ::free(m_zs);
+  ::free(m_zout);
+  m_zs=NULL;
+  m_zout=NULL;
+  return 0;
+}
+
+int C_MessageQueue::start_inflate()
+{
+  if (m_zr) return 0; // only once
+  m_zr=(z_stream *)::calloc(1,sizeof(z_stream));
+  m_zin=(unsigned char *)::malloc(PAD8(MQZ_MAXZ));
+  m_zraw=(unsigned char *)::malloc(MQZ_MAXRAW+64); // room past the end so inflate never stops short
+  if (m_zr && m_zin && m_zraw && inflateInit2(m_zr,-15) == Z_OK) return 1;
+  ::free(m_zr);
+  m_zr=NULL;
+  return 0;
+}
+
+int C_MessageQueue::zpack(T_Message *msg)
+{
+  unsigned char hdr[40];
+  unsigned char *out=m_zout+MQZ_HDR;
+  unsigned char *data=(unsigned char *)(msg->data?msg->data->Get():0);
+  int plen=data ? PAD8(msg->message_length) : 0;
+  int c=msg->message_type == MESSAGE_FILE_REQUEST_REPLY; // file data has its own odds
+
+  if (40+plen > MQZ_MAXRAW) return 0;
+  int hl=put_header(msg,hdr);
+  int rawlen=hl+plen, zlen=rawlen, kind=MQZ_STORED;
+  if (msg->message_type != MESSAGE_LOCAL_SATURATE) // random, don't bother
+  {
+    if (m_zskip[c] > 0) m_zskip[c]--;
+    else
+    {
+      m_zs->next_in=hdr;
+      m_zs->avail_in=hl;
+      m_zs->next_out=out;
+      m_zs->avail_out=MQZ_MAXZ;
+      int r=deflate(m_zs,Z_NO_FLUSH);
+      if (r == Z_OK)
+      {
+        m_zs->next_in=data;
+        m_zs->avail_in=plen;
+        r=deflate(m_zs,Z_SYNC_FLUSH);
+      }
+      if (r != Z_OK || m_zs->avail_in || !m_zs->avail_out) return 0;
+      zlen=MQZ_MAXZ-m_zs->avail_out;
+      kind=MQZ_DEFLATED;
+      if (zlen > rawlen-rawlen/8) // not worth it, back off
+      {
+        m_zback[c]=m_zback[c] ? min(m_zback[c]*2,MQZ_MAXBACK) : MQZ_BACKOFF;
+        m_zskip[c]=m_zback[c];
       }
+      else m_zback[c]=0;
     }
   }
+  if (kind == MQZ_STORED)
+  {
+    memcpy(out,hdr,hl);
+    if (plen) memcpy(out+hl,data,plen);
+  }
+  memset(m_zout,0,MQZ_HDR);
+  m_zout[0]=kind;
+  m_zout[2]=zlen&0xff;
+  m_zout[3]=(zlen>>8)&0xff;
+  m_zout[4]=rawlen&0xff;
+  m_zout[5]=(rawlen>>8)&0xff;
+  while (zlen&7) out[zlen++]=0;
+  m_zout_len=MQZ_HDR+zlen;
+  m_zout_pos=0;
+  m_stat_zraw+=rawlen;
+  m_stat_zsent+=m_zout_len;
+  return 1;
+}
+
+int C_MessageQueue::zunpack()
+{
+  if (m_zin_len < 0)
+  {
+    if (m_con->recv_bytes_available() < MQZ_HDR) return 0;
+    unsigned char t[MQZ_HDR];
+    m_con->recv_bytes(t,MQZ_HDR);
+    m_zin_kind=t[0];
+    m_zin_len=t[2]|(t[3]<<8);
+    m_zin_raw=t[4]|(t[5]<<8);
+    m_zin_pos=0;
+    if (m_zin_raw < 8 || m_zin_raw > MQZ_MAXRAW || (m_zin_raw&7) || m_zin_len > MQZ_MAXZ ||
+        (m_zin_kind != MQZ_DEFLATED && (m_zin_kind != MQZ_STORED || m_zin_len != m_zin_raw)))
+      return -1;
+  }
+
+  // stored blocks go straight to m_zraw
+  unsigned char *in=m_zin_kind == MQZ_STORED ? m_zraw : m_zin;
+  int padlen=PAD8(m_zin_len);
+  int len=padlen-m_zin_pos;
+  int len2=m_con->recv_bytes_available();
+  if (len > len2) len=len2;
+  if (len > 0)
+  {
+    m_con->recv_bytes(in+m_zin_pos,len);
+    m_zin_pos+=len;
+  }
+  if (m_zin_pos < padlen) return 0;
+
+  if (m_zin_kind == MQZ_DEFLATED)
+  {
+    m_zr->next_in=m_zin;
+    m_zr->avail_in=m_zin_len;
+    m_zr->next_out=m_zraw;
+    m_zr->avail_out=MQZ_MAXRAW+64;
+    int r=inflate(m_zr,Z_SYNC_FLUSH);
+    if ((r != Z_OK && r != Z_BUF_ERROR) || m_zr->avail_in || MQZ_MAXRAW+64-(int)m_zr->avail_out != m_zin_raw) return -1;
+  }
+  m_zraw_pos=0;
+  m_zraw_len=m_zin_raw;
+  m_zin_len=-1;
+  return 1;
 }
 
+#else//NO_ZLIB
+
+int C_MessageQueue::start_deflate() { return 0; }
+int C_MessageQueue::start_inflate() { return 0; }
+int C_MessageQueue::zpack(T_Message *msg) { return 0; }
+int C_MessageQueue::zunpack() { return -1; }
+
+#endif//NO_ZLIB
+
 #define __idcmp(x,y) memcmp((x),(y),16)
 
 void C_MessageQueue::add_route(T_GUID *id, unsigned char msgtype)
@@ -35,6 +35,8 @@
 // lowest bit=routed, second lowest bit = local (unless low bit set)
 
 #define MESSAGE_LOCAL_CAPS          (10)
+#define MESSAGE_LOCAL_DEFLATE       (14) // never delivered, see C_MessageQueue::start_deflate()
+#define MESSAGE_LOCAL_HDRV2         (18) // never delivered, see C_MessageQueue::start_hdrv2()
 #define MESSAGE_UPLOAD              (16)
 #define MESSAGE_CHAT                (32)
 #define MESSAGE_CHAT_REPLY          (32|1)
@@ -75,6 +77,36 @@
 #define MSGPRIO_LOCAL_SATURATE 255 // lowest possible priority
 
 
+// link compression. once a link is compressed, each message goes over it as
+// one block: MQZ_HDR bytes (kind, 0, 2 byte length, 2 byte unpacked length,
+// 0, 0) and then the block data, padded to 8. the deflate stream runs across
+// all the MQZ_DEFLATED blocks of a link, MQZ_STORED blocks skip it.
+// build with -DNO_ZLIB to leave it out.
+#define MQZ_STORED 1
+#define MQZ_DEFLATED 2
+#define MQZ_HDR 8
+#define MQZ_MAXRAW (40+MESSAGE_MAX_PAYLOAD_ROUTE)
+#define MQZ_MAXZ (MQZ_MAXRAW+MQZ_MAXRAW/1024+64)
+// when deflate saves less than an eighth of a message, the next this many
+// (doubling each time, up to MQZ_MAXBACK) messages of its kind are stored
+#define MQZ_BACKOFF 4
+#define MQZ_MAXBACK 256
+
+// v2 headers. instead of the 40 byte header, each message starts with
+//   1 byte: header length/8, |MQV2_SAMEGUID if the guid is left out
+//   4 bytes: keyed checksum (calc_sum()) of the message and its header fields
+//   varint type, varint length, 1 byte prio, 1 byte ttl
+//   16 bytes guid, unless it's the same as the last message's on the link
+// padded to 8, then the payload padded to 8 as usual. the checksum key is
+// picked by the receiving end and sent in its LOCAL_CAPS (MLC_HDRV2).
+#define MQV2_SAMEGUID 0x08
+#define MQV2_MAXHDR 32
+
+// messages run() takes off the link before their md5s are checked together
+#define MQ_RECV_BATCH 8
+
+struct z_stream_s;
+
 
 typedef struct // the header is now 40 bytes per packet. this is kinda a lot, heh. oh well.
 {
@@ -91,6 +123,7 @@ typedef struct // the header is now 40 bytes per packet. this is kinda a lot, he
 
   // etc
   C_SHBuf *data;
+  unsigned char message_nomd5; // message_md5 isn't worked out yet, it will be if it goes over a v1 link
 } T_Message;
 
 
@@ -114,9 +147,43 @@ class C_MessageQueue
 
     void run(int isrecv, int maxbytesend);
 
+    // start compressing what we send, once the other end has said it can take
+    // it (MLC_DEFLATE). the switch is marked by a MESSAGE_LOCAL_DEFLATE header.
+    // 0 if it can't be done (no zlib, out of memory), 1 if it is or will be on
+    int start_deflate();
+    int get_deflate() { return m_zsend; } // 0=off, 1=starting, 2=on
+    static int can_deflate();
+
+    // the same for v2 headers (MESSAGE_LOCAL_HDRV2), key is the other end's
+    void start_hdrv2(unsigned int key[2]);
+    int get_hdrv2() { return m_v2send; } // 0=off, 1=starting, 2=on
+    unsigned int *get_hdrv2_key() { return m_v2key_recv; } // what we want to be sent with
+    static unsigned int calc_sum(T_Message *msg, unsigned int key[2]);
+    int get_stat_zraw(void) { return m_stat_zraw; } // bytes before and after compression
+    int get_stat_zsent(void) { return m_stat_zsent; }
+
     void add_route(T_GUID *id, unsigned char msgtype);
     int is_route(T_GUID *id, unsigned char msgtype);
 
+    // a bulk link only carries file transfers between us and the other end,
+    // nothing is broadcast or relayed over it. 1=we opened it for the host
+    // with client id peer, 2=that host said yes, 3=they opened it, so who's
+    // on the other end is only their say and nothing of ours is sent down it
+    // unless it's a reply to something that came in on it.
+    void set_bulk(int bulk, T_GUID *peer=NULL) { m_bulk=bulk; if (peer) m_bulk_peer=*peer; }
+    int get_bulk() { return m_bulk; }
+    T_GUID *get_bulk_peer() { return &m_bulk_peer; }
+    // an incoming link isn't pinged until its caps say it isn't a bulk link
+    // (time it came in, 0=not waiting)
+    void set_ping_pending(time_t p) { m_ping_pending=p; }
+    time_t get_ping_pending() { return m_ping_pending; }
+    time_t bulk_lastactive() // when we last sent or got anything on it
+    {
+      unsigned int n=m_stat_send+m_stat_recv;
+      if (n != m_bulk_seen) { m_bulk_seen=n; m_bulk_time=time(NULL); }
+      return m_bulk_time;
+    }
+
     int get_stat_recv(void) { return m_stat_recv; }
     int get_stat_send(void) { return m_stat_send; }
     int get_stat_drop(void) { return m_stat_drop; }
@@ -172,6 +239,40 @@ class C_MessageQueue
 
     int find_route(T_GUID *id, int whichtab); // returns index of where route should go (or is)
 
+    int put_header(T_Message *msg, unsigned char t[40]); // returns length
+    int get_header(); // into m_newmsg, 1 if got one, -1 on error
+    int check_msg(T_Message *msg); // 1 if its md5 or checksum is ok
+    void fill_md5(T_Message *msg); // works out msg's md5, and those of the next few queued that need one
+    int check_ready(); // 1 if the md5s in m_ready are ok
+    void put_marker(int type); // queues a switch marker at the front
+    int recv_avail(); // the raw message stream, from m_zraw if the link is compressed
+    void recv_get(void *data, int len);
+
+    int m_v2send, m_v2recv;
+    unsigned int m_v2key_send[2], m_v2key_recv[2];
+    T_GUID m_v2guid_send, m_v2guid_recv; // guid of the last message each way
+    unsigned char m_v2hdr[MQV2_MAXHDR]; // v2 header being received
+    int m_v2hdr_got;
+    unsigned int m_newmsg_sum;
+
+    T_Message m_ready[MQ_RECV_BATCH]; // whole messages, recv_message() hands them out
+    int m_ready_cnt, m_ready_pos;
+
+    int start_inflate();
+    int zpack(T_Message *msg); // msg into m_zout as one block, 0 on error
+    int zunpack(); // next block into m_zraw, 0 if there isn't a whole one yet, -1 on error
+
+    int m_zsend;
+    z_stream_s *m_zs, *m_zr; // deflate for what we send, inflate for what we get
+    unsigned char *m_zout; // block being sent
+    int m_zout_pos, m_zout_len;
+    unsigned char *m_zin; // block being received, m_zin_len=-1 until its header is in
+    int m_zin_pos, m_zin_len, m_zin_kind, m_zin_raw;
+    unsigned char *m_zraw; // unpacked bytes the message parser hasn't had yet
+    int m_zraw_pos, m_zraw_len;
+    int m_zskip[2], m_zback[2]; // adaptive bypass, for file data and for everything else
+    int m_stat_zraw, m_stat_zsent;
+
     C_Connection *m_con;
     
     int m_msg_bsent;
@@ -181,6 +282,12 @@ class C_MessageQueue
     int m_stat_recv;
     int m_stat_send,m_stat_drop;
 
+    int m_bulk;
+    T_GUID m_bulk_peer;
+    time_t m_ping_pending;
+    unsigned int m_bulk_seen;
+    time_t m_bulk_time;
+
 
 };
 
@@ -33,6 +33,7 @@ C_MessageQueueList::C_MessageQueueList(void (*gm)(T_Message *message, C_MessageQ
 #endif
   m_stat_route_errors=0;
   m_run_rr=0;
+  m_bulk_rr=0;
 }
 
 C_MessageQueueList::~C_MessageQueueList()
@@ -90,7 +91,8 @@ int C_MessageQueueList::send(T_Message *msg)
     int a=find_route(&msg->message_guid, msg->message_type);
     if (a >= 0)
     {
-      C_MessageQueue::calc_md5(msg,msg->message_md5);
+      if (m_queues->Get(a)->get_bulk() == 2) a=find_bulk(m_queues->Get(a)->get_bulk_peer()); // spread over parallel links
+      msg->message_nomd5=1; // only needed if it goes over a v1 link
       m_queues->Get(a)->send_message(msg);
     }
     else if (a == -1)
@@ -111,17 +113,33 @@ int C_MessageQueueList::send(T_Message *msg)
   {
     CreateID128(&msg->message_guid);
     C_MessageQueue::calc_md5(msg,msg->message_md5);
+    msg->message_nomd5=0;
     m_local_route->add_route(&msg->message_guid, msg->message_type);
     int o;
     for (o = 0; o < m_queues->GetSize(); o ++)
     {
-      m_queues->Get(o)->send_message(msg);
+      if (!m_queues->Get(o)->get_bulk()) m_queues->Get(o)->send_message(msg);
     }
   }
   msg->data->Unlock();
   return 0;
 }
 
+int C_MessageQueueList::send_bulk(T_Message *msg, T_GUID *peer)
+{
+  int a=find_bulk(peer);
+  if (a < 0) return -1;
+  msg->message_prio = GetMessagePriority(msg->message_type);
+  msg->message_ttl=1;
+  msg->data->Lock();
+  CreateID128(&msg->message_guid);
+  msg->message_nomd5=1;
+  m_local_route->add_route(&msg->message_guid, msg->message_type);
+  m_queues->Get(a)->send_message(msg);
+  msg->data->Unlock();
+  return 0;
+}
+
 void C_MessageQueueList::run(int doRouting)
 {
   int runcnt=0;
@@ -163,12 +181,14 @@ void C_MessageQueueList::run(int doRouting)
       m_queues->Get(thisq)->run(1,-1);
       if (m_queues->Get(thisq)->recv_message(&msg)) break;
 
+      int bulk=m_queues->Get(thisq)->get_bulk();
       if (MESSAGE_TYPE_ROUTED(msg.message_type))
       {
         int r=find_route(&msg.message_guid,msg.message_type);
         if (r >= 0 && r != thisq)
         {          
-          if (msg.message_type != MESSAGE_KEYDIST_REPLY || (g_keydist_flags&4))
+          // nothing is relayed on or off a bulk link, it's for the two ends only
+          if (!bulk && !m_queues->Get(r)->get_bulk() && (msg.message_type != MESSAGE_KEYDIST_REPLY || (g_keydist_flags&4)))
           {
             msg.message_ttl--;
             if (msg.message_ttl>0) m_queues->Get(r)->send_message(&msg);
@@ -199,13 +219,13 @@ void C_MessageQueueList::run(int doRouting)
         {
           int o;
           m_queues->Get(thisq)->add_route(&msg.message_guid,msg.message_type);
-          if (msg.message_ttl>1 && doRouting && (msg.message_type != MESSAGE_KEYDIST || (g_keydist_flags&4)))
+          if (msg.message_ttl>1 && doRouting && !bulk && (msg.message_type != MESSAGE_KEYDIST || (g_keydist_flags&4)))
           {
             if (msg.message_ttl>m_max_ttl) msg.message_ttl=m_max_ttl;
             msg.message_ttl--;
             for (o = 0; o < numqueues; o ++)
             {
-              if (o != thisq) m_queues->Get(o)->send_message(&msg);
+              if (o != thisq && !m_queues->Get(o)->get_bulk()) m_queues->Get(o)->send_message(&msg);
             }
           }
           m_got_message(&msg,this,m_queues->Get(thisq)->get_con());
@@ -264,3 +284,17 @@ int C_MessageQueueList::find_route(T_GUID *id, unsigned char msgtype)
       return r;
  return -2;
 }
+
+int C_MessageQueueList::find_bulk(T_GUID *peer)
+{
+  int x, n=m_queues->GetSize(), best=-1;
+  for (x = 0; x < n; x ++)
+  {
+    int r=(x+m_bulk_rr)%n;
+    C_MessageQueue *q=m_queues->Get(r);
+    if (q->get_bulk() != 2 || memcmp(q->get_bulk_peer(),peer,sizeof(T_GUID))) continue;
+    if (best < 0 || q->getlen() < m_queues->Get(best)->getlen()) best=r;
+  }
+  if (best >= 0) m_bulk_rr=best+1;
+  return best;
+}
@@ -51,6 +51,13 @@ class C_MessageQueueList
 
     int find_route(T_GUID *id, unsigned char msgtype); // -1 = local, -2 = none, >=0 = queue
 
+    // bulk links (C_MessageQueue::set_bulk), -1 = none. with several to the
+    // same host the one with the fewest messages queued is used, for routed
+    // messages too, and ties take turns so every link stays in use. send_bulk() sends a broadcast type message to the other
+    // end only, -1 if there's no link.
+    int find_bulk(T_GUID *peer);
+    int send_bulk(T_Message *msg, T_GUID *peer);
+
     static unsigned char GetMessagePriority(int type);
 
   protected:
@@ -63,6 +70,7 @@ class C_MessageQueueList
     int m_max_ttl;
     int m_stat_route_errors;
     int m_run_rr;
+    int m_bulk_rr;
 
     void (*m_got_message)(T_Message *message, C_MessageQueueList *_this, C_Connection *cn);
 
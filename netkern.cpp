@@ -30,6 +30,17 @@
 #include "srchwnd.h"
 
 C_ItemList<C_Connection> g_new_net;
+typedef struct
+{
+  C_Connection *con; // in g_new_net
+  T_GUID peer; // client id of the host it's for
+} BulkDial;
+static C_ItemList<BulkDial> g_new_bulk; // from NetKern_ConnectBulk()
+
+// bulk links that nothing has gone over for this long are closed
+#define BULK_IDLE_SECS 120
+// most bulk links to one host, whatever directxfers_streams says
+#define BULK_MAX_STREAMS 8
 
 #ifdef _WIN32
 W_ListView g_lvnetcons;
@@ -139,6 +150,14 @@ void NetKern_ConnectToHostIfOK(int ip, int port)
   }
 }
 
+static int BulkStreams(void)
+{
+  int n=g_config->ReadInt("directxfers_streams",4);
+  if (n < 1) n=1;
+  if (n > BULK_MAX_STREAMS) n=BULK_MAX_STREAMS;
+  return n;
+}
+
 static void SendCaps(C_MessageQueue *mq)
 {
   if (mq) // send caps
@@ -151,6 +170,25 @@ static void SendCaps(C_MessageQueue *mq)
     else if (g_conspeed<20000)a=8192;
     l.add_cap(MLC_BANDWIDTH,a); // tell it our max bufsize
     l.add_cap(MLC_SATURATION,!!(g_throttle_flag&16));
+    if (C_MessageQueue::can_deflate() && g_config->ReadInt("link_deflate",1)) l.add_cap(MLC_DEFLATE,1);
+    if (g_config->ReadInt("link_hdrv2",1))
+    {
+      unsigned int *k=mq->get_hdrv2_key();
+      l.add_cap(MLC_HDRV2,(int)k[0]);
+      l.add_cap(MLC_HDRV2+1,(int)k[1]);
+    }
+    if (mq->get_bulk())
+    {
+      l.add_cap(MLC_BULK,1);
+      l.add_cap(MLC_STREAMS,BulkStreams());
+      int x;
+      for (x = 0; x < 4; x ++)
+      {
+        int v;
+        memcpy(&v,g_client_id.idc+x*4,4);
+        l.add_cap(MLC_CLIENTID+x,v);
+      }
+    }
   	T_Message msg={0,};
 	  msg.data=l.Make();
 	  if (msg.data)
@@ -176,6 +214,23 @@ void RebroadcastCaps(C_MessageQueueList *mql) // sends a local message to every
   for (x = 0; x < mql->GetNumQueues(); x ++) SendCaps(mql->GetQueue(x));
 }
 
+static int TakeBulk(C_Connection *c, T_GUID *peer=NULL) // 1 if c was from NetKern_ConnectBulk()
+{
+  int x;
+  for (x = 0; x < g_new_bulk.GetSize(); x ++)
+  {
+    BulkDial *b=g_new_bulk.Get(x);
+    if (b->con == c)
+    {
+      if (peer) *peer=b->peer;
+      free(b);
+      g_new_bulk.Del(x);
+      return 1;
+    }
+  }
+  return 0;
+}
+
 static void HandleNewOutCons(void)
 {
 #ifdef _WIN32
@@ -310,6 +365,7 @@ static void HandleNewOutCons(void)
 #endif
 
       debug_printf("Could not connect to host: failed connect!\n");
+      TakeBulk(g_new_net.Get(x));
       delete g_new_net.Get(x);
       g_new_net.Del(x--);
 #ifdef _WIN32
@@ -330,6 +386,7 @@ static void HandleNewOutCons(void)
         }
 #endif
         debug_printf("Could not connect to host: failed auth!\n");
+        TakeBulk(g_new_net.Get(x));
         delete g_new_net.Get(x);
         g_new_net.Del(x--);
 #ifdef _WIN32
@@ -346,6 +403,7 @@ static void HandleNewOutCons(void)
         }
 #endif
         debug_printf("Could not connect to host: host not in access list!\n");
+        TakeBulk(g_new_net.Get(x));
         delete g_new_net.Get(x);
         g_new_net.Del(x--);
 #ifdef _WIN32
@@ -391,9 +449,14 @@ static void HandleNewOutCons(void)
 #endif//WIN32
         debug_printf("Connected to remote host\n");
         C_MessageQueue *newq=new C_MessageQueue(g_new_net.Get(x));
+        T_GUID peer;
+        int bulk=TakeBulk(g_new_net.Get(x),&peer);
+        if (bulk) newq->set_bulk(1,&peer);
         SendCaps(newq);
         g_mql->AddMessageQueue(newq);
-        DoPing(newq);
+        // an incoming one might be a bulk link, its caps will tell
+        if (!g_new_net.Get(x)->get_remote_port()) newq->set_ping_pending(time(NULL));
+        else if (!bulk) DoPing(newq);
         g_new_net.Del(x--);
 #ifdef _WIN32
         PostMessage(g_netstatus_wnd,WM_USER_TITLEUPDATE,0,0);
@@ -403,10 +466,143 @@ static void HandleNewOutCons(void)
   }
 }
 
+static void CloseIdleBulk(void)
+{
+  static unsigned int next_check;
+  unsigned int a=GetTickCount();
+  if (a < next_check && a >= next_check-30000) return;
+  next_check=a+5000;
+
+  int x;
+  for (x = 0; x < g_mql->GetNumQueues(); x ++)
+  {
+    C_MessageQueue *q=g_mql->GetQueue(x);
+    if (q->get_bulk() && time(NULL)-q->bulk_lastactive() > BULK_IDLE_SECS)
+    {
+      debug_printf("closing idle bulk link\n");
+      q->get_con()->close();
+    }
+    // hosts that never send caps still get pinged
+    if (q->get_ping_pending() && time(NULL)-q->get_ping_pending() > 10)
+    {
+      q->set_ping_pending(0);
+      if (!q->get_bulk()) DoPing(q);
+    }
+  }
+}
+
 void NetKern_Run()
 {
   ListenToSocket();
   HandleNewOutCons();
+  CloseIdleBulk();
+}
+
+// a link of our own to the host at ip:port for file data, using the same
+// handshake as any other. both ends tell each other their client id, and if
+// the other end is the host peer we opened it for, downloads send their
+// requests straight down it. nothing else is broadcast or relayed over it,
+// and it's closed once it has been idle a while. once both ends agree,
+// whoever opened it opens more of them, up to the smaller of the two
+// MLC_STREAMS, and messages go down whichever is emptiest.
+static void OpenBulk(int ip, int port, T_GUID *peer)
+{
+  struct in_addr in;
+  in.s_addr=ip;
+  char *t=inet_ntoa(in);
+  if (!t || !*t || !isaccessable(t) || !allowIP(ip)) return;
+
+  BulkDial *b=(BulkDial *)malloc(sizeof(BulkDial));
+  if (!b) return;
+  debug_printf("opening bulk link to %s:%d\n",t,port);
+  b->con=new C_Connection(t,port,g_dns);
+  b->con->send_bytes(g_con_str,SYNC_SIZE);
+  b->peer=*peer;
+  g_new_net.Add(b->con);
+  g_new_bulk.Add(b);
+}
+
+static int CountBulk(unsigned long ip) // ours, open or opening
+{
+  int x, n=0;
+  for (x = 0; x < g_new_bulk.GetSize(); x ++)
+    if (g_new_bulk.Get(x)->con->get_remote() == ip) n++;
+  for (x = 0; x < g_mql->GetNumQueues(); x ++)
+  {
+    C_MessageQueue *q=g_mql->GetQueue(x);
+    if ((q->get_bulk() == 1 || q->get_bulk() == 2) && q->get_con()->get_remote() == ip) n++;
+  }
+  return n;
+}
+
+void NetKern_ConnectBulk(int ip, int port, T_GUID *peer)
+{
+  if (!CountBulk((unsigned long)ip)) OpenBulk(ip,port,peer);
+}
+
+void NetKern_OnCaps(C_MessageLocalCaps *mlc, C_Connection *cn)
+{
+  int x, bulk=0, streams=1, have=0, deflate=0, havekey=0;
+  unsigned int key[2];
+  T_GUID peer;
+  for (x = 0; x < mlc->get_numcaps(); x ++)
+  {
+    int n,v;
+    mlc->get_cap(x,&n,&v);
+    if (n == MLC_BULK) bulk=v;
+    else if (n == MLC_STREAMS) streams=v;
+    else if (n == MLC_DEFLATE) deflate=v;
+    else if (n == MLC_HDRV2 || n == MLC_HDRV2+1)
+    {
+      key[n-MLC_HDRV2]=(unsigned int)v;
+      havekey|=1<<(n-MLC_HDRV2);
+    }
+    else if (n >= MLC_CLIENTID && n < MLC_CLIENTID+4)
+    {
+      memcpy(peer.idc+(n-MLC_CLIENTID)*4,&v,4);
+      have|=1<<(n-MLC_CLIENTID);
+    }
+  }
+  if (!cn) return;
+
+  for (x = 0; x < g_mql->GetNumQueues(); x ++)
+  {
+    C_MessageQueue *q=g_mql->GetQueue(x);
+    if (q->get_con() != cn) continue;
+    if (deflate && g_config->ReadInt("link_deflate",1)) q->start_deflate();
+    if (havekey == 3 && key[0] && g_config->ReadInt("link_hdrv2",1)) q->start_hdrv2(key);
+    if (!bulk || have != 15)
+    {
+      if (q->get_ping_pending()) DoPing(q);
+      q->set_ping_pending(0);
+      return;
+    }
+    q->set_ping_pending(0);
+    int asked=q->get_bulk();
+    if (asked == 2 || asked == 3) return; // already agreed
+    if (!asked)
+    {
+      // they asked. anyone can say they're anyone, so this one only
+      // carries what they send us and our replies to it.
+      debug_printf("link is a bulk link\n");
+      q->set_bulk(3);
+      SendCaps(q); // tell them who we are
+      return;
+    }
+    if (memcmp(&peer,q->get_bulk_peer(),sizeof(T_GUID)))
+    {
+      debug_printf("bulk link isn't to the host we opened it for, closing\n");
+      q->get_con()->close();
+      return;
+    }
+    debug_printf("link is a bulk link\n");
+    q->set_bulk(2);
+    int want=BulkStreams();
+    if (want > streams) want=streams;
+    int n=CountBulk(cn->get_remote());
+    while (n++ < want) OpenBulk(cn->get_remote(),cn->get_remote_port(),&peer);
+    return;
+  }
 }
 
 void AddConnection(char *str, int port, int rating)
@@ -20,6 +20,8 @@
 #ifndef _NETKERN_H_
 #define _NETKERN_H_
 
+class C_MessageLocalCaps;
+
 extern C_ItemList<C_Connection> g_new_net;
 
 #ifdef _WIN32
@@ -32,6 +34,8 @@ void AddConnection(char *str, int port, int rating);
 void DoPing(C_MessageQueue *mq);
 void RebroadcastCaps(C_MessageQueueList *mql);
 void NetKern_ConnectToHostIfOK(int ip, int port);
+void NetKern_ConnectBulk(int ip, int port, T_GUID *peer);
+void NetKern_OnCaps(C_MessageLocalCaps *mlc, C_Connection *cn); // for MESSAGE_LOCAL_CAPS
 
 #ifdef _WIN32
 BOOL WINAPI Net_DlgProc(HWND hwndDlg, UINT uMsg, WPARAM wParam, LPARAM lParam);
@@ -20,6 +20,14 @@
 #ifndef _C_SHBUF_H_
 #define _C_SHBUF_H_
 
+// buffers of SHBUF_POOL_MIN to SHBUF_POOL_MIN<<(SHBUF_POOL_CLASSES-1) bytes
+// (file data mostly) are made and dropped all the time, New() hands them out
+// from free lists by power of two size class instead of the heap. like the
+// queues that pass buffers around, that's core thread only.
+#define SHBUF_POOL_MIN 4096
+#define SHBUF_POOL_CLASSES 4
+#define SHBUF_POOL_KEEP 64 // per class
+
 class C_SHBuf
 {
   public:
@@ -28,10 +36,44 @@ class C_SHBuf
       m_dlen=length;
       m_d=malloc((length+7)&~7);
       m_refcnt=0; 
+      m_class=-1;
+      m_next=NULL;
     }
     ~C_SHBuf() { free(m_d); }
+    static C_SHBuf *New(int length)
+    {
+      if (length <= SHBUF_POOL_MIN/2 || length > (SHBUF_POOL_MIN<<(SHBUF_POOL_CLASSES-1))) return new C_SHBuf(length);
+      int c=0;
+      while ((SHBUF_POOL_MIN<<c) < length) c++;
+      Pool *p=pool();
+      C_SHBuf *b=p->free[c];
+      if (b)
+      {
+        p->free[c]=b->m_next;
+        p->nfree[c]--;
+      }
+      else
+      {
+        b=new C_SHBuf(SHBUF_POOL_MIN<<c);
+        if (b->m_d) b->m_class=c;
+      }
+      b->m_dlen=length;
+      b->m_refcnt=0;
+      return b;
+    }
     void Lock(void) { m_refcnt++; }
-    void Unlock(void) { if (!--m_refcnt) delete this; }
+    void Unlock(void) 
+    { 
+      if (--m_refcnt) return;
+      Pool *p=pool();
+      if (m_class < 0 || p->nfree[m_class] >= SHBUF_POOL_KEEP) delete this;
+      else
+      {
+        m_next=p->free[m_class];
+        p->free[m_class]=this;
+        p->nfree[m_class]++;
+      }
+    }
     void *Get(void) { return m_d; }
     int  GetLength(void) { return m_dlen; };
 
@@ -39,6 +81,15 @@ class C_SHBuf
     void *m_d;
     int m_dlen;
     int m_refcnt;
+    int m_class; // pool size class, -1 if it's not pooled
+    C_SHBuf *m_next; // free list
+
+    typedef struct
+    {
+      C_SHBuf *free[SHBUF_POOL_CLASSES];
+      int nfree[SHBUF_POOL_CLASSES];
+    } Pool;
+    static Pool *pool() { static Pool p; return &p; }
 };
 
 
@@ -194,6 +194,7 @@ void main_MsgCallback(T_Message *message, C_MessageQueueList *_this, C_Connectio
             break;
           }
         }
+        NetKern_OnCaps(&mlc,cn);
       }
 
     break;
@@ -293,27 +294,23 @@ void main_MsgCallback(T_Message *message, C_MessageQueueList *_this, C_Connectio
         if (!memcmp(r->get_guid(),&g_client_id,sizeof(g_client_id)))
         {
           int n=g_sends.GetSize();
-          int x;
-          for (x = 0; x < n; x ++)
+          XferSend *xs=XferSend::Find(r->get_prev_guid());
+          if (xs)
           {
-            if (!memcmp(r->get_prev_guid(),g_sends.Get(x)->get_guid(),16))
+/*            if (r->is_abort()==2)
             {
-/*              if (r->is_abort()==2)
+              int a=xs->GetIdx()-UPLOAD_BASE_IDX;
+              if (a >= 0 && a < g_uploads.GetSize())
               {
-                int a=g_sends.Get(x)->GetIdx()-UPLOAD_BASE_IDX;
-                if (a >= 0 && a < g_uploads.GetSize())
-                {
-                  free(g_uploads.Get(a));
-                  g_uploads.Set(a,NULL);
-                }
+                free(g_uploads.Get(a));
+                g_uploads.Set(a,NULL);
               }
-              */
-              g_sends.Get(x)->set_guid(&message->message_guid);
-              g_sends.Get(x)->onGotMsg(r);
-              break;
             }
+            */
+            xs->set_guid(&message->message_guid);
+            xs->onGotMsg(r);
           }
-          if (x == n && !r->is_abort()) // new file request
+          else if (!r->is_abort()) // new file request
           {
             if (g_config->ReadInt("limit_uls",1) && n < g_config->ReadInt("ul_limit",160))
             {
@@ -360,15 +357,11 @@ void main_MsgCallback(T_Message *message, C_MessageQueueList *_this, C_Connectio
     break;
     case MESSAGE_FILE_REQUEST_REPLY:
       {
-        int n=g_recvs.GetSize();
-        int x;
-        for (x = 0; x < n; x ++)
+        XferRecv *xr=XferRecv::Find(&message->message_guid);
+        if (xr)
         {
-          if (!memcmp(g_recvs.Get(x)->get_guid(),&message->message_guid,16))
-          {
-            g_recvs.Get(x)->onGotMsg(new C_FileSendReply(message->data));
-            break;
-          }
+          C_FileSendReply reply(message->data);
+          xr->onGotMsg(&reply,&message->message_guid);
         }
       }
     break;
@@ -707,6 +700,10 @@ int main(int argc, char **argv)
               g_newdatabase=0;
             }
           }
+          else if (g_database && g_config->ReadInt("shafiles",1) && g_config->ReadInt("db_bghash",1))
+          {
+            g_database->HashStep(10,g_config->ReadInt("maxsizesha",32)*1024*1024);
+          }
 
           int lastqueues=g_mql->GetNumQueues();
 
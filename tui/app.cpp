@@ -94,6 +94,7 @@ std::string formatSize(uint64_t bytes) {
 
 std::string transferStatusStr(TransferStatus status) {
     switch (status) {
+        case TransferStatus::Preparing: return "Preparing";
         case TransferStatus::Active: return "Active";
         case TransferStatus::Paused: return "Paused";
         case TransferStatus::Queued: return "Queued";
@@ -385,6 +386,21 @@ void App::setupCoreCallbacks() {
         refresh();
     };
 
+    // Transfer status (preparing -> active, done, failed)
+    core_->onTransferStatusChanged = [this](int id, TransferStatus status, const std::string& error) {
+        post([this, id, status, error] {
+            std::lock_guard<std::mutex> lock(state_.mutex());
+            for (auto& t : state_.transfers()) {
+                if (t.id == id) {
+                    t.status = status;
+                    t.errorMsg = error;
+                    break;
+                }
+            }
+        });
+        refresh();
+    };
+
     // Chat message
     core_->onChatMessage = [this](const ChatMessage& msg) {
         post([this, msg] {
@@ -2301,6 +2317,10 @@ Component App::buildTransfersView() {
             std::string status;
             Color statusColor = Color::Default;
             switch (xfer.status) {
+                case TransferStatus::Preparing:
+                    status = "PREPARING";
+                    statusColor = th.primary;
+                    break;
                 case TransferStatus::Active:
                     status = formatSpeed(xfer.speedKBps);
                     statusColor = th.success;
@@ -30,6 +30,7 @@
 #include "m_ping.h"
 #include "m_search.h"
 #include "m_file.h"
+#include "m_lcaps.h"
 #include "config.h"
 #include "filedb.h"
 #include "xfers.h"
@@ -94,6 +95,9 @@ char *g_def_extlist = (char*)"mp3;ogg;flac;wav;avi;mkv;mp4;zip;rar;7z;pdf;doc;tx
 C_ItemList<XferSend> g_sends;
 C_ItemList<XferRecv> g_recvs;
 
+// Downloads waiting for a slot (recv_maxdl, recv_maxdl_host)
+static C_RecvQueue g_recvqueue;
+
 // Download path (config-driven)
 static std::string g_download_path;
 
@@ -107,6 +111,38 @@ static waste::WasteCore* g_waste_core_instance = nullptr;
 static std::string g_browse_path;
 static std::mutex g_browse_mutex;
 
+// Remote hits of the current search, so a download can also pull the file
+// from the other peers that have it (protected by WasteCore::mutex_)
+struct SearchHit {
+    std::string guididx;
+    std::string filename;
+    uint64_t size;
+};
+static std::vector<SearchHit> g_search_hits;
+
+static std::string hitBaseName(const std::string& fn) {
+    size_t p = fn.find_last_of("/\\");
+    return p == std::string::npos ? fn : fn.substr(p + 1);
+}
+
+// Same name and size elsewhere in the results: queue those peers as
+// extra sources for download id, XferRecv only uses them if the hash
+// matches too. Taken now, the results may be gone by the time it starts.
+static void addExtraSources(int id, const std::string& guididx) {
+    const SearchHit* hit = nullptr;
+    for (const auto& h : g_search_hits) {
+        if (h.guididx == guididx) { hit = &h; break; }
+    }
+    if (!hit) return;
+    for (const auto& h : g_search_hits) {
+        if (&h == hit || h.size != hit->size ||
+            hitBaseName(h.filename) != hitBaseName(hit->filename)) continue;
+        if (g_recvqueue.addSource(id, (char*)h.guididx.c_str(), (char*)h.filename.c_str())) {
+            debug_printf("[XFER] Extra source %s for '%s'\n", h.guididx.c_str(), hit->filename.c_str());
+        }
+    }
+}
+
 // Message callback - called by g_mql when messages arrive
 // Note: main_MsgCallback is already declared extern in main.h
 void main_MsgCallback(T_Message *message, C_MessageQueueList *_this, C_Connection *cn) {
@@ -114,6 +150,14 @@ void main_MsgCallback(T_Message *message, C_MessageQueueList *_this, C_Connectio
 
     // Handle different message types
     switch (message->message_type) {
+        case MESSAGE_LOCAL_CAPS:
+            // Bulk transfer links (directxfers) and link compression are set up here
+            {
+                C_MessageLocalCaps mlc(message->data);
+                NetKern_OnCaps(&mlc, cn);
+            }
+            break;
+
         case MESSAGE_CHAT_REPLY:
             // Chat reply - contains only the replying peer's nickname
             debug_printf("[CHAT_REPLY] Received (len=%d, data=%p)\n",
@@ -397,6 +441,11 @@ void main_MsgCallback(T_Message *message, C_MessageQueueList *_this, C_Connectio
                         int sizeLow, sizeHigh, fileTime;
 
                         if (reply.get_item(i, &id, filename, metadata, &sizeLow, &sizeHigh, &fileTime) == 0) {
+                            char hitGuid[33];
+                            MakeID128Str(reply.get_guid(), hitGuid);
+                            g_search_hits.push_back({std::string(hitGuid) + ":" + std::to_string(id), filename,
+                                ((uint64_t)sizeHigh << 32) | (uint64_t)(unsigned int)sizeLow});
+
                             if (g_waste_core_instance->onSearchResult) {
                                 waste::SearchResult result;
                                 result.filename = filename;
@@ -430,20 +479,17 @@ void main_MsgCallback(T_Message *message, C_MessageQueueList *_this, C_Connectio
                 // Check if this request is for us
                 if (!memcmp(r->get_guid(), &g_client_id, sizeof(g_client_id))) {
                     int n = g_sends.GetSize();
-                    int x;
 
                     // Check if this is a follow-up to an existing transfer
-                    for (x = 0; x < n; x++) {
-                        if (!memcmp(r->get_prev_guid(), g_sends.Get(x)->get_guid(), 16)) {
-                            // Update existing transfer
-                            g_sends.Get(x)->set_guid(&message->message_guid);
-                            g_sends.Get(x)->onGotMsg(r);
-                            break;
-                        }
+                    XferSend *existing = XferSend::Find(r->get_prev_guid());
+                    if (existing) {
+                        // Update existing transfer
+                        existing->set_guid(&message->message_guid);
+                        existing->onGotMsg(r);
                     }
 
                     // New file request
-                    if (x == n && !r->is_abort()) {
+                    else if (!r->is_abort()) {
                         int maxUploads = g_config ? g_config->ReadInt((char*)"ul_limit", 160) : 160;
                         if (n < maxUploads) {
                             char fn[2048];
@@ -471,7 +517,8 @@ void main_MsgCallback(T_Message *message, C_MessageQueueList *_this, C_Connectio
                                         info.id = (int)(intptr_t)xfer;  // Use pointer as ID
                                         info.filename = xfer->GetName();
                                         info.direction = waste::TransferDirection::Upload;
-                                        info.status = waste::TransferStatus::Active;
+                                        info.status = xfer->IsPreparing() ? waste::TransferStatus::Preparing
+                                                                          : waste::TransferStatus::Queued;
                                         unsigned int sizeLow, sizeHigh;
                                         xfer->GetSize(&sizeLow, &sizeHigh);
                                         info.totalSize = ((uint64_t)sizeHigh << 32) | sizeLow;
@@ -504,14 +551,10 @@ void main_MsgCallback(T_Message *message, C_MessageQueueList *_this, C_Connectio
         case MESSAGE_FILE_REQUEST_REPLY:
             // Handle file data/header from peer (we're downloading)
             {
-                int n = g_recvs.GetSize();
-                for (int x = 0; x < n; x++) {
-                    if (!memcmp(g_recvs.Get(x)->get_guid(), &message->message_guid, 16)) {
-                        C_FileSendReply *reply = new C_FileSendReply(message->data);
-                        g_recvs.Get(x)->onGotMsg(reply);
-                        // Note: onGotMsg takes ownership of reply, don't delete
-                        break;
-                    }
+                XferRecv *recv = XferRecv::Find(&message->message_guid);
+                if (recv) {
+                    C_FileSendReply reply(message->data);
+                    recv->onGotMsg(&reply, &message->message_guid);
                 }
             }
             break;
@@ -1373,6 +1416,10 @@ void WasteCore::processMessages() {
                 g_newdatabase = nullptr;
                 impl_->scanningFiles = false;
             }
+        } else if (g_database && g_config && g_config->ReadInt((char*)"shafiles", 1) &&
+                   g_config->ReadInt((char*)"db_bghash", 1)) {
+            // Hash shared files while idle so uploads don't have to
+            g_database->HashStep(10, g_config->ReadInt((char*)"maxsizesha", 32) * 1024 * 1024);
         }
     }
 }
@@ -1386,6 +1433,7 @@ void WasteCore::processTransfers() {
         if (!send) continue;
 
         // Process header if needed
+        bool preparing = send->IsPreparing();
         int headerResult = send->run_hdr(g_mql);
         if (headerResult) {
             // Transfer finished (completed or error)
@@ -1415,8 +1463,35 @@ void WasteCore::processTransfers() {
             continue;
         }
 
-        // Send data chunks
-        send->run(g_mql);
+        if (preparing) {
+            // File is opened and hashed off-thread, the header goes out once that's done
+            if (send->IsPreparing()) continue;
+            if (onTransferStatusChanged) {
+                onTransferStatusChanged((int)(intptr_t)send,
+                    send->IsQueued() ? TransferStatus::Queued : TransferStatus::Active, "");
+            }
+        }
+    }
+
+    // Send data chunks, sharing the upload slots and bandwidth between them.
+    // A send can get a slot or, once it's gone idle, lose it to a waiting one
+    std::vector<std::pair<XferSend*, bool>> slots;
+    for (int x = 0; x < g_sends.GetSize(); x++) {
+        XferSend* send = g_sends.Get(x);
+        if (send && !send->IsPreparing()) slots.push_back({send, send->IsQueued() != 0});
+    }
+    XferSend::RunAll(&g_sends, g_mql);
+    for (const auto& s : slots) {
+        bool queued = s.first->IsQueued() != 0;
+        if (queued != s.second && onTransferStatusChanged) {
+            onTransferStatusChanged((int)(intptr_t)s.first,
+                queued ? TransferStatus::Queued : TransferStatus::Active, "");
+        }
+    }
+
+    for (int x = 0; x < g_sends.GetSize(); x++) {
+        XferSend* send = g_sends.Get(x);
+        if (!send || send->IsPreparing()) continue;
 
         // Report upload progress
         if (onTransferProgress) {
@@ -1434,6 +1509,30 @@ void WasteCore::processTransfers() {
         }
     }
 
+    // Start queued downloads as slots free up
+    if (g_recvqueue.GetSize()) {
+        int maxdl = g_config->ReadInt((char*)"recv_maxdl", 4);
+        int maxhost = g_config->ReadInt((char*)"recv_maxdl_host", 1);
+        if (maxhost & 0x80000000) maxhost = 0;  // per host limit turned off
+        XferRecv* recv;
+        while ((recv = g_recvqueue.run(&g_recvs, g_mql, maxdl, maxhost)) != nullptr) {
+            char* err = recv->GetError();
+            if (err) {
+                debug_printf("[XFER] Download failed to start: %s\n", err);
+                if (onTransferStatusChanged) {
+                    onTransferStatusChanged(recv->GetTag(), TransferStatus::Failed, err);
+                }
+                delete recv;
+                continue;
+            }
+            g_recvs.Add(recv);
+            debug_printf("[XFER] Download started: %s\n", recv->GetGuidIdx());
+            if (onTransferStatusChanged) {
+                onTransferStatusChanged(recv->GetTag(), TransferStatus::Active, "");
+            }
+        }
+    }
+
     // Process active downloads (XferRecv)
     for (int x = 0; x < g_recvs.GetSize(); x++) {
         XferRecv* recv = g_recvs.Get(x);
@@ -1450,12 +1549,12 @@ void WasteCore::processTransfers() {
             // Report final progress (100%) before status change
             if (completed && onTransferProgress) {
                 uint64_t totalSize = ((uint64_t)recv->getBytesTotalHigh() << 32) | recv->getBytesTotalLow();
-                onTransferProgress((int)(intptr_t)recv, totalSize, totalSize, 0);
+                onTransferProgress(recv->GetTag(), totalSize, totalSize, 0);
             }
 
             // Notify TUI of completion
             if (onTransferStatusChanged) {
-                onTransferStatusChanged((int)(intptr_t)recv,
+                onTransferStatusChanged(recv->GetTag(),
                     completed ? TransferStatus::Completed : TransferStatus::Failed,
                     err ? err : "");
             }
@@ -1475,7 +1574,7 @@ void WasteCore::processTransfers() {
                 // Get total size from the recv object
                 uint64_t totalSize = ((uint64_t)recv->getBytesTotalHigh() << 32) | recv->getBytesTotalLow();
                 float speedKBps = recv->getSpeedCps() / 1024.0f;
-                onTransferProgress((int)(intptr_t)recv, transferred, totalSize, speedKBps);
+                onTransferProgress(recv->GetTag(), transferred, totalSize, speedKBps);
             }
         }
     }
@@ -1490,7 +1589,7 @@ void WasteCore::updatePeerListFromConnections() {
     // For each queue, check if we have it in our peer list
     for (int i = 0; i < numQueues; i++) {
         C_MessageQueue* q = g_mql->GetQueue(i);
-        if (!q) continue;
+        if (!q || q->get_bulk()) continue;  // transfer-only links aren't peers
 
         C_Connection* conn = q->get_con();
         if (!conn) continue;
@@ -1868,6 +1967,8 @@ void WasteCore::search(const std::string& query) {
     std::lock_guard<std::mutex> lock(mutex_);
 
     if (!impl_->simulationMode && g_mql) {
+        g_search_hits.clear();
+
         // First, search local database for our own shared files
         if (g_database && g_database->GetNumFiles() > 0) {
             debug_printf("[SEARCH] Searching local database (%d files) for '%s'\n",
@@ -1985,7 +2086,6 @@ void WasteCore::cancelSearch() {
 
 // Transfers
 void WasteCore::downloadFile(const std::string& hash, const std::string& peer) {
-    // Don't hold lock when creating XferRecv - it sends network messages
     if (!impl_->simulationMode && g_mql) {
         // hash is in format "GUID:index" from search result
         // peer contains filename from search
@@ -2014,30 +2114,24 @@ void WasteCore::downloadFile(const std::string& hash, const std::string& peer) {
             return;
         }
 
-        XferRecv* recv = new XferRecv(g_mql,
-            (char*)guididx.c_str(),
-            (char*)sizestr.c_str(),
-            (char*)filename.c_str(),
-            (char*)downloadPath.c_str());
-
-        char* err = recv->GetError();
-        if (err) {
-            debug_printf("[XFER] Download failed to start: %s\n", err);
-            delete recv;
-            return;
-        }
-
+        // Started from processTransfers() once there's a slot for it
+        int id;
         {
             std::lock_guard<std::mutex> lock(mutex_);
-            g_recvs.Add(recv);
+            id = g_recvqueue.add((char*)guididx.c_str(),
+                (char*)sizestr.c_str(),
+                (char*)filename.c_str(),
+                (char*)downloadPath.c_str());
+            if (id && g_config->ReadInt((char*)"recv_multisource", 1)) addExtraSources(id, guididx);
         }
+        if (!id) return;  // already queued
 
         // Create transfer info for UI
         TransferInfo xfer;
-        xfer.id = (int)(intptr_t)recv;  // Use pointer as ID
+        xfer.id = id;  // XferRecv tag once it starts
         xfer.filename = filename;
         xfer.direction = TransferDirection::Download;
-        xfer.status = TransferStatus::Active;
+        xfer.status = TransferStatus::Queued;
         xfer.totalSize = 0;  // Will be updated when header arrives
         xfer.transferred = 0;
         xfer.speedKBps = 0;
@@ -2110,10 +2204,19 @@ void WasteCore::resumeTransfer(int id) {
 void WasteCore::cancelTransfer(int id) {
     // Try to cancel real transfers first (without holding lock for network ops)
     if (!impl_->simulationMode && g_mql) {
-        // Check downloads
+        // Check downloads, queued ones first
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (g_recvqueue.remove(id)) {
+                if (onTransferStatusChanged) {
+                    onTransferStatusChanged(id, TransferStatus::Failed, "Cancelled");
+                }
+                return;
+            }
+        }
         for (int x = 0; x < g_recvs.GetSize(); x++) {
             XferRecv* recv = g_recvs.Get(x);
-            if (recv && (int)(intptr_t)recv == id) {
+            if (recv && recv->GetTag() == id) {
                 recv->Abort(g_mql);
                 delete recv;
                 g_recvs.Del(x);
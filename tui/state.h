@@ -46,7 +46,8 @@ enum class TransferStatus {
     Paused,
     Queued,
     Completed,
-    Failed
+    Failed,
+    Preparing   // upload opening/hashing the file
 };
 
 enum class TransferDirection {
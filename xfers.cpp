@@ -19,16 +19,443 @@
 
 #include "main.h"
 #include "xfers.h"
-#ifdef _WIN32
 #include "xferwnd.h"
+#ifdef _WIN32
 #include "srchwnd.h"
 #endif
 
 #include "netkern.h"
 #include "rsa/md5.h"
 
-#define IS_VALID(x) (m_validbf[(x)>>3]&(1<<(x&7)))
-#define SET_VALID(x) m_validbf[(x)>>3]|=(1<<(x&7))
+
+static C_ChunkCache *g_chunkcache;
+static C_XferIO *g_xferio;
+static C_XferGuidMap g_send_guids, g_recv_guids;
+
+C_XferGuidMap::C_XferGuidMap()
+{
+  m_tab=0;
+  m_mask=0;
+  m_used=0;
+  m_seed=0;
+}
+
+C_XferGuidMap::~C_XferGuidMap()
+{
+  free(m_tab);
+}
+
+// guids come off the wire, so they're mixed with a seed of ours rather than trusted to be random
+unsigned int C_XferGuidMap::slot(T_GUID *guid)
+{
+  unsigned int w[4], h=m_seed, x;
+  memcpy(w,guid,16);
+  for (x = 0; x < 4; x ++)
+  {
+    h^=w[x];
+    h*=0x9E3779B1;
+    h^=h>>15;
+  }
+  return h & m_mask;
+}
+
+void C_XferGuidMap::grow()
+{
+  Ent *old=m_tab;
+  unsigned int x, n=old ? m_mask+1 : 0, ns=n ? n*2 : 64;
+  Ent *t=(Ent *)calloc(ns,sizeof(Ent));
+  if (!t) return;
+  if (!m_seed) m_seed=GetTickCount()^(unsigned int)time(NULL)^(unsigned int)(size_t)this;
+  m_tab=t;
+  m_mask=ns-1;
+  m_used=0;
+  for (x = 0; x < n; x ++) if (old[x].item) add(&old[x].guid,old[x].item);
+  free(old);
+}
+
+void C_XferGuidMap::add(T_GUID *guid, void *item)
+{
+  if (!m_tab || (m_used+1)*4 > (m_mask+1)*3) grow();
+  if (!m_tab) return;
+  unsigned int i=slot(guid);
+  while (m_tab[i].item)
+  {
+    if (!memcmp(&m_tab[i].guid,guid,sizeof(T_GUID)))
+    {
+      m_tab[i].item=item;
+      return;
+    }
+    i=(i+1)&m_mask;
+  }
+  m_tab[i].guid=*guid;
+  m_tab[i].item=item;
+  m_used++;
+}
+
+void C_XferGuidMap::del(T_GUID *guid, void *item)
+{
+  if (!m_tab) return;
+  unsigned int i=slot(guid);
+  while (m_tab[i].item && memcmp(&m_tab[i].guid,guid,sizeof(T_GUID))) i=(i+1)&m_mask;
+  if (m_tab[i].item != item) return;
+  m_tab[i].item=NULL;
+  m_used--;
+  // pull later entries of the run back over the hole so lookups don't stop short
+  unsigned int j=i;
+  for (;;)
+  {
+    j=(j+1)&m_mask;
+    if (!m_tab[j].item) break;
+    unsigned int k=slot(&m_tab[j].guid);
+    if (((j-k)&m_mask) < ((j-i)&m_mask)) continue; // its slot is between the hole and it
+    m_tab[i]=m_tab[j];
+    m_tab[j].item=NULL;
+    i=j;
+  }
+}
+
+void *C_XferGuidMap::find(T_GUID *guid)
+{
+  if (!m_tab) return NULL;
+  unsigned int i=slot(guid);
+  while (m_tab[i].item)
+  {
+    if (!memcmp(&m_tab[i].guid,guid,sizeof(T_GUID))) return m_tab[i].item;
+    i=(i+1)&m_mask;
+  }
+  return NULL;
+}
+
+C_ChunkCache::C_ChunkCache(int maxbytes)
+{
+  m_max=maxbytes > 0 ? maxbytes/FILE_CHUNKSIZE : 0;
+  m_data=0;
+  m_ents=0;
+  m_hash=0;
+  m_hash_mask=0;
+  m_head=m_tail=-1;
+  m_used=0;
+  m_files=0;
+  m_files_used=m_files_size=0;
+}
+
+C_ChunkCache::~C_ChunkCache()
+{
+  int x;
+  for (x = 0; x < m_files_used; x ++) free(m_files[x].fn);
+  free(m_files);
+  free(m_data);
+  free(m_ents);
+  free(m_hash);
+}
+
+int C_ChunkCache::addFile(char *fn, unsigned int len_l, unsigned int len_h, unsigned int mtime)
+{
+  if (m_max < XFER_READAHEAD) return -1;
+  int x, freeslot=-1;
+  for (x = 0; x < m_files_used; x ++)
+  {
+    FileEnt *f=m_files+x;
+    if (!f->refs && !f->nchunks)
+    {
+      if (freeslot < 0) freeslot=x;
+    }
+    else if (f->len_l == len_l && f->len_h == len_h && f->mtime == mtime && !strcmp(f->fn,fn))
+    {
+      f->refs++;
+      return x;
+    }
+  }
+  if (freeslot < 0)
+  {
+    if (m_files_used >= m_files_size)
+    {
+      int ns=m_files_size ? m_files_size*2 : 16;
+      FileEnt *n=(FileEnt *)realloc(m_files,ns*sizeof(FileEnt));
+      if (!n) return -1;
+      m_files=n;
+      m_files_size=ns;
+    }
+    freeslot=m_files_used++;
+  }
+  else free(m_files[freeslot].fn);
+  FileEnt *f=m_files+freeslot;
+  f->fn=strdup(fn);
+  f->len_l=len_l;
+  f->len_h=len_h;
+  f->mtime=mtime;
+  f->refs=1;
+  f->nchunks=0;
+  return freeslot;
+}
+
+// the chunks stay around for whoever asks for the file next
+void C_ChunkCache::releaseFile(int f)
+{
+  if (f >= 0 && f < m_files_used && m_files[f].refs > 0) m_files[f].refs--;
+}
+
+int C_ChunkCache::find(int f, unsigned int idx)
+{
+  if (!m_hash) return -1;
+  int e=m_hash[hashslot(f,idx)];
+  while (e >= 0 && (m_ents[e].file != f || m_ents[e].idx != idx)) e=m_ents[e].hnext;
+  return e;
+}
+
+void C_ChunkCache::unlink(int e)
+{
+  ChunkEnt *c=m_ents+e;
+  if (c->prev >= 0) m_ents[c->prev].next=c->next;
+  else m_head=c->next;
+  if (c->next >= 0) m_ents[c->next].prev=c->prev;
+  else m_tail=c->prev;
+}
+
+void C_ChunkCache::pushFront(int e)
+{
+  m_ents[e].prev=-1;
+  m_ents[e].next=m_head;
+  if (m_head >= 0) m_ents[m_head].prev=e;
+  else m_tail=e;
+  m_head=e;
+}
+
+void C_ChunkCache::drop(int e)
+{
+  ChunkEnt *c=m_ents+e;
+  int *p=m_hash+hashslot(c->file,c->idx);
+  while (*p != e) p=&m_ents[*p].hnext;
+  *p=c->hnext;
+  m_files[c->file].nchunks--;
+  c->file=-1;
+}
+
+unsigned char *C_ChunkCache::get(int f, unsigned int idx, unsigned int *len)
+{
+  int e=find(f,idx);
+  if (e < 0) return NULL;
+  if (e != m_head)
+  {
+    unlink(e);
+    pushFront(e);
+  }
+  *len=m_ents[e].len;
+  return m_data+(size_t)e*FILE_CHUNKSIZE;
+}
+
+void C_ChunkCache::put(int f, unsigned int idx, unsigned char *data, unsigned int len)
+{
+  if (f < 0 || !len || len > FILE_CHUNKSIZE) return;
+  if (!m_data)
+  {
+    unsigned int hs=16;
+    while (hs < (unsigned int)m_max*2) hs<<=1;
+    m_data=(unsigned char *)malloc((size_t)m_max*FILE_CHUNKSIZE);
+    m_ents=(ChunkEnt *)malloc(m_max*sizeof(ChunkEnt));
+    m_hash=(int *)malloc(hs*sizeof(int));
+    if (!m_data || !m_ents || !m_hash)
+    {
+      free(m_data);
+      free(m_ents);
+      free(m_hash);
+      m_data=0;
+      m_ents=0;
+      m_hash=0;
+      m_max=0; // don't try again
+      return;
+    }
+    memset(m_hash,0xff,hs*sizeof(int));
+    m_hash_mask=hs-1;
+  }
+
+  int e=find(f,idx);
+  if (e >= 0) unlink(e);
+  else
+  {
+    if (m_used < m_max) e=m_used++;
+    else // take the least recently used
+    {
+      e=m_tail;
+      unlink(e);
+      drop(e);
+    }
+    ChunkEnt *c=m_ents+e;
+    c->file=f;
+    c->idx=idx;
+    unsigned int h=hashslot(f,idx);
+    c->hnext=m_hash[h];
+    m_hash[h]=e;
+    m_files[f].nchunks++;
+  }
+  m_ents[e].len=len;
+  memcpy(m_data+(size_t)e*FILE_CHUNKSIZE,data,len);
+  pushFront(e);
+}
+
+C_XferIO::C_XferIO()
+{
+  m_running=0;
+  m_thread_ok=0;
+  m_thread_kill=0;
+  m_thread=0;
+#ifdef _WIN32
+  InitializeCriticalSection(&m_cs);
+  m_event=CreateEvent(NULL,FALSE,FALSE,NULL);
+#else
+  pthread_mutex_init(&m_mutex,NULL);
+  pthread_cond_init(&m_cond,NULL);
+  pthread_cond_init(&m_donecond,NULL);
+#endif
+}
+
+C_XferIO::~C_XferIO()
+{
+  lock();
+  m_thread_kill=1;
+#ifdef _WIN32
+  unlock();
+  if (m_thread_ok)
+  {
+    SetEvent(m_event);
+    WaitForSingleObject(m_thread,INFINITE);
+    CloseHandle(m_thread);
+  }
+  if (m_event) CloseHandle(m_event);
+  DeleteCriticalSection(&m_cs);
+#else
+  pthread_cond_signal(&m_cond);
+  unlock();
+  if (m_thread_ok)
+  {
+    void *p;
+    pthread_join(m_thread,&p);
+  }
+  pthread_mutex_destroy(&m_mutex);
+  pthread_cond_destroy(&m_cond);
+  pthread_cond_destroy(&m_donecond);
+#endif
+  int x;
+  for (x = 0; x < m_jobs.GetSize(); x ++) free(m_jobs.Get(x));
+}
+
+void C_XferIO::lock()
+{
+#ifdef _WIN32
+  EnterCriticalSection(&m_cs);
+#else
+  pthread_mutex_lock(&m_mutex);
+#endif
+}
+
+void C_XferIO::unlock()
+{
+#ifdef _WIN32
+  LeaveCriticalSection(&m_cs);
+#else
+  pthread_mutex_unlock(&m_mutex);
+#endif
+}
+
+#ifdef _WIN32
+unsigned long WINAPI C_XferIO::_threadfunc(LPVOID _d)
+#else
+void *C_XferIO::_threadfunc(void *_d)
+#endif
+{
+  C_XferIO *_this=(C_XferIO*)_d;
+  _this->lock();
+  while (!_this->m_thread_kill)
+  {
+    if (!_this->m_jobs.GetSize())
+    {
+#ifdef _WIN32
+      _this->unlock();
+      WaitForSingleObject(_this->m_event,INFINITE);
+      _this->lock();
+#else
+      pthread_cond_wait(&_this->m_cond,&_this->m_mutex);
+#endif
+      continue;
+    }
+    Job *j=_this->m_jobs.Get(0);
+    _this->m_jobs.Del(0);
+    _this->m_running=j->owner;
+    _this->unlock();
+    j->func(j->owner);
+    free(j);
+    _this->lock();
+    _this->m_running=0;
+#ifndef _WIN32
+    pthread_cond_broadcast(&_this->m_donecond);
+#endif
+  }
+  _this->unlock();
+  return 0;
+}
+
+void C_XferIO::add(void (*func)(void *), void *owner)
+{
+  Job *j=(Job *)malloc(sizeof(Job));
+  if (!m_thread_ok && j)
+  {
+#ifdef _WIN32
+    DWORD id;
+    if (m_event) m_thread=CreateThread(NULL,0,_threadfunc,(LPVOID)this,0,&id);
+    m_thread_ok=!!m_thread;
+#else
+    m_thread_ok=pthread_create(&m_thread,NULL,_threadfunc,(void*)this) == 0;
+#endif
+  }
+  if (!m_thread_ok || !j)
+  {
+    free(j);
+    func(owner);
+    return;
+  }
+  j->func=func;
+  j->owner=owner;
+  lock();
+  m_jobs.Add(j);
+#ifdef _WIN32
+  SetEvent(m_event);
+#else
+  pthread_cond_signal(&m_cond);
+#endif
+  unlock();
+}
+
+int C_XferIO::busy(void *owner)
+{
+  lock();
+  int x, r=m_running == owner;
+  for (x = 0; x < m_jobs.GetSize() && !r; x ++) if (m_jobs.Get(x)->owner == owner) r=1;
+  unlock();
+  return r;
+}
+
+void C_XferIO::cancel(void *owner)
+{
+  lock();
+  int x;
+  for (x = 0; x < m_jobs.GetSize(); x ++)
+  {
+    if (m_jobs.Get(x)->owner != owner) continue;
+    free(m_jobs.Get(x));
+    m_jobs.Del(x--);
+  }
+  while (m_running == owner)
+  {
+#ifdef _WIN32
+    unlock();
+    Sleep(1);
+    lock();
+#else
+    pthread_cond_wait(&m_donecond,&m_mutex);
+#endif
+  }
+  unlock();
+}
 
 
 XferSend::XferSend(C_MessageQueueList *mql,T_GUID *guid, C_FileSendRequest *req, char *fn)
@@ -43,14 +470,46 @@ XferSend::XferSend(C_MessageQueueList *mql,T_GUID *guid, C_FileSendRequest *req,
   m_lastchunkcnt=0;
   m_chunks_sent_total=0;
   m_need_reply=0;
+  m_peer_caps=0;
+  m_tree=0;
+  m_tree_n=0;
+  m_ra_buf[0]=m_ra_buf[1]=0;
+  m_ra_n[0]=m_ra_n[1]=0;
+  m_ra_idx[0]=m_ra_idx[1]=0;
+  m_ra_len[0]=m_ra_len[1]=0;
+  m_ra_state=0;
+  m_cache_file=-1;
+  m_slot=0;
+  m_deficit=0;
+  m_queued_sendtime=GetTickCount();
+  m_busytime=GetTickCount();
+  m_weight=1;
+  if (req->get_nick() && *req->get_nick())
+  {
+    char key[128];
+    sprintf(key,"ul_weight_%.100s",req->get_nick());
+    m_weight=g_config->ReadInt(key,1);
+    if (m_weight < 1) m_weight=1;
+  }
+  m_filelen_bytes_l=m_filelen_bytes_h=0;
+  m_filelen_chunks=1;
 #ifdef XFER_WIN32_FILEIO
   m_hfile=INVALID_HANDLE_VALUE;
 #else
   m_file=0;
 #endif
+  m_prep_state=0;
+  m_prep_kill=0;
+  m_prep_fn=0;
+  m_prep_err=0;
+  m_prep_req=0;
+  m_prep_tree=0;
+  m_prep_tree_n=0;
+  m_prep_thread=0;
   m_err=0;
   m_fn[0]=0;
   m_guid=*guid;
+  g_send_guids.add(&m_guid,this);
   m_idx=req->get_idx();
 
   if (fn[0])
@@ -86,119 +545,291 @@ XferSend::XferSend(C_MessageQueueList *mql,T_GUID *guid, C_FileSendRequest *req,
     }
     else
     {
-#ifdef XFER_WIN32_FILEIO
-      m_hfile=CreateFile(fn,
-          GENERIC_READ,
-          FILE_SHARE_READ|FILE_SHARE_WRITE,
-          NULL,
-          OPEN_EXISTING,
-          FILE_ATTRIBUTE_NORMAL, NULL);
-      if (m_hfile==INVALID_HANDLE_VALUE)
+      // everything that touches the disk happens in prepFile(), on a
+      // worker thread. the db and config are only looked at here.
+      m_prep_fn=strdup(fn);
+      m_prep_req=new C_FileSendRequest(*req);
+      m_prep_maxsha=0;
+      if (g_config->ReadInt("shafiles",1))
+        m_prep_maxsha=(unsigned int)g_config->ReadInt("maxsizesha",32)*1024*1024;
+      // shared files are usually already hashed in the db
+      m_prep_havesha = m_prep_maxsha && m_idx < UPLOAD_BASE_IDX && g_database &&
+          !g_database->GetFileHash(m_idx,&m_prep_sha_l,&m_prep_sha_h,&m_prep_sha_time,m_prep_hash);
+      if (m_prep_havesha)
+      {
+        // the tree should be in there too, if not hash it again to get one
+        int n;
+        unsigned char *t=g_database->GetFileTree(m_idx,&n);
+        if (t && (m_prep_tree=(unsigned char *)malloc(n*SHA_OUTSIZE)))
+        {
+          memcpy(m_prep_tree,t,n*SHA_OUTSIZE);
+          m_prep_tree_n=n;
+        }
+        else m_prep_havesha=0;
+      }
+      m_prep_newsha=0;
+
+      m_prep_state=1;
+#ifdef _WIN32
+      DWORD id;
+      m_prep_thread=CreateThread(NULL,0,_prepthread,(LPVOID)this,0,&id);
+      if (!m_prep_thread)
 #else
-      m_file=fopen(fn,"rb");
-      if (!m_file)
+      if (pthread_create(&m_prep_thread,NULL,_prepthread,(void*)this) != 0)
 #endif
       {
-        m_err="File not found on disk";
+        m_prep_thread=0;
+        prepFile();
+        m_prep_state=2;
       }
-      else
-      {
+    }
+  }
+  else
+    m_err="File not found in DB";
+
+  if (m_err) sendError(mql);
+  m_last_talktime=time(NULL);
+}
+
+XferSend::~XferSend()
+{
+  g_send_guids.del(&m_guid,this);
+  m_prep_kill=1;
+  if (m_prep_thread)
+  {
+#ifdef _WIN32
+    WaitForSingleObject(m_prep_thread,INFINITE);
+    CloseHandle(m_prep_thread);
+#else
+    void *p;
+    pthread_join(m_prep_thread,&p);
+#endif
+  }
+  if (m_ra_state) g_xferio->cancel(this);
+  if (g_chunkcache) g_chunkcache->releaseFile(m_cache_file);
+  free(m_ra_buf[0]);
+  free(m_ra_buf[1]);
+  free(m_prep_fn);
+  free(m_prep_tree);
+  free(m_tree);
+  delete m_prep_req;
 #ifdef XFER_WIN32_FILEIO
-        m_filelen_bytes_l=GetFileSize(m_hfile,(LPDWORD)&m_filelen_bytes_h);
+  if (m_hfile != INVALID_HANDLE_VALUE) CloseHandle(m_hfile);
+#else
+  if (m_file) fclose(m_file);
+#endif
+}
 
-        FILETIME ct,wt;
-        if (GetFileTime(m_hfile,&ct,NULL,&wt))
-        {
-          m_create_date=C_FileDB::FileTimeToUnixTime(&ct);
-          m_mod_date=C_FileDB::FileTimeToUnixTime(&wt);
-        }
+void XferSend::set_guid(T_GUID *guid)
+{
+  g_send_guids.del(&m_guid,this);
+  m_guid=*guid;
+  g_send_guids.add(&m_guid,this);
+}
 
+XferSend *XferSend::Find(T_GUID *guid)
+{
+  return (XferSend *)g_send_guids.find(guid);
+}
+
+#ifdef _WIN32
+unsigned long WINAPI XferSend::_prepthread(LPVOID _d)
 #else
-        fseek(m_file,0,SEEK_END);
-        m_filelen_bytes_h=0;//fucko64 for bsd
-        m_filelen_bytes_l=ftell(m_file);
-        fseek(m_file,0,SEEK_SET);
-  
-        struct stat s;
-        fstat(fileno(m_file),&s);
-        m_create_date=m_mod_date=s.st_mtime; // fuckobsd: create = modified time
+void *XferSend::_prepthread(void *_d)
 #endif
+{
+  XferSend *_this=(XferSend*)_d;
+  _this->prepFile();
+  _this->m_prep_state=2;
+  return 0;
+}
 
-        if (g_config->ReadInt("shafiles",1)
-            && !m_filelen_bytes_h && m_filelen_bytes_l < (unsigned int)g_config->ReadInt("maxsizesha",32)*1024*1024)
-        {
-          context.reset();
-          for (;;)
-          {
-            unsigned char buf[8192];
+// runs on the worker thread: only touches the file handle and m_prep_*
+void XferSend::prepFile()
+{
 #ifdef XFER_WIN32_FILEIO
-            DWORD l;
-            if (!ReadFile(m_hfile,buf,sizeof(buf),&l,NULL) || !l) break;
+  m_hfile=CreateFile(m_prep_fn,
+      GENERIC_READ,
+      FILE_SHARE_READ|FILE_SHARE_WRITE,
+      NULL,
+      OPEN_EXISTING,
+      FILE_ATTRIBUTE_NORMAL, NULL);
+  if (m_hfile==INVALID_HANDLE_VALUE)
 #else
-            int l=fread(buf,1,8192,m_file);
-            if (!l) break;
+  m_file=fopen(m_prep_fn,"rb");
+  if (!m_file)
 #endif
-            context.add(buf,l);
-          }
-          context.final(hashbuf);
+  {
+    m_prep_err="File not found on disk";
+    return;
+  }
+
+  m_prep_create_date=m_prep_mod_date=0;
 #ifdef XFER_WIN32_FILEIO
-          SetFilePointer(m_hfile,0,NULL,FILE_BEGIN);
+  m_prep_len_l=GetFileSize(m_hfile,(LPDWORD)&m_prep_len_h);
+
+  FILETIME ct,wt;
+  if (GetFileTime(m_hfile,&ct,NULL,&wt))
+  {
+    m_prep_create_date=C_FileDB::FileTimeToUnixTime(&ct);
+    m_prep_mod_date=C_FileDB::FileTimeToUnixTime(&wt);
+  }
+
 #else
-          fseek(m_file,0,SEEK_SET);
+  fseek(m_file,0,SEEK_END);
+  m_prep_len_h=0;//fucko64 for bsd
+  m_prep_len_l=ftell(m_file);
+  fseek(m_file,0,SEEK_SET);
+
+  struct stat s;
+  fstat(fileno(m_file),&s);
+  m_prep_create_date=m_prep_mod_date=s.st_mtime; // fuckobsd: create = modified time
 #endif
-        }
-        else
-          memset(hashbuf,0,SHA_OUTSIZE);
 
-        m_reply.set_hash(hashbuf);
-        if (g_config->ReadInt("directxfers",0))
-        {
-          int ip,prt=0;
-          req->get_dc_ipport(&ip,&prt);
-          if (ip && prt)
-          {
-            NetKern_ConnectToHostIfOK(ip,prt);
-          }
-          if (g_route_traffic && g_listen && !g_listen->is_error() && mql->GetNumQueues())
-          {       
-            int ip=(g_forceip&&g_forceip_addr!=INADDR_NONE)?g_forceip_addr:  
-                    mql->GetQueue(0)->get_con()->get_interface();
-            m_reply.set_dc_ipport(ip,g_listen->port());
-          }
-        }
-        m_lastpos_l=m_lastpos_h=0;
-        m_filelen_chunks=(m_filelen_bytes_l+FILE_CHUNKSIZE-1)/FILE_CHUNKSIZE + (m_filelen_bytes_h * ((1<<30)/FILE_CHUNKSIZE) * 4);
-        if (m_filelen_chunks<1) m_filelen_chunks=1;
-        onGotMsg(req);
-      }
-    }
+  if (m_prep_havesha && ((unsigned int)m_prep_sha_l != m_prep_len_l ||
+      (unsigned int)m_prep_sha_h != m_prep_len_h || (unsigned int)m_prep_sha_time != m_prep_mod_date))
+  {
+    m_prep_havesha=0; // changed since it was hashed
+    free(m_prep_tree);
+    m_prep_tree=0;
+    m_prep_tree_n=0;
   }
-  else
-    m_err="File not found in DB";
 
-  if (m_err) // send reply
+  if (m_prep_maxsha && !m_prep_len_h && m_prep_len_l < m_prep_maxsha)
   {
-    T_Message msg={0,};
-    m_reply.set_error(1);
-    msg.data=m_reply.Make();
-    if (msg.data)
+    if (!m_prep_havesha)
     {
-      msg.message_type=MESSAGE_FILE_REQUEST_REPLY;
-      msg.message_length=msg.data->GetLength();
-      msg.message_guid=m_guid;
-      mql->send(&msg);
+      SHAify context;
+      C_FileTreeHasher tree;
+      for (;;)
+      {
+        if (m_prep_kill) return;
+        unsigned char buf[8192];
+#ifdef XFER_WIN32_FILEIO
+        DWORD l;
+        if (!ReadFile(m_hfile,buf,sizeof(buf),&l,NULL) || !l) break;
+#else
+        int l=fread(buf,1,8192,m_file);
+        if (!l) break;
+#endif
+        context.add(buf,l);
+        tree.add(buf,l);
+      }
+      context.final(m_prep_hash);
+      free(m_prep_tree);
+      m_prep_tree_n=tree.final(&m_prep_tree);
+#ifdef XFER_WIN32_FILEIO
+      SetFilePointer(m_hfile,0,NULL,FILE_BEGIN);
+#else
+      fseek(m_file,0,SEEK_SET);
+#endif
+      m_prep_newsha=1;
     }
   }
-  m_last_talktime=time(NULL);
+  else
+    memset(m_prep_hash,0,SHA_OUTSIZE);
+#if !defined(XFER_WIN32_FILEIO) && defined(POSIX_FADV_SEQUENTIAL)
+  posix_fadvise(fileno(m_file),0,0,POSIX_FADV_SEQUENTIAL);
+#endif
 }
 
-XferSend::~XferSend()
+// back on the main thread, the worker has finished
+void XferSend::prepDone(C_MessageQueueList *mql)
 {
-#ifdef XFER_WIN32_FILEIO
-  if (m_hfile != INVALID_HANDLE_VALUE) CloseHandle(m_hfile);
+  if (m_prep_thread)
+  {
+#ifdef _WIN32
+    WaitForSingleObject(m_prep_thread,INFINITE);
+    CloseHandle(m_prep_thread);
 #else
-  if (m_file) fclose(m_file);
+    void *p;
+    pthread_join(m_prep_thread,&p);
 #endif
+    m_prep_thread=0;
+  }
+  m_prep_state=0;
+
+  if (m_prep_err)
+  {
+    free(m_prep_fn);
+    m_prep_fn=0;
+    m_err=m_prep_err;
+    sendError(mql);
+    return;
+  }
+
+  m_filelen_bytes_l=m_prep_len_l;
+  m_filelen_bytes_h=m_prep_len_h;
+  m_create_date=m_prep_create_date;
+  m_mod_date=m_prep_mod_date;
+
+  if (!g_chunkcache) g_chunkcache=new C_ChunkCache(g_config->ReadInt("upcache_kb",8192)*1024);
+  m_cache_file=g_chunkcache->addFile(m_prep_fn,m_filelen_bytes_l,m_filelen_bytes_h,m_mod_date);
+  free(m_prep_fn);
+  m_prep_fn=0;
+
+  if (m_prep_newsha && m_idx < UPLOAD_BASE_IDX && g_database)
+    g_database->SetFileHash(m_idx,m_filelen_bytes_l,m_filelen_bytes_h,m_mod_date,m_prep_hash,
+                            m_prep_tree,m_prep_tree_n);
+  m_reply.set_hash(m_prep_hash);
+
+  m_tree=m_prep_tree;
+  m_tree_n=m_prep_tree_n;
+  m_prep_tree=0;
+  if (m_tree && m_tree_n == FileTree_NumLeaves(m_filelen_bytes_l,m_filelen_bytes_h))
+  {
+    unsigned char root[SHA_OUTSIZE];
+    FileTree_Root(m_tree,m_tree_n,root);
+    m_reply.set_tree_root(root);
+  }
+  else
+  {
+    free(m_tree);
+    m_tree=0;
+  }
+
+  // the receiver opens the bulk link, to the address we give it here: it
+  // knows who it asked, and we can't tell who's really at the address in
+  // its request.
+  if (g_config->ReadInt("directxfers",0))
+  {
+    if (g_route_traffic && g_listen && !g_listen->is_error() && mql->GetNumQueues())
+    {       
+      int ip=(g_forceip&&g_forceip_addr!=INADDR_NONE)?g_forceip_addr:  
+              mql->GetQueue(0)->get_con()->get_interface();
+      m_reply.set_dc_ipport(ip,g_listen->port());
+    }
+  }
+  m_filelen_chunks=(m_filelen_bytes_l+FILE_CHUNKSIZE-1)/FILE_CHUNKSIZE + (m_filelen_bytes_h * ((1<<30)/FILE_CHUNKSIZE) * 4);
+  if (m_filelen_chunks<1) m_filelen_chunks=1;
+
+#ifdef _WIN32
+  int idx=g_lvsend.FindItemByParam((int)this);
+  if (idx!=-1)
+  {
+    char buf[32];
+    FormatSizeStr64(buf,m_filelen_bytes_l,m_filelen_bytes_h);
+    g_lvsend.SetItemText(idx,2,buf);
+  }
+#endif
+
+  onGotMsg(m_prep_req);
+  delete m_prep_req;
+  m_prep_req=0;
+}
+
+void XferSend::sendError(C_MessageQueueList *mql)
+{
+  T_Message msg={0,};
+  m_reply.set_error(1);
+  msg.data=m_reply.Make();
+  if (msg.data)
+  {
+    msg.message_type=MESSAGE_FILE_REQUEST_REPLY;
+    msg.message_length=msg.data->GetLength();
+    msg.message_guid=m_guid;
+    mql->send(&msg);
+  }
 }
 
 void XferSend::Abort(C_MessageQueueList *mql) 
@@ -219,6 +850,13 @@ void XferSend::Abort(C_MessageQueueList *mql)
 int XferSend::run_hdr(C_MessageQueueList *mql)
 {
   if (m_err) return 1;
+  if (m_prep_state)
+  {
+    if (m_prep_state != 2) return 0;
+    prepDone(mql);
+    if (m_err) return 1;
+    m_last_talktime=time(NULL);
+  }
   if (time(NULL)-m_last_talktime > 300) // 5 minutes
   {
     sprintf(m_err_buf,"Timed out @ %d%%",m_max_chunksent*100/m_filelen_chunks);
@@ -241,67 +879,327 @@ int XferSend::run_hdr(C_MessageQueueList *mql)
   return 0;
 }
 
-void XferSend::run(C_MessageQueueList *mql)
+int XferSend::run(C_MessageQueueList *mql, int budget)
 {
-  if (!m_err && chunks_to_send_pos<chunks_to_send_len)
+  if (m_err || chunks_to_send_pos>=chunks_to_send_len) return 0;
+
+  m_last_talktime=time(NULL);
+  int a=mql->find_route(&m_guid,MESSAGE_FILE_REQUEST_REPLY);
+  if (a < 0) return 0;
+  C_MessageQueue *q=mql->GetQueue(a);
+
+  // keep the route's queue topped up to a quarter full, instead of one
+  // chunk per call, so throughput isn't tied to how often we get run.
+  int sent=0;
+  while (chunks_to_send_pos<chunks_to_send_len && sent < budget && q->getlen() < q->getmaxlen()/4)
   {
-    m_last_talktime=time(NULL);
-    int a=mql->find_route(&m_guid,MESSAGE_FILE_REQUEST_REPLY);
-    if (a >= -1 && mql->GetQueue(a)->getlen() < mql->GetQueue(a)->getmaxlen()/4)
+    unsigned int x=chunks_to_send[chunks_to_send_pos];
+    if (x >= FILE_TREE_INDEX) // a page of hash tree leaves
+    {
+      chunks_to_send_pos++;
+      unsigned int p=(x-FILE_TREE_INDEX)*FILE_TREE_LEAVES_PER_MSG;
+      int nl=m_tree_n-p;
+      if (nl > FILE_TREE_LEAVES_PER_MSG) nl=FILE_TREE_LEAVES_PER_MSG;
+      C_FileSendReply treereply;
+      treereply.set_data(m_tree+p*SHA_OUTSIZE,nl*SHA_OUTSIZE);
+      treereply.set_index(x);
+      T_Message msg={0,};
+      msg.data=treereply.Make();
+      msg.message_type=MESSAGE_FILE_REQUEST_REPLY;
+      msg.message_length=msg.data->GetLength();
+      msg.message_guid=m_guid;
+      mql->send(&msg);
+      sent+=msg.message_length;
+      continue;
+    }
+    if (x >= m_filelen_chunks)
     {
-      m_lastsendtime=GetTickCount();
+      chunks_to_send_pos++;
+      continue;
+    }
+    if (!readChunk(x)) break; // still coming off the disk
+    chunks_to_send_pos++;
+    m_lastsendtime=GetTickCount();
 
-      unsigned int x=chunks_to_send[chunks_to_send_pos++];
-      if (x >= 0 && x < m_filelen_chunks)
+    // runs of consecutive chunks go out in one message if the receiver takes that
+    unsigned int nch=1, end=m_ra_idx[0]+m_ra_n[0];
+    if (m_peer_caps & FILE_CAP_MULTICHUNK)
+    {
+      while (nch < FILE_MAX_MULTICHUNK && chunks_to_send_pos < chunks_to_send_len &&
+             chunks_to_send[chunks_to_send_pos] == x+nch && x+nch < end)
       {
-        unsigned int newpos_l=x*FILE_CHUNKSIZE;
-#ifdef _WIN32
-        unsigned int newpos_h=(unsigned int) (((__int64)x*(__int64)FILE_CHUNKSIZE)>>32);
-#else
-        unsigned int newpos_h=0;
-#endif
-        if (newpos_l != m_lastpos_l || newpos_h != m_lastpos_h)
-        {
-#ifdef XFER_WIN32_FILEIO
-          LONG zero=newpos_h;
-          SetFilePointer(m_hfile,newpos_l,&zero,FILE_BEGIN);
-#else
-          fseek(m_file,newpos_l,SEEK_SET);
-#endif
-          m_lastpos_l=newpos_l;
-          m_lastpos_h=newpos_h;
-        }
-        unsigned char buf[FILE_CHUNKSIZE];
-#ifdef XFER_WIN32_FILEIO
-        DWORD l;
-        if (!ReadFile(m_hfile,buf,FILE_CHUNKSIZE,&l,NULL))
-          l=0;
-#else
-        int l=fread(buf,1,FILE_CHUNKSIZE,m_file);
-#endif
-        unsigned int o = m_lastpos_l;
-        m_lastpos_l+=l;
-        if (m_lastpos_l < o) m_lastpos_h++;
-        C_FileSendReply datareply;
-
-        datareply.set_data(buf,l);
-        datareply.set_index(x);
-        T_Message msg={0,};
-        msg.data=datareply.Make();
-        msg.message_type=MESSAGE_FILE_REQUEST_REPLY;
-        msg.message_length=msg.data->GetLength();
-        msg.message_guid=m_guid;
-        mql->send(&msg);
-        if (x > m_max_chunksent) m_max_chunksent=x;
-        m_chunks_sent_total++;
+        chunks_to_send_pos++;
+        nch++;
       }
+    }
 
-      if (g_extrainf)
+    unsigned int o=(x-m_ra_idx[0])*FILE_CHUNKSIZE, l=0;
+    if (o < m_ra_len[0])
+    {
+      l=m_ra_len[0]-o;
+      if (l > nch*FILE_CHUNKSIZE) l=nch*FILE_CHUNKSIZE;
+    }
+    C_FileSendReply datareply;
+
+    datareply.set_data(m_ra_buf[0]+o,l);
+    datareply.set_index(x);
+    T_Message msg={0,};
+    msg.data=datareply.Make();
+    msg.message_type=MESSAGE_FILE_REQUEST_REPLY;
+    msg.message_length=msg.data->GetLength();
+    msg.message_guid=m_guid;
+    mql->send(&msg);
+    if (x+nch-1 > m_max_chunksent) m_max_chunksent=x+nch-1;
+    m_chunks_sent_total+=nch;
+    sent+=msg.message_length;
+  }
+  prefetch();
+
+  if (sent && g_extrainf)
+  {
+    updateStatusText();
+  }
+  return sent;
+}
+
+void XferSend::RunAll(C_ItemList<XferSend> *sends, C_MessageQueueList *mql)
+{
+  static int runoffs;
+  int x, n=sends->GetSize();
+  if (!n) return;
+
+  unsigned int now=GetTickCount();
+  int slots=g_config->ReadInt("ul_slots",0), active=0;
+  for (x = 0; x < n; x ++)
+  {
+    XferSend *s=sends->Get(x);
+    if (s->chunks_to_send_pos < s->chunks_to_send_len) s->m_busytime=now;
+    if (s->m_slot) active++;
+  }
+  for (x = 0; x < n; x ++)
+  {
+    XferSend *s=sends->Get(x);
+    if (s->m_slot) continue;
+    if (slots > 0 && active >= slots)
+    {
+      // only take an idle send's slot for one that has something to send
+      if (s->m_busytime != now) continue;
+      int y;
+      for (y = 0; y < n; y ++)
+      {
+        XferSend *o=sends->Get(y);
+        if (o->m_slot && now-o->m_busytime >= XFER_SLOT_IDLE_MS) break;
+      }
+      if (y >= n) break;
+      sends->Get(y)->m_slot=0;
+      sends->Get(y)->m_queued_sendtime=now;
+      sends->Get(y)->updateStatusText();
+      active--;
+    }
+    s->m_slot=1;
+    s->m_deficit=0;
+    s->updateStatusText();
+    active++;
+  }
+
+  for (x = 0; x < n; x ++)
+  {
+    XferSend *s=sends->Get(x);
+    if (!s->m_slot && now-s->m_queued_sendtime >= XFER_QUEUED_MS && s->run(mql,1))
+      s->m_queued_sendtime=now;
+  }
+
+  // keep going round until nobody can send any more, so the quantum only
+  // sets the ratios and not the rate
+  int r=runoffs++, round;
+  for (round = 0; round < XFER_DRR_ROUNDS; round ++)
+  {
+    int busy=0;
+    for (x = 0; x < n; x ++)
+    {
+      XferSend *s=sends->Get((x+r)%n);
+      if (!s->m_slot) continue;
+      if (s->m_err || s->chunks_to_send_pos >= s->chunks_to_send_len)
       {
-        updateStatusText();
+        s->m_deficit=0; // nothing to send, don't bank credit for later
+        continue;
       }
+      int q=XFER_DRR_QUANTUM*s->m_weight;
+      s->m_deficit+=q;
+      int sent=s->run(mql,s->m_deficit);
+      s->m_deficit-=sent;
+      if (sent) busy++;
+      else if (s->m_deficit > q) s->m_deficit=q; // route is full or the disk is behind
+    }
+    if (!busy) break;
+  }
+}
+
+void XferSend::_readahead(void *_d)
+{
+  ((XferSend*)_d)->readAhead();
+}
+
+// returns 1 and goes back to idle once the io thread is done with window 1
+int XferSend::takeWindow()
+{
+  if (m_ra_state != 1 || g_xferio->busy(this)) return 0;
+  m_ra_state=0;
+  return 1;
+}
+
+// runs on the io thread: fills window 1. once prep is done the file
+// handle is only used from here, so there's no seek position to share.
+void XferSend::readAhead()
+{
+  unsigned int len=m_ra_n[1]*FILE_CHUNKSIZE, got=0;
+#ifdef XFER_WIN32_FILEIO
+  LONG h=(LONG) (((__int64)FILE_CHUNKSIZE*(__int64)m_ra_idx[1])>>32);
+  SetFilePointer(m_hfile,FILE_CHUNKSIZE*m_ra_idx[1],&h,FILE_BEGIN);
+  while (got < len)
+  {
+    DWORD d;
+    if (!ReadFile(m_hfile,m_ra_buf[1]+got,len-got,&d,NULL) || !d) break;
+    got+=d;
+  }
+#else
+  int fd=fileno(m_file);
+  off_t pos=(off_t)m_ra_idx[1]*FILE_CHUNKSIZE;
+  while (got < len)
+  {
+    ssize_t n=pread(fd,m_ra_buf[1]+got,len-got,pos+got);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    got+=n;
+  }
+#ifdef POSIX_FADV_WILLNEED
+  // most likely asked for next
+  if (got == len) posix_fadvise(fd,pos+len,len,POSIX_FADV_WILLNEED);
+#endif
+#endif
+  m_ra_len[1]=got;
+}
+
+// a window never needs more than the whole file
+int XferSend::allocWindow(int w)
+{
+  if (m_ra_buf[w]) return 1;
+  unsigned int n=m_filelen_chunks < XFER_READAHEAD ? m_filelen_chunks : XFER_READAHEAD;
+  m_ra_buf[w]=(unsigned char *)malloc(n*FILE_CHUNKSIZE);
+  return !!m_ra_buf[w];
+}
+
+// chunks from x to the furthest one queued within a window's reach
+unsigned int XferSend::queuedSpan(unsigned int x)
+{
+  unsigned int n=1, p, e=chunks_to_send_pos+1024;
+  if (e > chunks_to_send_len) e=chunks_to_send_len;
+  for (p = chunks_to_send_pos; p < e; p ++)
+  {
+    unsigned int c=chunks_to_send[p];
+    if (c > x && c < x+XFER_READAHEAD && c-x >= n) n=c-x+1;
+  }
+  if (x+n > m_filelen_chunks) n=m_filelen_chunks-x;
+  return n;
+}
+
+// fills window 0 with the cached run of chunks starting at x, if there is one
+int XferSend::fromCache(unsigned int x)
+{
+  if (m_cache_file < 0 || !g_chunkcache->has(m_cache_file,x)) return 0;
+  if (!allocWindow(0)) return 0;
+  unsigned int n=queuedSpan(x), i, len=0;
+  for (i = 0; i < n; i ++)
+  {
+    unsigned int l;
+    unsigned char *d=g_chunkcache->get(m_cache_file,x+i,&l);
+    if (!d) break;
+    memcpy(m_ra_buf[0]+len,d,l);
+    len+=l;
+    if (l < FILE_CHUNKSIZE) { i++; break; }
+  }
+  m_ra_idx[0]=x;
+  m_ra_n[0]=i;
+  m_ra_len[0]=len;
+  return 1;
+}
+
+// hands what the io thread read in window w to the other uploads
+void XferSend::toCache(int w)
+{
+  if (m_cache_file < 0) return;
+  unsigned int i;
+  for (i = 0; i < m_ra_n[w]; i ++)
+  {
+    unsigned int o=i*FILE_CHUNKSIZE, l=FILE_CHUNKSIZE;
+    if (o >= m_ra_len[w]) break;
+    if (o+l > m_ra_len[w])
+    {
+      l=m_ra_len[w]-o;
+      if (m_ra_idx[w]+i != m_filelen_chunks-1) break; // short read, not the end of the file
+    }
+    g_chunkcache->put(m_cache_file,m_ra_idx[w]+i,m_ra_buf[w]+o,l);
+  }
+}
+
+// starts filling window 1 from chunk x, as far as the queue wants from there
+void XferSend::startRead(unsigned int x)
+{
+  if (!allocWindow(0) || !allocWindow(1))
+  {
+    m_err="Out of memory";
+    return;
+  }
+
+  unsigned int n=queuedSpan(x);
+  m_ra_idx[1]=x;
+  m_ra_n[1]=n;
+  m_ra_len[1]=0;
+  m_ra_state=1;
+  if (!g_xferio) g_xferio=new C_XferIO;
+  g_xferio->add(_readahead,this);
+}
+
+// returns 1 if chunk x is in window 0, otherwise gets it on its way
+int XferSend::readChunk(unsigned int x)
+{
+  if (x >= m_ra_idx[0] && x-m_ra_idx[0] < m_ra_n[0]) return 1;
+  if (takeWindow())
+  {
+    toCache(1);
+    if (x >= m_ra_idx[1] && x-m_ra_idx[1] < m_ra_n[1])
+    {
+      unsigned char *t=m_ra_buf[0];
+      m_ra_buf[0]=m_ra_buf[1];
+      m_ra_buf[1]=t;
+      m_ra_idx[0]=m_ra_idx[1];
+      m_ra_n[0]=m_ra_n[1];
+      m_ra_len[0]=m_ra_len[1];
+      m_ra_n[1]=0;
+      return 1;
     }
   }
+  if (fromCache(x)) return 1; // window 1 isn't touched, so this is fine mid-read
+  if (m_ra_state == 1) return 0;
+  startRead(x);
+  if (m_ra_state == 1 && !m_err && !g_xferio->busy(this)) return readChunk(x); // read already
+  return 0;
+}
+
+// gets the next window read while window 0 is going out
+void XferSend::prefetch()
+{
+  if (m_ra_state || m_err) return;
+  unsigned int p, e=chunks_to_send_pos+256;
+  if (e > chunks_to_send_len) e=chunks_to_send_len;
+  for (p = chunks_to_send_pos; p < e; p ++)
+  {
+    unsigned int x=chunks_to_send[p];
+    if (x >= m_filelen_chunks) continue;
+    if (x >= m_ra_idx[0] && x-m_ra_idx[0] < m_ra_n[0]) continue;
+    if (m_cache_file < 0 || !g_chunkcache->has(m_cache_file,x)) startRead(x);
+    return;
+  }
 }
 
 void XferSend::updateStatusText()
@@ -309,7 +1207,7 @@ void XferSend::updateStatusText()
   char s[128];
   int wcps=m_last_cps;
 
-  sprintf(s,"%d%%@%d.%02dk/s",
+  sprintf(s,"%s%d%%@%d.%02dk/s",m_slot ? "" : "Queued ",
     (m_max_chunksent*100)/m_filelen_chunks,
     wcps/1000,(wcps/10)%100);
 
@@ -321,6 +1219,13 @@ void XferSend::updateStatusText()
 #endif
 }
 
+// tree pages first, then data chunks in file order
+static int cmp_sendchunk(const void *a, const void *b)
+{
+  unsigned int x=*(unsigned int *)a-FILE_TREE_INDEX, y=*(unsigned int *)b-FILE_TREE_INDEX;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
 void XferSend::onGotMsg(C_FileSendRequest *req)
 {
   if (m_err) return;
@@ -344,35 +1249,56 @@ void XferSend::onGotMsg(C_FileSendRequest *req)
     m_err="Got different index";
     return;
   }
+  if (m_prep_state)
+  {
+    *m_prep_req=*req; // answer this one once we're ready
+    return;
+  }
   m_need_reply=1;
   m_reply.set_file_len(m_filelen_bytes_l,m_filelen_bytes_h);
   m_reply.set_file_dates(m_create_date,m_mod_date);
   m_reply.set_index(-1);
+  m_peer_caps=req->get_caps();
+  m_reply.set_caps(FILE_CAP_PIPELINE|FILE_CAP_MULTICHUNK|(m_tree && (m_peer_caps & FILE_CAP_TREE) ? FILE_CAP_TREE : 0));
   unsigned int x;
+  unsigned int treepages=m_tree ? (m_tree_n+FILE_TREE_LEAVES_PER_MSG-1)/FILE_TREE_LEAVES_PER_MSG : 0;
+
+  if (req->get_caps() & FILE_CAP_PIPELINE) // pipelined, keep what's still pending
+  {
+    if (chunks_to_send_pos)
+    {
+      chunks_to_send_len-=chunks_to_send_pos;
+      memmove(chunks_to_send,chunks_to_send+chunks_to_send_pos,chunks_to_send_len*sizeof(unsigned int));
+      chunks_to_send_pos=0;
+    }
+  }
+  else
+  {
+    chunks_to_send_pos=0;
+    chunks_to_send_len=0;
+  }
 
-  chunks_to_send_pos=0;
-  chunks_to_send_len=req->get_chunks_needed();
-  if (chunks_to_send_len)
+  unsigned int n=req->get_chunks_needed(), added=0;
+  if (n > FILE_MAX_CHUNKS_PER_REQ) n=FILE_MAX_CHUNKS_PER_REQ;
+  for (x = 0; x < n && chunks_to_send_len < XFER_MAX_WINDOW; x ++)
   {
-    if (chunks_to_send_len > FILE_MAX_CHUNKS_PER_REQ) chunks_to_send_len=FILE_MAX_CHUNKS_PER_REQ;
-    for (x = 0; x < chunks_to_send_len; x ++) 
+    unsigned int nc=req->get_need_chunk(x);
+    if (nc < m_filelen_chunks || (nc >= FILE_TREE_INDEX && nc-FILE_TREE_INDEX < treepages))
     {
-      unsigned int nc=req->get_need_chunk(x);
-      if (nc < m_filelen_chunks) chunks_to_send[x]=nc;
-      else 
-      {
-        chunks_to_send_len--; // sending less chunks
-        x--; // skip this chunk
-      }
+      chunks_to_send[chunks_to_send_len++]=nc;
+      added++;
     }
   }
+  // so the batch comes off the disk in one sweep
+  qsort(chunks_to_send+chunks_to_send_len-added,added,sizeof(unsigned int),cmp_sendchunk);
 
   if (!chunks_to_send_len) // default poopie
   {
     chunks_to_send[0]=0;
     chunks_to_send_len=1;
+    added=1;
   }
-  m_reply.set_chunkcount(chunks_to_send_len);
+  m_reply.set_chunkcount(added);
   unsigned int tm=GetTickCount()-m_starttime;
 
 #ifdef _WIN32
@@ -446,18 +1372,27 @@ XferRecv::XferRecv(C_MessageQueueList *mql, char *guididx, char *sizestr, char *
   g_lvrecv.SetItemText(0,3,guididx);
 #endif
 
-  m_adaptive_chunksize=FILE_MAX_CHUNKS_PER_REQ/2;
-
+  safe_strncpy(m_guididx,guididx,sizeof(m_guididx));
+  m_tag=0;
   m_path_len=0x10000000;
-  m_hasgotchunks=0;
-  m_validbf=0;
+  m_nsrc=0;
   m_tmpcopyfn=0;
   m_chunk_startcnt=0;
   m_total_chunks_recvd=0;
   m_done=0;
-  chunks_coming=100000000;
   m_chunk_total=m_chunk_cnt=0;
   m_first_chunkilack=0;
+  m_tree=0;
+  m_tree_pgot=0;
+  m_tree_ptime=0;
+  m_blockstate=0;
+  freeTree();
+  m_stream_next=0;
+  m_stream_on=0;
+  m_hash_state=0;
+  m_hash_kill=0;
+  m_hash_ok=0;
+  m_hash_thread=0;
   m_err=0;
   lasthdr=0;
 #ifdef XFER_WIN32_FILEIO
@@ -468,6 +1403,17 @@ XferRecv::XferRecv(C_MessageQueueList *mql, char *guididx, char *sizestr, char *
   m_statfile=0;
 #endif
   m_outfile_lastpos_l=m_outfile_lastpos_h=0;
+  m_wb=0;
+  m_wb_len=0;
+  m_jr=0;
+  m_jr_n=m_jr_size=0;
+  m_journal_n=0;
+  m_state_compact=1;
+  m_last_journal_time=GetTickCount();
+  m_st_buf=0;
+  m_st_len=m_st_size=m_st_rewrite=0;
+  m_st_queued=0;
+  m_wb_idx=0;
 
   char *p=filename;
   while (*p) p++;
@@ -477,18 +1423,12 @@ XferRecv::XferRecv(C_MessageQueueList *mql, char *guididx, char *sizestr, char *
 #endif
     *p != '/') p--;
   p++;
-  unsigned char fn_hash[SHA_OUTSIZE];
-  SHAify context;
-  context.add((unsigned char *)p, strlen(p));
-  context.final(fn_hash);
-  request.set_fn_hash(fn_hash);
-  if (g_config->ReadInt("nickonxfers",1))
-    request.set_nick(g_regnick);
+  Source *src=m_src[m_nsrc++]=newSource(filename);
   if (g_route_traffic && g_listen && !g_listen->is_error() && mql->GetNumQueues() && g_config->ReadInt("directxfers",0))
   {       
     int ip=(g_forceip&&g_forceip_addr!=INADDR_NONE)?g_forceip_addr:  
             mql->GetQueue(0)->get_con()->get_interface();
-    request.set_dc_ipport(ip,g_listen->port());
+    src->request->set_dc_ipport(ip,g_listen->port());
   }
 
   m_statfile_fn=(char *)malloc(strlen(filename)+strlen(path)+64);
@@ -594,7 +1534,6 @@ XferRecv::XferRecv(C_MessageQueueList *mql, char *guididx, char *sizestr, char *
     return;
   }
 
-  unsigned int x;
   if (strlen(guididx) < 34)
   {
     m_err="Malformed address";
@@ -602,13 +1541,12 @@ XferRecv::XferRecv(C_MessageQueueList *mql, char *guididx, char *sizestr, char *
   }
   T_GUID gid;
   MakeID128FromStr(guididx,&gid);
-  request.set_guid(&gid);
-  request.set_idx(atoi(guididx+33));
+  src->request->set_guid(&gid);
+  src->request->set_idx(atoi(guididx+33));
   m_create_date=m_mod_date=0;
   m_bytes_total_l=0xFFFFFFFF;
   m_bytes_total_h=0xFFFFFFFF;
   memset(m_hash,0,SHA_OUTSIZE);
-  m_next_stateflush_time=time(NULL)+60;
 
   int sig1=0, sig2=0;
 #ifdef XFER_WIN32_FILEIO
@@ -640,60 +1578,46 @@ XferRecv::XferRecv(C_MessageQueueList *mql, char *guididx, char *sizestr, char *
       m_chunk_total=(m_bytes_total_l+FILE_CHUNKSIZE-1)/FILE_CHUNKSIZE + (m_bytes_total_h * ((1<<30)/FILE_CHUNKSIZE) * 4);
 
       if (m_chunk_total<1) m_chunk_total=1;
-      if (m_chunk_total)
+      unsigned int nb=(m_chunk_total+7)/8;
+      unsigned char *bf=(unsigned char *)malloc(nb);
+      if (bf && m_valid.resize(m_chunk_total))
       {
-        free(m_validbf);
-        m_validbf=(unsigned char *)malloc((m_chunk_total+7)/8);
 #ifdef XFER_WIN32_FILEIO
-        if (m_validbf && 
-          ReadFile(m_hstatfile,m_validbf,(m_chunk_total+7)/8,&d,NULL) && d==(unsigned int)((m_chunk_total+7)/8))
+        if (ReadFile(m_hstatfile,bf,nb,&d,NULL) && d==nb)
 #else
-        if (m_validbf && fread(m_validbf,1,(m_chunk_total+7)/8,m_statfile)==(unsigned int)((m_chunk_total+7)/8))
+        if (fread(bf,1,nb,m_statfile)==nb)
 #endif
         {
-          for (x = 0; x < m_chunk_total; x ++)
+          m_valid.fromBytes(bf);
+          // then whatever was journaled since, up to a torn or missing record
+          for (;;)
           {
-            if (IS_VALID(x)) 
-            {
-              m_total_chunks_recvd++;
-              m_chunk_startcnt++;
-              m_chunk_cnt++;
-            }
+            unsigned int r[3];
+#ifdef XFER_WIN32_FILEIO
+            if (!ReadFile(m_hstatfile,r,sizeof(r),&d,NULL) || d != sizeof(r)) break;
+#else
+            if (fread(r,1,sizeof(r),m_statfile) != sizeof(r)) break;
+#endif
+            if ((r[0]^r[1]^WASTESTATE_JSIG) != r[2] || r[0] >= m_chunk_total || r[1] > m_chunk_total-r[0]) break;
+            m_valid.setRange(r[0],r[1]);
+            m_journal_n++;
           }
+          m_state_compact=0;
+          m_total_chunks_recvd+=m_valid.count();
+          m_chunk_startcnt+=m_valid.count();
+          m_chunk_cnt+=m_valid.count();
         }
+        else m_valid.release();
       }
+      free(bf);
     }
   }
   if (m_chunk_total<1)
   {
     m_chunk_total=FILE_MAX_CHUNKS_PER_REQ; // default request as much as we can
   }
-  T_Message m={0,};
-  request.clear_need_chunks();
-  int setfirst=0;
-  for (x = m_first_chunkilack; x < m_chunk_total && request.get_chunks_needed() < m_adaptive_chunksize; x ++)
-  {
-    if (!m_validbf || !IS_VALID(x))  // dont have this one
-    {
-      request.add_need_chunk(x);
-      if (!setfirst) 
-      {
-        m_first_chunkilack=x;
-        setfirst++;
-      }
-    }
-  }
-  m.data=request.Make();
-  m.message_type=MESSAGE_FILE_REQUEST;
-  m.message_length=m.data->GetLength();
-
-  mql->send(&m);
-
-
-  m_guid=m.message_guid;
-  request.set_dc_ipport(0,0); // never send dc ip/port again
-
-  last_msg_time=time(NULL)+30; // give it a little more time the first time
+  sendRequest(mql,src,src->adaptive_chunksize);
+  src->request->set_dc_ipport(0,0); // never send dc ip/port again
   m_next_cpstime=GetTickCount();
   m_cps_blks_pos=0;
   m_last_cps=0;
@@ -703,6 +1627,11 @@ XferRecv::XferRecv(C_MessageQueueList *mql, char *guididx, char *sizestr, char *
 XferRecv::~XferRecv()
 {
   debug_printf("[XFER] ~XferRecv: m_done=%d statfile_fn='%s'\n", m_done, m_statfile_fn ? m_statfile_fn : "(null)");
+  m_hash_kill=1;
+  joinHashThread();
+  if (m_st_queued) g_xferio->cancel(this);
+  if (lasthdr) flushState();
+  else flushWrites();
   unsigned int filesize_l=0,filesize_h=0;
 #ifdef XFER_WIN32_FILEIO
   if (m_houtfile!=INVALID_HANDLE_VALUE) 
@@ -721,24 +1650,7 @@ XferRecv::~XferRecv()
     filesize_l=GetFileSize(m_houtfile,(DWORD*)&filesize_h);
     CloseHandle(m_houtfile);
   }
-  if (m_hstatfile != INVALID_HANDLE_VALUE) 
-  {
-    if (lasthdr) // flush state
-    {
-      DWORD d;
-      SetFilePointer(m_hstatfile,0,NULL,FILE_BEGIN);
-      int sig1=WASTESTATE_SIG1, sig2=WASTESTATE_SIG2;
-      WriteFile(m_hstatfile,&sig1,4,&d,NULL);
-      WriteFile(m_hstatfile,&sig2,4,&d,NULL);
-      WriteFile(m_hstatfile,&m_bytes_total_l,4,&d,NULL);
-      WriteFile(m_hstatfile,&m_bytes_total_h,4,&d,NULL);
-      WriteFile(m_hstatfile,m_hash,SHA_OUTSIZE,&d,NULL);
-      if (m_validbf) 
-        WriteFile(m_hstatfile,m_validbf,(m_chunk_total+7)/8,&d,NULL);
-      SetEndOfFile(m_hstatfile);
-    }
-    CloseHandle(m_hstatfile);
-  }
+  if (m_hstatfile != INVALID_HANDLE_VALUE) CloseHandle(m_hstatfile);
 #else
   if (m_outfile) 
   {
@@ -748,23 +1660,21 @@ XferRecv::~XferRecv()
     // fucko for bsd, write date(s)
     fclose(m_outfile);
   }
-  if (m_statfile) 
+  if (m_statfile) fclose(m_statfile);
+#endif
+  free(m_wb);
+  free(m_jr);
+  free(m_st_buf);
+  freeTree();
+  while (m_nsrc > 0)
   {
-    if (lasthdr) // flush state
-    {
-      fseek(m_statfile,0,SEEK_SET);
-      int sig1=WASTESTATE_SIG1, sig2=WASTESTATE_SIG2;
-      fwrite(&sig1,1,4,m_statfile);
-      fwrite(&sig2,1,4,m_statfile);
-      fwrite(&m_bytes_total_l,1,4,m_statfile);
-      fwrite(&m_bytes_total_h,1,4,m_statfile);
-      fwrite(m_hash,1,SHA_OUTSIZE,m_statfile);
-      if (m_validbf) fwrite(m_validbf,1,(m_chunk_total+7)/8,m_statfile);
-    }
-    fclose(m_statfile);
+    Source *s=m_src[--m_nsrc];
+    int x;
+    for (x = 0; x < s->outreq_used; x ++) g_recv_guids.del(&s->outreq[x].guid,this);
+    if (s->started) g_recv_guids.del(&s->guid,this);
+    delete s->request;
+    free(s);
   }
-#endif
-  free(m_validbf);
   if (m_done)
   {
 #ifndef XFER_WIN32_FILEIO
@@ -835,7 +1745,7 @@ XferRecv::~XferRecv()
 char *XferRecv::getOutputFileCopy()
 {
 #ifdef XFER_WIN32_FILEIO
-  if (m_houtfile == INVALID_HANDLE_VALUE || !m_validbf) return NULL;
+  if (m_houtfile == INVALID_HANDLE_VALUE || !m_valid.ok() || !flushWrites()) return NULL;
   char *p=m_outfile_fn+strlen(m_outfile_fn);
   while (p >= m_outfile_fn && *p != '/' && *p != '\\') p--;
   p++;
@@ -857,7 +1767,7 @@ char *XferRecv::getOutputFileCopy()
   SetFilePointer(m_houtfile,0,NULL,FILE_BEGIN);
   for (;;)
   {
-    if (!IS_VALID(x)) break;
+    if (!m_valid.is(x)) break;
     DWORD d;
     char buf[4096];
     if (!ReadFile(m_houtfile,buf,sizeof(buf),&d,NULL)) break;
@@ -876,29 +1786,597 @@ char *XferRecv::getOutputFileCopy()
 void XferRecv::Abort(C_MessageQueueList *mql) 
 { 
   // send abort message
-  request.set_prev_guid(&m_guid);
-  request.set_abort(1);
+  int x;
+  for (x = 0; x < m_nsrc; x ++) sendAbort(mql,m_src[x],1);
+  sprintf(m_errbuf,"Aborted @ %d%%",(m_chunk_cnt*100)/m_chunk_total);
+  m_err=m_errbuf;
+}
+
+void XferRecv::sendAbort(C_MessageQueueList *mql, Source *s, int abort)
+{
+  if (!s->started) return; // never asked it for anything
+  s->request->set_prev_guid(&s->guid);
+  s->request->set_abort(abort);
   T_Message m={0,};
-  m.data=request.Make();
+  m.data=s->request->Make();
   m.message_type=MESSAGE_FILE_REQUEST;
   m.message_length=m.data->GetLength();
 
-  mql->send(&m);
-  sprintf(m_errbuf,"Aborted @ %d%%",(m_chunk_cnt*100)/m_chunk_total);
-  m_err=m_errbuf;
+  if (mql->send_bulk(&m,s->request->get_guid()) < 0) mql->send(&m);
+}
+
+XferRecv::Source *XferRecv::newSource(char *filename)
+{
+  Source *s=(Source *)malloc(sizeof(Source));
+  memset(s,0,sizeof(Source));
+  s->request=new C_FileSendRequest;
+
+  char *p=filename;
+  while (*p) p++;
+  while (p >= filename && 
+#ifdef _WIN32
+    *p != '\\' && 
+#endif
+    *p != '/') p--;
+  p++;
+  unsigned char fn_hash[SHA_OUTSIZE];
+  SHAify context;
+  context.add((unsigned char *)p, strlen(p));
+  context.final(fn_hash);
+  s->request->set_fn_hash(fn_hash);
+  if (g_config->ReadInt("nickonxfers",1))
+    s->request->set_nick(g_regnick);
+
+  s->adaptive_chunksize=FILE_MAX_CHUNKS_PER_REQ/2;
+  s->window=s->adaptive_chunksize;
+  s->chunks_coming=100000000;
+  return s;
+}
+
+int XferRecv::AddSource(char *guididx, char *filename)
+{
+  if (m_err || m_done || m_nsrc >= XFER_MAX_SOURCES || strlen(guididx) < 34) return -1;
+
+  T_GUID gid;
+  MakeID128FromStr(guididx,&gid);
+  int idx=atoi(guididx+33);
+  int x;
+  for (x = 0; x < m_nsrc; x ++)
+  {
+    C_FileSendRequest *r=m_src[x]->request;
+    if (!memcmp(r->get_guid(),&gid,sizeof(T_GUID)) && r->get_idx() == idx) return -1;
+  }
+
+  Source *s=newSource(filename);
+  s->request->set_guid(&gid);
+  s->request->set_idx(idx);
+  m_src[m_nsrc++]=s;
+  return 0;
+}
+
+XferRecv *XferRecv::Find(T_GUID *guid)
+{
+  return (XferRecv *)g_recv_guids.find(guid);
+}
+
+// a guid has stopped being one of ours, unless another request still has it
+void XferRecv::retireGuid(T_GUID *guid)
+{
+  if (!findSource(guid)) g_recv_guids.del(guid,this);
+}
+
+XferRecv::Source *XferRecv::findSource(T_GUID *guid)
+{
+  int x,y;
+  for (x = 0; x < m_nsrc; x ++)
+  {
+    Source *s=m_src[x];
+    if (!s->started) continue;
+    if (!memcmp(&s->guid,guid,sizeof(T_GUID))) return s;
+    for (y = 0; y < s->outreq_used; y ++)
+      if (!memcmp(&s->outreq[y].guid,guid,sizeof(T_GUID))) return s;
+  }
+  return NULL;
+}
+
+// stops using a source, whatever it still owed us is up for grabs again
+void XferRecv::dropSource(int i)
+{
+  Source *s=m_src[i];
+  sendAbort(g_mql,s,1);
+  resetPipeline(s);
+  m_nsrc--;
+  memmove(m_src+i,m_src+i+1,(m_nsrc-i)*sizeof(Source *));
+  if (s->started) retireGuid(&s->guid);
+  delete s->request;
+  free(s);
+}
+
+
+// do periodic tasks
+int XferRecv::run(C_MessageQueueList *mql)
+{
+  if (m_err||m_done) return 1;
+  if (m_hash_state) // all in, waiting on the hash
+  {
+    if (m_hash_state == 2) checkDone();
+    return m_err||m_done;
+  }
+
+  if (lasthdr && GetTickCount()-m_last_journal_time >= XFER_JOURNAL_MS)
+  {
+    m_last_journal_time=GetTickCount();
+    journalState();
+    if (m_err) return 1;
+  }
+
+  if (m_blocks_pending)
+  {
+    if (checkBlocks(20) && m_chunk_cnt >= m_chunk_total) checkDone();
+    if (m_err||m_done) return 1;
+  }
+  if (m_stream_on && m_tree_ok != 1 && m_stream_next < m_chunk_total && m_valid.is(m_stream_next))
+    streamFile(20);
+
+  int x;
+  for (x = 0; x < m_nsrc; x ++)
+  {
+    if (!runSource(mql,m_src[x])) continue;
+    if (m_nsrc > 1) dropSource(x--);
+    else
+    {
+      sprintf(m_errbuf,"Timed out @ %d%%",(m_chunk_cnt*100)/m_chunk_total);
+      m_err=m_errbuf;
+      return 1; // timeout
+    }
+  }
+  return 0;
+}
+
+int XferRecv::runSource(C_MessageQueueList *mql, Source *s)
+{
+  if (!s->started)
+  {
+    // extra sources join once pipelining is up, unless they're all that's left
+    if (!m_req.ok() && s != m_src[0]) return 0;
+    if (m_req.ok()) s->pipeline=1;
+    sendRequest(mql,s,s->pipeline ? s->window : s->adaptive_chunksize);
+    return 0;
+  }
+
+  if (s->pipeline && time(NULL)-s->last_msg_time <= 30)
+  {
+    expireRequests(s);
+    // keep the window full, in requests of a useful size
+    while (s->outreq_used < XFER_MAX_OUTREQ)
+    {
+      int room=s->window-s->inflight;
+      if (room < FILE_MAX_CHUNKS_PER_REQ/4 && room < s->window/2) break;
+      int oldinflight=s->inflight;
+      sendRequest(mql,s,room);
+      if (s->inflight == oldinflight) break; // nothing left to ask for
+    }
+    return 0;
+  }
+
+  if (s->chunks_coming<=0 || time(NULL)-s->last_msg_time > 30)
+  {
+    // send a new request
+    if (s->chunks_coming <= 0)
+    {
+      s->adaptive_chunksize += s->adaptive_chunksize/4;
+      if (s->adaptive_chunksize>=FILE_MAX_CHUNKS_PER_REQ) s->adaptive_chunksize=FILE_MAX_CHUNKS_PER_REQ;
+    }
+    else
+    {
+      s->adaptive_chunksize-=s->chunks_coming;
+      if (s->adaptive_chunksize<4) s->adaptive_chunksize=4;
+    }
+
+    s->chunks_coming=1000000;
+    if (!s->verified || !s->hasgotchunks) return 1; // timeout
+
+    m_chunk_cnt=m_valid.count();
+
+    if (s->pipeline) resetPipeline(s); // stalled, start over
+    else if ((s->caps & FILE_CAP_PIPELINE) && g_config->ReadInt("recv_pipeline",1))
+    {
+      // first batch is in, sender will queue requests from here on
+      if (m_req.ok() || m_req.resize(m_chunk_total))
+      {
+        s->pipeline=1;
+        resetPipeline(s);
+      }
+    }
+
+    sendRequest(mql,s,s->pipeline ? s->window : s->adaptive_chunksize);
+    s->hasgotchunks=0;
+
+    s->last_msg_time=time(NULL)+30; // give it a little more time the first time
+  }
+  return 0;
+}
+
+static int cmp_chunk(const void *a, const void *b)
+{
+  unsigned int x=*(unsigned int *)a, y=*(unsigned int *)b;
+  return x < y ? -1 : x > y;
+}
+
+// asks for up to maxchunks of what we don't have and haven't asked for yet
+void XferRecv::sendRequest(C_MessageQueueList *mql, Source *s, int maxchunks)
+{
+  unsigned int chunks[FILE_MAX_CHUNKS_PER_REQ];
+  int n=0;
+  unsigned int x;
+  if (maxchunks > FILE_MAX_CHUNKS_PER_REQ) maxchunks=FILE_MAX_CHUNKS_PER_REQ;
+
+  // what we don't have, less what's on its way
+  m_first_chunkilack=m_valid.findClear(m_first_chunkilack);
+  C_ChunkSet *busy=s->pipeline ? &m_req : NULL;
+  for (x = m_valid.findClear(m_first_chunkilack,busy); x < m_chunk_total && n < maxchunks; x=m_valid.findClear(x+1,busy))
+    chunks[n++]=x;
+  if (s->pipeline && !n && m_nsrc > 1)
+  {
+    // end game: everything has been asked for. rather than sit idle, race
+    // the other sources for what they still owe, newest requests first since
+    // those are the furthest from showing up. whichever copy lands first wins.
+    int y,i,j;
+    for (y = 0; y < m_nsrc && n < maxchunks; y ++)
+    {
+      Source *o=m_src[y];
+      if (o == s) continue;
+      for (i = o->outreq_used-1; i >= 0 && n < maxchunks; i --)
+      {
+        OutReq *r=o->outreq+i;
+        for (j = 0; j < r->n && n < maxchunks; j ++)
+        {
+          unsigned int c=r->chunks[j];
+          if (m_valid.is(c) || findOutReq(s,c) >= 0) continue;
+          int k;
+          for (k = 0; k < n && chunks[k] != c; k ++);
+          if (k == n) chunks[n++]=c;
+        }
+      }
+    }
+    qsort(chunks,n,sizeof(unsigned int),cmp_chunk);
+  }
+
+  // and any pages of the hash tree we're missing, after the chunks
+  int nt=0;
+  if (m_tree && !m_tree_ok && (s->caps & FILE_CAP_TREE))
+  {
+    time_t now=time(NULL);
+    for (x = 0; x < (unsigned int)m_tree_pages && n+nt < FILE_MAX_CHUNKS_PER_REQ; x ++)
+    {
+      if (m_tree_pgot[x] || (m_tree_ptime[x] && now-m_tree_ptime[x] < 30)) continue;
+      m_tree_ptime[x]=now;
+      chunks[n+nt++]=FILE_TREE_INDEX+x;
+    }
+  }
+  if (s->pipeline && !n && !nt) return;
+
+  C_FileSendRequest *req=s->request;
+  req->clear_need_chunks();
+  req->set_caps(FILE_CAP_PIPELINE|FILE_CAP_MULTICHUNK|FILE_CAP_TREE);
+  // tree pages go first, so they're in before the chunks finish off the request
+  for (x = n; x < (unsigned int)(n+nt); x ++) req->add_need_chunk(chunks[x]);
+  for (x = 0; x < (unsigned int)n; x ++) req->add_need_chunk(chunks[x]);
+  if (s->started) req->set_prev_guid(&s->guid);
+
+  T_Message m={0,};
+  m.data=req->Make();
+  m.message_type=MESSAGE_FILE_REQUEST;
+  m.message_length=m.data->GetLength();
+
+  // straight down a bulk link to the host if we have one (directxfers)
+  if (mql->send_bulk(&m,s->request->get_guid()) < 0) mql->send(&m);
+
+  T_GUID prev=s->guid;
+  int had=s->started;
+  s->guid=m.message_guid;
+  g_recv_guids.add(&s->guid,this);
+  if (!s->started)
+  {
+    s->started=1;
+    s->last_msg_time=time(NULL)+30; // give it a little more time the first time
+  }
+
+  if (s->pipeline)
+  {
+    OutReq *r=s->outreq+s->outreq_used++;
+    r->guid=s->guid;
+    r->sent=GetTickCount();
+    r->n=r->left=n;
+    r->sampled=0;
+    memcpy(r->chunks,chunks,n*sizeof(unsigned int));
+    for (x = 0; x < (unsigned int)n; x ++) m_req.set(chunks[x]);
+    s->inflight+=n;
+  }
+  if (had) retireGuid(&prev); // still good if it's in outreq
+}
+
+// forgets what a source was asked for, so it can be asked for again
+void XferRecv::resetPipeline(Source *s)
+{
+  int x,i;
+  if (m_req.ok()) for (x = 0; x < s->outreq_used; x ++)
+  {
+    OutReq *r=s->outreq+x;
+    for (i = 0; i < r->n; i ++) if (!m_valid.is(r->chunks[i])) m_req.clr(r->chunks[i]);
+  }
+  s->inflight=0;
+  forgetOutReqs(s);
+  s->window=s->adaptive_chunksize;
+  if (s->window < XFER_MIN_WINDOW) s->window=XFER_MIN_WINDOW;
+}
+
+void XferRecv::forgetOutReqs(Source *s)
+{
+  int x, n=s->outreq_used;
+  s->outreq_used=0;
+  for (x = 0; x < n; x ++) retireGuid(&s->outreq[x].guid);
+}
+
+// gives up on requests whose chunks are overdue, so they get asked for again
+void XferRecv::expireRequests(Source *s)
+{
+  unsigned int now=GetTickCount();
+  unsigned int rto=s->srtt ? s->srtt*2+2000 : 15000;
+  if (rto > 30000) rto=30000;
+
+  int x=0;
+  while (x < s->outreq_used)
+  {
+    OutReq *r=s->outreq+x;
+    if (now-r->sent < rto)
+    {
+      x++;
+      continue;
+    }
+    int i;
+    for (i = 0; i < r->n; i ++)
+      if (!m_valid.is(r->chunks[i])) m_req.clr(r->chunks[i]);
+    s->inflight-=r->left;
+    if (r->left && now-s->lastloss > s->srtt) // once per round trip
+    {
+      s->window/=2;
+      if (s->window < XFER_MIN_WINDOW) s->window=XFER_MIN_WINDOW;
+      s->lastloss=now;
+    }
+    T_GUID g=r->guid;
+    s->outreq_used--;
+    memmove(r,r+1,(s->outreq_used-x)*sizeof(OutReq));
+    retireGuid(&g);
+  }
+}
+
+int XferRecv::findOutReq(Source *s, unsigned int idx)
+{
+  int x;
+  for (x = 0; x < s->outreq_used; x ++)
+  {
+    OutReq *r=s->outreq+x;
+    if (!r->n || idx < r->chunks[0] || idx > r->chunks[r->n-1]) continue; // n=0: just tree pages
+    int lo=0, hi=r->n-1;
+    while (lo < hi)
+    {
+      int mid=(lo+hi)/2;
+      if (r->chunks[mid] < idx) lo=mid+1;
+      else hi=mid;
+    }
+    if (r->chunks[lo] == idx) return x;
+  }
+  return -1;
+}
+
+// idx is in for the first time. every source that was asked for it is
+// done waiting on it, only the one that sent it gets an rtt sample.
+void XferRecv::gotChunk(Source *from, unsigned int idx)
+{
+  m_req.clr(idx);
+
+  int x;
+  for (x = 0; x < m_nsrc; x ++)
+  {
+    Source *s=m_src[x];
+    int i=findOutReq(s,idx);
+    if (i < 0) continue;
+    OutReq *r=s->outreq+i;
+    s->inflight--;
+
+    if (s == from && !r->sampled)
+    {
+      unsigned int rtt=GetTickCount()-r->sent;
+      r->sampled=1;
+      if (!s->minrtt || rtt < s->minrtt) s->minrtt=rtt;
+      s->srtt=s->srtt ? (s->srtt*7+rtt)/8 : rtt;
+    }
+    if (--r->left <= 0)
+    {
+      // grow by about a request per round trip while the delay holds, back
+      // off a little when queues along the route start to fill
+      if (r->sampled && s->srtt < s->minrtt*2+100)
+      {
+        int inc=FILE_MAX_CHUNKS_PER_REQ*r->n/s->window;
+        s->window+=inc>0?inc:1;
+        if (s->window > XFER_MAX_WINDOW) s->window=XFER_MAX_WINDOW;
+      }
+      else if (r->sampled && s->srtt > s->minrtt*4+500)
+      {
+        s->window-=s->window/8;
+        if (s->window < XFER_MIN_WINDOW) s->window=XFER_MIN_WINDOW;
+      }
+      T_GUID g=r->guid;
+      s->outreq_used--;
+      memmove(r,r+1,(s->outreq_used-i)*sizeof(OutReq));
+      retireGuid(&g);
+    }
+  }
+}
+
+// queues data for chunk idx on in the write-behind buffer. what's there is
+// written out first unless this carries straight on from it. 0 on error.
+int XferRecv::writeData(unsigned int idx, unsigned char *data, int len)
+{
+  if (m_wb_len && (idx != m_wb_idx+m_wb_len/FILE_CHUNKSIZE || (m_wb_len%FILE_CHUNKSIZE) ||
+                   m_wb_len+len > XFER_WRITEBEHIND))
+  {
+    if (!flushWrites()) return 0;
+  }
+  if (!m_wb && !(m_wb=(unsigned char *)malloc(XFER_WRITEBEHIND))) return 0;
+  if (!m_wb_len) m_wb_idx=idx;
+  memcpy(m_wb+m_wb_len,data,len);
+  m_wb_len+=len;
+  return 1;
+}
+
+// writes out the write-behind buffer, 0 on error
+int XferRecv::flushWrites()
+{
+  if (!m_wb_len) return 1;
+  int len=m_wb_len;
+  m_wb_len=0;
+  unsigned int nch=(len+FILE_CHUNKSIZE-1)/FILE_CHUNKSIZE;
+#ifdef XFER_WIN32_FILEIO
+  unsigned int pos_l=FILE_CHUNKSIZE*m_wb_idx;
+  unsigned int pos_h=(unsigned int) (((__int64)FILE_CHUNKSIZE*(__int64)m_wb_idx)>>32);
+  if (m_outfile_lastpos_l != pos_l || m_outfile_lastpos_h != pos_h)
+  {
+    LONG h=pos_h;
+    if (SetFilePointer(m_houtfile,pos_l,&h,FILE_BEGIN) == 0xFFFFFFFF && GetLastError() != NO_ERROR) return 0;
+  }
+  DWORD d;
+  if (!WriteFile(m_houtfile,m_wb,len,&d,NULL) || d != (DWORD)len)
+  {
+    m_outfile_lastpos_l=m_outfile_lastpos_h=0xFFFFFFFF;
+    return 0;
+  }
+  m_outfile_lastpos_l=pos_l+len;
+  m_outfile_lastpos_h=pos_h+(m_outfile_lastpos_l < pos_l);
+#else
+  off_t pos=(off_t)m_wb_idx*FILE_CHUNKSIZE;
+  unsigned char *p=m_wb;
+  while (len > 0)
+  {
+    ssize_t n=pwrite(fileno(m_outfile),p,len,pos);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return 0;
+    p+=n;
+    pos+=n;
+    len-=n;
+  }
+#endif
+  noteWritten(m_wb_idx,nch);
+  return 1;
+}
+
+// remembers chunks that are on their way to disk, for the journal
+void XferRecv::noteWritten(unsigned int idx, unsigned int n)
+{
+  if (m_jr_n && m_jr[m_jr_n*2-2]+m_jr[m_jr_n*2-1] == idx)
+  {
+    m_jr[m_jr_n*2-1]+=n;
+    return;
+  }
+  if (m_jr_n >= m_jr_size)
+  {
+    int ns=m_jr_size ? m_jr_size*2 : 64;
+    unsigned int *t=(unsigned int *)realloc(m_jr,ns*2*sizeof(unsigned int));
+    if (!t)
+    {
+      m_state_compact=1; // lost track, rewrite it all next time
+      return;
+    }
+    m_jr=t;
+    m_jr_size=ns;
+  }
+  m_jr[m_jr_n*2]=idx;
+  m_jr[m_jr_n*2+1]=n;
+  m_jr_n++;
+}
+
+// reads back from chunk idx on, returns bytes read
+unsigned int XferRecv::readData(unsigned int idx, unsigned char *buf, unsigned int len)
+{
+  if (!flushWrites())
+  {
+    m_err="error writing";
+    return 0;
+  }
+#ifdef XFER_WIN32_FILEIO
+  m_outfile_lastpos_l=m_outfile_lastpos_h=0xFFFFFFFF; // make the next write seek
+  LONG h=(LONG) (((__int64)FILE_CHUNKSIZE*(__int64)idx)>>32);
+  DWORD d;
+  SetFilePointer(m_houtfile,FILE_CHUNKSIZE*idx,&h,FILE_BEGIN);
+  if (!ReadFile(m_houtfile,buf,len,&d,NULL)) d=0;
+  return d;
+#else
+  ssize_t n;
+  do n=pread(fileno(m_outfile),buf,len,(off_t)idx*FILE_CHUNKSIZE);
+  while (n < 0 && errno == EINTR);
+  return n > 0 ? (unsigned int)n : 0;
+#endif
+}
+
+// takes what the state file gets next into m_st_buf: the whole bitmap, or
+// the records written since last time. returns 0 if there's nothing to write.
+int XferRecv::snapState(int rewrite)
+{
+  if (!flushWrites())
+  {
+    m_err="error writing";
+    return 0;
+  }
+#ifdef XFER_WIN32_FILEIO
+  if (m_hstatfile == INVALID_HANDLE_VALUE) return 0;
+#else
+  if (!m_statfile) return 0;
+#endif
+  int len=rewrite ? (m_valid.ok() ? (m_chunk_total+7)/8 : 0) : m_jr_n*12;
+  if (len > m_st_size)
+  {
+    unsigned char *t=(unsigned char *)realloc(m_st_buf,len);
+    if (!t)
+    {
+      m_state_compact=1; // try again, all of it, next time
+      return 0;
+    }
+    m_st_buf=t;
+    m_st_size=len;
+  }
+  if (rewrite)
+  {
+    if (len) m_valid.toBytes(m_st_buf);
+    m_journal_n=0;
+    m_state_compact=0;
+  }
+  else
+  {
+    int x;
+    unsigned int *r=(unsigned int *)m_st_buf;
+    for (x = 0; x < m_jr_n; x ++)
+    {
+      r[x*3]=m_jr[x*2];
+      r[x*3+1]=m_jr[x*2+1];
+      r[x*3+2]=m_jr[x*2]^m_jr[x*2+1]^WASTESTATE_JSIG;
+    }
+    m_journal_n+=m_jr_n;
+  }
+  m_jr_n=0;
+  m_st_rewrite=rewrite;
+  m_st_len=len;
+  return 1;
 }
 
-
-// do periodic tasks
-int XferRecv::run(C_MessageQueueList *mql)
+// gets the data to disk, then writes out m_st_buf to say it's there
+void XferRecv::writeState()
 {
-  if (m_err||m_done) return 1;
-
 #ifdef XFER_WIN32_FILEIO
-  if (m_hstatfile != INVALID_HANDLE_VALUE && lasthdr && time(NULL) > m_next_stateflush_time) // flush state
+  DWORD d;
+  FlushFileBuffers(m_houtfile);
+  if (m_st_rewrite)
   {
-    m_next_stateflush_time=time(NULL)+60;
-    DWORD d;
     SetFilePointer(m_hstatfile,0,NULL,FILE_BEGIN);
     int sig1=WASTESTATE_SIG1, sig2=WASTESTATE_SIG2;
     WriteFile(m_hstatfile,&sig1,4,&d,NULL);
@@ -906,14 +2384,22 @@ int XferRecv::run(C_MessageQueueList *mql)
     WriteFile(m_hstatfile,&m_bytes_total_l,4,&d,NULL);
     WriteFile(m_hstatfile,&m_bytes_total_h,4,&d,NULL);
     WriteFile(m_hstatfile,m_hash,SHA_OUTSIZE,&d,NULL);
-    if (m_validbf) 
-      WriteFile(m_hstatfile,m_validbf,(m_chunk_total+7)/8,&d,NULL);
+    if (m_st_len) WriteFile(m_hstatfile,m_st_buf,m_st_len,&d,NULL);
     SetEndOfFile(m_hstatfile);
   }
+  else
+  {
+    SetFilePointer(m_hstatfile,0,NULL,FILE_END);
+    WriteFile(m_hstatfile,m_st_buf,m_st_len,&d,NULL);
+  }
 #else
-  if (m_statfile && lasthdr && time(NULL) > m_next_stateflush_time) // flush state
+#ifdef __APPLE__
+  fsync(fileno(m_outfile));
+#else
+  fdatasync(fileno(m_outfile));
+#endif
+  if (m_st_rewrite)
   {
-    m_next_stateflush_time=time(NULL)+60;
     fseek(m_statfile,0,SEEK_SET);
     int sig1=WASTESTATE_SIG1, sig2=WASTESTATE_SIG2;
     fwrite(&sig1,1,4,m_statfile);
@@ -921,90 +2407,384 @@ int XferRecv::run(C_MessageQueueList *mql)
     fwrite(&m_bytes_total_l,1,4,m_statfile);
     fwrite(&m_bytes_total_h,1,4,m_statfile);
     fwrite(m_hash,1,SHA_OUTSIZE,m_statfile);
-    if (m_validbf) fwrite(m_validbf,1,(m_chunk_total+7)/8,m_statfile);
+    if (m_st_len) fwrite(m_st_buf,1,m_st_len,m_statfile);
+    fflush(m_statfile);
+    ftruncate(fileno(m_statfile),ftell(m_statfile));
+  }
+  else
+  {
+    fseek(m_statfile,0,SEEK_END);
+    fwrite(m_st_buf,1,m_st_len,m_statfile);
     fflush(m_statfile);
   }
 #endif
+}
+
+// rewrites the state file right here, once the io thread is done with it
+void XferRecv::flushState()
+{
+  if (snapState(1)) writeState();
+}
+
+void XferRecv::_writestate(void *_d)
+{
+  ((XferRecv*)_d)->writeState();
+}
+
+// appends the chunks written since last time to the state file, once
+// they're on disk. a crash then loses a second or so instead of a minute.
+// the syncing and writing is left to the io thread; if it's still busy
+// with the last lot, these wait for the next time around.
+void XferRecv::journalState()
+{
+  if (!m_jr_n && !m_state_compact) return;
+  if (m_st_queued && g_xferio->busy(this)) return;
+  if (!snapState(m_state_compact || m_journal_n+m_jr_n > XFER_JOURNAL_MAX)) return;
+  m_st_queued=1;
+  if (!g_xferio) g_xferio=new C_XferIO;
+  g_xferio->add(_writestate,this);
+}
+
+void XferRecv::freeTree()
+{
+  free(m_tree);
+  free(m_tree_pgot);
+  free(m_tree_ptime);
+  free(m_blockstate);
+  m_tree=0;
+  m_tree_pgot=0;
+  m_tree_ptime=0;
+  m_blockstate=0;
+  m_tree_n=m_tree_ok=m_tree_pages=0;
+  m_blocks_ok=m_blocks_pending=m_blocks_bad=m_block_scan=0;
+}
+
+// once every page is in, the leaves have to add up to the header's root
+void XferRecv::gotTree()
+{
+  int x;
+  for (x = 0; x < m_tree_pages && m_tree_pgot[x]; x ++);
+  if (x < m_tree_pages) return;
 
-  if (chunks_coming<=0 || time(NULL)-last_msg_time > 30)
+  unsigned char root[SHA_OUTSIZE];
+  FileTree_Root(m_tree,m_tree_n,root);
+  if (memcmp(root,m_tree_root,SHA_OUTSIZE))
   {
-    unsigned int x;
-    // send a new request
-    if (chunks_coming <= 0)
-    {
-      m_adaptive_chunksize += m_adaptive_chunksize/4;
-      if (m_adaptive_chunksize>=FILE_MAX_CHUNKS_PER_REQ) m_adaptive_chunksize=FILE_MAX_CHUNKS_PER_REQ;
-    }
-    else
+    debug_printf("xfer_recv: hash tree doesn't match its root, checking the whole file instead\n");
+    freeTree();
+    m_tree_ok=-1;
+    return;
+  }
+  m_tree_ok=1;
+  for (x = 0; x < m_tree_n; x ++) blockFilled(x); // what we had already (resuming)
+}
+
+// chunks of block b were written, queue it for checking if it's all there
+void XferRecv::blockFilled(unsigned int b)
+{
+  if (m_blockstate[b] == 1) return;
+  unsigned int x=b*FILE_TREE_BLOCK, e=x+FILE_TREE_BLOCK;
+  if (e > m_chunk_total) e=m_chunk_total;
+  if (m_valid.findClear(x) < e) return;
+  if (m_blockstate[b] == 2) m_blocks_ok--; // written over, check it again
+  m_blockstate[b]=1;
+  m_blocks_pending++;
+}
+
+// rereads queued blocks and checks them against their leaves, for up to
+// maxms. a bad block's chunks are dropped so they get asked for again.
+// returns how many checked out.
+int XferRecv::checkBlocks(unsigned int maxms)
+{
+  unsigned int start=GetTickCount();
+  int good=0;
+  while (m_blocks_pending > 0 && GetTickCount()-start <= maxms)
+  {
+    while (m_blockstate[m_block_scan] != 1) m_block_scan=(m_block_scan+1)%m_tree_n;
+    unsigned int b=m_block_scan;
+
+    unsigned int c=b*FILE_TREE_BLOCK;
+    unsigned int l=FILE_TREE_BLOCK*FILE_CHUNKSIZE;
+    if (b == (unsigned int)m_tree_n-1) l=m_bytes_total_l-c*FILE_CHUNKSIZE; // short last block
+    SHAify context;
+    while (l>0)
     {
-      m_adaptive_chunksize-=chunks_coming;
-      if (m_adaptive_chunksize<4) m_adaptive_chunksize=4;
+      unsigned char buf[16*FILE_CHUNKSIZE];
+      unsigned int a=sizeof(buf);
+      if (a > l) a=l;
+      a=readData(c,buf,a);
+      if (!a) break;
+      context.add(buf,a);
+      c+=a/FILE_CHUNKSIZE;
+      l-=a;
     }
+    unsigned char hash[SHA_OUTSIZE];
+    context.final(hash);
+    m_blocks_pending--;
 
-    chunks_coming=1000000;
-    if (lasthdr && m_hasgotchunks)
+    if (!l && !memcmp(hash,m_tree+b*SHA_OUTSIZE,SHA_OUTSIZE))
     {
-      request.set_prev_guid(&m_guid);
-      m_chunk_cnt=0;
-      for (x = 0; x < m_chunk_total; x ++)
-      {
-        if (IS_VALID(x)) m_chunk_cnt++;
-      }
+      m_blockstate[b]=2;
+      m_blocks_ok++;
+      good++;
+      continue;
     }
-    else
+
+    debug_printf("xfer_recv: block %d is bad, getting it again\n",b);
+    m_blockstate[b]=0;
+    unsigned int x=b*FILE_TREE_BLOCK, e=x+FILE_TREE_BLOCK;
+    if (e > m_chunk_total) e=m_chunk_total;
+    if (x < m_first_chunkilack) m_first_chunkilack=x;
+    m_state_compact=1; // the journal may have these as good
+    m_chunk_cnt-=m_valid.clrRange(x,e-x);
+    if (++m_blocks_bad > 16)
     {
-      sprintf(m_errbuf,"Timed out @ %d%%",(m_chunk_cnt*100)/m_chunk_total);
+      sprintf(m_errbuf,"Too many bad blocks @ %d%%",(m_chunk_cnt*100)/m_chunk_total);
       m_err=m_errbuf;
-      return 1; // timeout
+      for (x = 0; x < (unsigned int)m_nsrc; x ++) sendAbort(g_mql,m_src[x],1);
+      break;
     }
+  }
+  return good;
+}
+
+// feeds the file's hash whatever in this reply now continues it
+void XferRecv::streamChunks(unsigned char *data, unsigned int idx, int len)
+{
+  while (m_stream_next >= idx && m_stream_next < m_chunk_total && m_valid.is(m_stream_next))
+  {
+    unsigned int o=(m_stream_next-idx)*FILE_CHUNKSIZE;
+    if (o >= (unsigned int)len) break;
+    unsigned int l=len-o, rem=m_bytes_total_l-m_stream_next*FILE_CHUNKSIZE;
+    if (l > FILE_CHUNKSIZE) l=FILE_CHUNKSIZE;
+    if (l > rem) l=rem;
+    m_stream_ctx.add(data+o,l);
+    m_stream_next++;
+  }
+}
+
+// catches the file's hash up to m_first_chunkilack from disk, for chunks
+// that beat the ones before them, or that we had from before a resume
+void XferRecv::streamFile(unsigned int maxms)
+{
+  unsigned int start=GetTickCount();
+  while (m_stream_next < m_chunk_total && m_valid.is(m_stream_next) && GetTickCount()-start <= maxms)
+  {
+    unsigned char buf[16*FILE_CHUNKSIZE];
+    unsigned int n=1;
+    while (n < 16 && m_stream_next+n < m_chunk_total && m_valid.is(m_stream_next+n)) n++;
+    unsigned int pos=m_stream_next*FILE_CHUNKSIZE, l=n*FILE_CHUNKSIZE;
+    if (l > m_bytes_total_l-pos) l=m_bytes_total_l-pos;
+
+    if (readData(m_stream_next,buf,l) != l) return;
+    m_stream_ctx.add(buf,l);
+    m_stream_next+=n;
+  }
+}
+
+#ifdef _WIN32
+unsigned long WINAPI XferRecv::_hashthread(LPVOID _d)
+#else
+void *XferRecv::_hashthread(void *_d)
+#endif
+{
+  XferRecv *_this=(XferRecv*)_d;
+  _this->hashRest();
+  _this->m_hash_state=2;
+  return 0;
+}
+
+// runs on the worker thread, with a handle of its own: finishes the file's
+// hash from m_stream_next. nothing is written to the file meanwhile.
+void XferRecv::hashRest()
+{
+  unsigned int pos=m_stream_next*FILE_CHUNKSIZE, l=m_bytes_total_l-pos;
+#ifdef XFER_WIN32_FILEIO
+  HANDLE h=CreateFile(m_outfile_fn,GENERIC_READ,FILE_SHARE_READ|FILE_SHARE_WRITE,
+    NULL,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,NULL);
+  if (h == INVALID_HANDLE_VALUE) return;
+  SetFilePointer(h,pos,NULL,FILE_BEGIN);
+#else
+  FILE *fp=fopen(m_outfile_fn,"rb");
+  if (!fp) return;
+  fseek(fp,pos,SEEK_SET);
+#endif
+  while (l>0 && !m_hash_kill)
+  {
+    unsigned char buf[65536];
+    unsigned int a=sizeof(buf);
+    if (a > l) a=l;
+#ifdef XFER_WIN32_FILEIO
+    DWORD d;
+    if (!ReadFile(h,buf,a,&d,NULL)) d=0;
+    a=d;
+#else
+    a=fread(buf,1,a,fp);
+#endif
+    if (!a) break;
+    m_stream_ctx.add(buf,a);
+    l-=a;
+  }
+#ifdef XFER_WIN32_FILEIO
+  CloseHandle(h);
+#else
+  fclose(fp);
+#endif
+  if (!l)
+  {
+    m_stream_ctx.final(m_stream_hash);
+    m_hash_ok=1;
+  }
+}
+
+void XferRecv::joinHashThread()
+{
+  if (m_hash_thread)
+  {
+#ifdef _WIN32
+    WaitForSingleObject(m_hash_thread,INFINITE);
+    CloseHandle(m_hash_thread);
+#else
+    void *p;
+    pthread_join(m_hash_thread,&p);
+#endif
+    m_hash_thread=0;
+  }
+  m_hash_state=0;
+}
+
+// every chunk is in. with a good tree we're done once all the blocks have
+// checked out, otherwise the whole file has to match the header's hash.
+void XferRecv::checkDone()
+{
+  unsigned int x;
+  m_chunk_cnt=m_valid.count();
+  if (m_chunk_cnt < m_chunk_total) return;
 
-    T_Message m={0,};
-    request.clear_need_chunks();
-    int setfirst=0;
-    for (x = m_first_chunkilack; x < m_chunk_total && request.get_chunks_needed() < m_adaptive_chunksize; x ++)
+  if (m_tree_ok == 1)
+  {
+    if (m_blocks_ok < m_tree_n) return; // run() is still at it
+  }
+  else if (lasthdr)
+  {
+    unsigned char zerohash[SHA_OUTSIZE]={0,};
+    unsigned char hash[SHA_OUTSIZE];
+    unsigned int l_h,l_l;
+    lasthdr->get_file_len(&l_l,&l_h);
+    lasthdr->get_hash(hash);
+    if (memcmp(zerohash,hash,SHA_OUTSIZE) && !l_h)
     {
-      if (!IS_VALID(x)) 
+      if (m_hash_state == 1) return;
+      if (m_hash_state == 2) joinHashThread();
+      else if (m_stream_next < m_chunk_total)
       {
-        request.add_need_chunk(x);
-        if (!setfirst) 
+        // hash the rest without holding everything else up
+        if (!flushWrites())
         {
-          m_first_chunkilack=x;
-          setfirst++;
+          m_err="error writing";
+          return;
         }
+        m_hash_ok=0;
+        m_hash_state=1;
+#ifdef _WIN32
+        DWORD id;
+        m_hash_thread=CreateThread(NULL,0,_hashthread,(LPVOID)this,0,&id);
+        if (m_hash_thread) return;
+#else
+        if (pthread_create(&m_hash_thread,NULL,_hashthread,(void*)this) == 0) return;
+#endif
+        m_hash_thread=0;
+        hashRest();
+        m_hash_state=0;
+      }
+      else
+      {
+        m_stream_ctx.final(m_stream_hash);
+        m_hash_ok=1;
+      }
+      if (!m_hash_ok || memcmp(hash,m_stream_hash,SHA_OUTSIZE))
+      {
+        m_err="SHA mismatch";
+        m_done=1;
+        for (x = 0; x < (unsigned int)m_nsrc; x ++) sendAbort(g_mql,m_src[x],2);
+        return;
       }
     }
+  }
 
-    m.data=request.Make();
-    m.message_type=MESSAGE_FILE_REQUEST;
-    m.message_length=m.data->GetLength();
-
-    mql->send(&m);
-    m_hasgotchunks=0;
-
-    m_guid=m.message_guid;
+  if (!flushWrites())
+  {
+    m_err="error writing";
+    return;
+  }
 
-    last_msg_time=time(NULL)+30; // give it a little more time the first time
+  char s[128];
+  int cps=m_last_cps;
+  sprintf(s,"Completed @ %d.%02dk/s",
+    cps/1000,(cps/10)%100);
+  if (m_total_chunks_recvd > m_chunk_cnt && m_chunk_cnt)
+  {
+    int p=(m_total_chunks_recvd-m_chunk_cnt)*100/m_chunk_cnt;
+    if (!p) sprintf(s+strlen(s)," 0.%d%% waste",((m_total_chunks_recvd-m_chunk_cnt)*1000/m_chunk_cnt)%10);
+    else sprintf(s+strlen(s)," %d%% waste",p);
   }
-  return 0;
+#ifdef _WIN32
+  int idx=g_lvrecv.FindItemByParam((int)this);
+  if (idx!=-1)
+  {
+    g_lvrecv.SetItemText(idx,2,s);
+    g_lvrecv.SetItemText(idx,3,"");
+    g_lvrecv.SetItemText(idx,0,m_outfile_fn+m_outfile_fn_ll);
+  }
+#endif
+  m_done=1;
+  for (x = 0; x < (unsigned int)m_nsrc; x ++) sendAbort(g_mql,m_src[x],2);
 }
 
 // process data! :)
-void XferRecv::onGotMsg(C_FileSendReply *reply)
+void XferRecv::onGotMsg(C_FileSendReply *reply, T_GUID *guid)
 {
-  if (m_err||m_done) { delete reply; return; }
+  if (m_err||m_done||m_hash_state) return;
+  Source *src=findSource(guid);
+  if (!src) return;
+  int srcidx=0;
+  while (m_src[srcidx] != src) srcidx++;
+
   if (reply->get_error())
   {
-    m_err=reply->get_error() == 2 ? (char*)"Aborted by remote" : (char*)"File not found";
-    delete reply;
+    if (m_nsrc > 1) dropSource(srcidx); // others still have it
+    else m_err=reply->get_error() == 2 ? (char*)"Aborted by remote" : (char*)"File not found";
     return;
   }
   unsigned int idx=reply->get_index();
-  last_msg_time=time(NULL);
-  m_hasgotchunks=1;
+  src->last_msg_time=time(NULL);
+  src->hasgotchunks=1;
   if (idx==0xFFFFFFFF) // woohoo header
   {
+    unsigned int fs_h,fs_l;
+    unsigned char srv_hash[SHA_OUTSIZE], zerohash[SHA_OUTSIZE]={0,};
+    reply->get_file_len(&fs_l,&fs_h);
+    reply->get_hash(srv_hash);
+    int same=m_valid.ok() && m_bytes_total_l == fs_l && m_bytes_total_h == fs_h && !memcmp(m_hash,srv_hash,SHA_OUTSIZE);
+
+    int x;
+    for (x = 0; x < m_nsrc && (m_src[x] == src || !m_src[x]->verified); x ++);
+    if (x < m_nsrc) // we're already getting it from elsewhere
+    {
+      // only mix in chunks from here if the hash says it's the same file
+      if (!same || !memcmp(srv_hash,zerohash,SHA_OUTSIZE) ||
+          (src->pipeline && !(reply->get_caps() & FILE_CAP_PIPELINE)))
+      {
+        debug_printf("xfer_recv: dropping source %d, not the same file\n",srcidx);
+        dropSource(srcidx);
+        return;
+      }
+    }
+    src->verified=1;
+    src->caps=reply->get_caps();
+
     delete lasthdr;
-    lasthdr=reply;
+    lasthdr=reply->Copy();
 
     if (g_config->ReadInt("directxfers",0))
     {
@@ -1012,19 +2792,15 @@ void XferRecv::onGotMsg(C_FileSendReply *reply)
       lasthdr->get_dc_ipport(&ip,&prt);
       if (ip && prt)
       {
-        NetKern_ConnectToHostIfOK(ip,prt);
+        NetKern_ConnectBulk(ip,prt,src->request->get_guid());
       }
     }
-    chunks_coming=lasthdr->get_chunkcount();    
-    unsigned int fs_h,fs_l;
-    lasthdr->get_file_len(&fs_l,&fs_h);
+    src->chunks_coming=lasthdr->get_chunkcount();    
     lasthdr->get_file_dates(&m_create_date,&m_mod_date);
     m_chunk_total=(fs_l+FILE_CHUNKSIZE-1)/FILE_CHUNKSIZE + (fs_h * ((1<<30)/FILE_CHUNKSIZE) * 4);
     if (m_chunk_total<1) m_chunk_total=1;
 
-    unsigned char srv_hash[SHA_OUTSIZE];
-    lasthdr->get_hash(srv_hash);
-    if (m_bytes_total_l != fs_l || m_bytes_total_h != fs_h || memcmp(m_hash,srv_hash,SHA_OUTSIZE) || !m_validbf)
+    if (!same)
     {
       memcpy(m_hash,srv_hash,SHA_OUTSIZE);
       m_bytes_total_l=fs_l;
@@ -1041,86 +2817,132 @@ void XferRecv::onGotMsg(C_FileSendReply *reply)
       m_chunk_cnt=0;
       m_total_chunks_recvd=0;
       m_chunk_startcnt=0;
-      free(m_validbf);
-      m_validbf=(unsigned char *)calloc(1,(m_chunk_total+7)/8);
+      m_valid.resize(m_chunk_total);
+      freeTree();
+#if !defined(XFER_WIN32_FILEIO) && defined(__linux__)
+      // reserve the space up front so a big file isn't left in pieces. the
+      // length stays put, the file only grows as chunks are written.
+      if (fs_l || fs_h) fallocate(fileno(m_outfile),FALLOC_FL_KEEP_SIZE,0,((off_t)fs_h<<32)|fs_l);
+#endif
+      m_stream_ctx.reset();
+      m_stream_next=0;
+      m_jr_n=0;
+      m_state_compact=1;
+      if (m_req.ok()) // different file, back to one source and one request at a time
+      {
+        for (x = m_nsrc-1; x >= 0; x --) if (m_src[x] != src) dropSource(x);
+        m_req.release();
+        src->pipeline=0;
+        forgetOutReqs(src);
+        src->inflight=0;
+      }
     }
-
-    m_total_chunks_recvd+=chunks_coming;
-  }
-  else if (lasthdr)
-  {
-    if (idx >= m_chunk_total)
+    else if (src->pipeline && !(src->caps & FILE_CAP_PIPELINE))
     {
-      m_err="idx out of range";
-      debug_printf("xfer_recv: idx out of range (%d, top is %d)\n",idx,m_chunk_total);
-      delete reply;
-      return;
+      resetPipeline(src);
+      src->pipeline=0;
     }
 
-    unsigned int newpos_l=FILE_CHUNKSIZE*idx;
-#ifdef _WIN32
-    unsigned int newpos_h=(unsigned int) (((__int64)FILE_CHUNKSIZE*(__int64)idx)>>32);
-#else
-    unsigned int newpos_h=0;//fucko bsd 64 bit fn
-#endif
+    m_stream_on=!m_bytes_total_h && memcmp(m_hash,zerohash,SHA_OUTSIZE);
 
-    if (m_outfile_lastpos_l != newpos_l || m_outfile_lastpos_h != newpos_h)
+    if (!m_tree && !m_tree_ok && (src->caps & FILE_CAP_TREE) && memcmp(srv_hash,zerohash,SHA_OUTSIZE))
     {
-      m_outfile_lastpos_l=newpos_l;
-      m_outfile_lastpos_h=newpos_h;
-#ifdef XFER_WIN32_FILEIO
-      LONG zero=m_outfile_lastpos_h;
-      if (SetFilePointer(m_houtfile,m_outfile_lastpos_l,&zero,FILE_BEGIN) == 0xFFFFFFFF && 
-        GetLastError() != NO_ERROR)
-#else
-      if (fseek(m_outfile,m_outfile_lastpos_l,SEEK_SET))
-#endif
+      lasthdr->get_tree_root(m_tree_root);
+      m_tree_n=FileTree_NumLeaves(m_bytes_total_l,m_bytes_total_h);
+      m_tree_pages=(m_tree_n+FILE_TREE_LEAVES_PER_MSG-1)/FILE_TREE_LEAVES_PER_MSG;
+      m_tree=(unsigned char *)malloc(m_tree_n*SHA_OUTSIZE);
+      m_tree_pgot=(unsigned char *)calloc(1,m_tree_pages);
+      m_tree_ptime=(time_t *)calloc(m_tree_pages,sizeof(time_t));
+      m_blockstate=(unsigned char *)calloc(1,m_tree_n);
+      if (!m_tree || !m_tree_pgot || !m_tree_ptime || !m_blockstate) freeTree();
+      else if (m_tree_n == 1) // the only leaf is the root, and the file's hash
       {
-        m_err="error seeking";
-        delete reply;
-        return;
+        memcpy(m_tree,m_tree_root,SHA_OUTSIZE);
+        m_tree_pgot[0]=1;
+        if (memcmp(m_tree_root,srv_hash,SHA_OUTSIZE))
+        {
+          freeTree();
+          m_tree_ok=-1;
+        }
+        else gotTree();
       }
     }
 
-    if (idx < m_chunk_total-1 && reply->get_data_len() != FILE_CHUNKSIZE)
+    m_total_chunks_recvd+=src->chunks_coming;
+  }
+  else if (src->verified && idx >= FILE_TREE_INDEX) // a page of the hash tree
+  {
+    unsigned int p=idx-FILE_TREE_INDEX;
+    if (m_tree && !m_tree_ok && p < (unsigned int)m_tree_pages && !m_tree_pgot[p])
     {
-      debug_printf("xfer_recv: chunk %d, got size of %d and should have been %d (was valid=%d)\n",
-        idx,reply->get_data_len(),FILE_CHUNKSIZE,IS_VALID(idx));
+      int nl=m_tree_n-p*FILE_TREE_LEAVES_PER_MSG;
+      if (nl > FILE_TREE_LEAVES_PER_MSG) nl=FILE_TREE_LEAVES_PER_MSG;
+      if (reply->get_data_len() == nl*SHA_OUTSIZE)
+      {
+        memcpy(m_tree+p*FILE_TREE_LEAVES_PER_MSG*SHA_OUTSIZE,reply->get_data(),nl*SHA_OUTSIZE);
+        m_tree_pgot[p]=1;
+        gotTree();
+      }
     }
-
-    int n=0;
-    if (reply->get_data_len()) 
-#ifdef XFER_WIN32_FILEIO
+    src->chunks_coming--;
+  }
+  else if (src->verified)
+  {
+    unsigned int nch=(reply->get_data_len()+FILE_CHUNKSIZE-1)/FILE_CHUNKSIZE, c;
+    if (nch<1) nch=1;
+    if (idx >= m_chunk_total || nch > m_chunk_total-idx)
     {
-      DWORD d;
-      if (!WriteFile(m_houtfile,reply->get_data(),reply->get_data_len(),&d,NULL))
-        d=0;
-      n=d;
+      m_err="idx out of range";
+      debug_printf("xfer_recv: idx out of range (%d+%d, top is %d)\n",idx,nch,m_chunk_total);
+      return;
     }
-#else
-      n=fwrite(reply->get_data(),1,reply->get_data_len(),m_outfile);
-#endif
 
-    if (n != reply->get_data_len())
+    // a copy of what we already have (end game), don't write over it
+    for (c = idx; c < idx+nch && m_valid.is(c); c ++);
+    if (c == idx+nch)
     {
-      m_err="error writing";
-      delete reply;
+      src->chunks_coming-=nch;
       return;
     }
-#ifndef XFER_WIN32_FILEIO
-    fflush(m_outfile);
-#endif
-    unsigned int o=m_outfile_lastpos_l;
-    m_outfile_lastpos_l+=n;
-    if (m_outfile_lastpos_l < o) m_outfile_lastpos_h++;
 
-    if (!IS_VALID(idx))
+    if (idx+nch < m_chunk_total && reply->get_data_len() != (int)nch*FILE_CHUNKSIZE)
+    {
+      debug_printf("xfer_recv: chunk %d, got size of %d and should have been %d (was valid=%d)\n",
+        idx,reply->get_data_len(),nch*FILE_CHUNKSIZE,m_valid.is(idx));
+    }
+
+    // only the runs of chunks we don't have yet go out
+    unsigned char *data=reply->get_data();
+    int len=reply->get_data_len();
+    for (c = idx; c < idx+nch; c ++)
     {
-      SET_VALID(idx);
-      m_chunk_cnt++;
+      if (m_valid.is(c)) continue;
+      unsigned int e=c+1;
+      while (e < idx+nch && !m_valid.is(e)) e++;
+      int o=(c-idx)*FILE_CHUNKSIZE, l=(e-idx)*FILE_CHUNKSIZE;
+      if (l > len) l=len;
+      if (l > o && !writeData(c,data+o,l-o))
+      {
+        m_err="error writing";
+        return;
+      }
+      c=e;
+    }
+
+    for (c = idx; c < idx+nch; c ++)
+    {
+      if (!m_valid.is(c))
+      {
+        m_valid.set(c);
+        m_chunk_cnt++;
+        if (m_req.ok()) gotChunk(src,c);
+      }
     }
-    chunks_coming--;
-    delete reply;
+    if (m_tree_ok == 1)
+      for (c = idx/FILE_TREE_BLOCK; c <= (idx+nch-1)/FILE_TREE_BLOCK; c ++) blockFilled(c);
+    else if (m_stream_on)
+      streamChunks(reply->get_data(),idx,reply->get_data_len());
+    src->chunks_coming-=nch;
 
     char s[128];
 
@@ -1142,86 +2964,9 @@ void XferRecv::onGotMsg(C_FileSendReply *reply)
 
     if (m_chunk_cnt >= m_chunk_total)
     {
-      m_chunk_cnt=0;
-      unsigned int x;
-      for (x = 0; x < m_chunk_total; x ++) if (IS_VALID(x)) m_chunk_cnt++;
-      if (m_chunk_cnt >= m_chunk_total) // done!
-      {
-        if (lasthdr)
-        {
-          unsigned char zerohash[SHA_OUTSIZE]={0,};
-          unsigned char hash[SHA_OUTSIZE],hash2[SHA_OUTSIZE];
-          unsigned int l_h,l_l;
-          lasthdr->get_file_len(&l_l,&l_h);
-          lasthdr->get_hash(hash);
-          if (memcmp(zerohash,hash,SHA_OUTSIZE) && !l_h)
-          {
-#ifdef XFER_WIN32_FILEIO
-            SetFilePointer(m_houtfile,0,NULL,FILE_BEGIN);
-#else
-            fseek(m_outfile,0,SEEK_SET);
-#endif
-            SHAify context;
-            unsigned int l=l_l;
-
-            while (l>0)
-            {
-              unsigned char buf[8192];
-              unsigned int a=sizeof(buf);
-              if (a > l) a=l;
-#ifdef XFER_WIN32_FILEIO
-              DWORD d;
-              if (!ReadFile(m_houtfile,buf,sizeof(buf),&d,NULL)) d=0;
-              a=d;
-#else
-              a=fread(buf,1,a,m_outfile);
-#endif
-              if (!a) break;
-              context.add(buf,a);
-              l-=a;
-            }
-            context.final(hash2);
-            if (l || memcmp(hash,hash2,SHA_OUTSIZE))
-            {
-              m_err="SHA mismatch";
-              m_done=1;
-              request.set_prev_guid(&m_guid);
-              request.set_abort(2);
-              T_Message m={0,};
-              m.data=request.Make();
-              m.message_type=MESSAGE_FILE_REQUEST;
-              m.message_length=m.data->GetLength();
-              g_mql->send(&m);
-              return;
-            }
-          }
-        }
-        sprintf(s,"Completed @ %d.%02dk/s",
-          cps/1000,(cps/10)%100);
-        if (m_total_chunks_recvd > m_chunk_cnt && m_chunk_cnt)
-        {
-          int p=(m_total_chunks_recvd-m_chunk_cnt)*100/m_chunk_cnt;
-          if (!p) sprintf(s+strlen(s)," 0.%d%% waste",((m_total_chunks_recvd-m_chunk_cnt)*1000/m_chunk_cnt)%10);
-          else sprintf(s+strlen(s)," %d%% waste",p);
-        }
-#ifdef _WIN32
-        int idx=g_lvrecv.FindItemByParam((int)this);
-        if (idx!=-1)
-        {
-          g_lvrecv.SetItemText(idx,2,s);
-          g_lvrecv.SetItemText(idx,3,"");
-          g_lvrecv.SetItemText(idx,0,m_outfile_fn+m_outfile_fn_ll);
-        }
-#endif
-        m_done=1;
-        request.set_prev_guid(&m_guid);
-        request.set_abort(2);
-        T_Message m={0,};
-        m.data=request.Make();
-        m.message_type=MESSAGE_FILE_REQUEST;
-        m.message_length=m.data->GetLength();
-        g_mql->send(&m);
-      }
+      if (m_blocks_pending) checkBlocks(20);
+      checkDone();
+      if (m_err) return;
     }
     if (!m_done)
     {
@@ -1241,8 +2986,8 @@ void XferRecv::onGotMsg(C_FileSendReply *reply)
         );
 
       if (g_extrainf)
-        sprintf(s+strlen(s)," [%d/%d/%d/%d]",
-        m_chunk_cnt,m_total_chunks_recvd,m_chunk_total,m_adaptive_chunksize);
+        sprintf(s+strlen(s)," [%d/%d/%d/%d/%d]",
+        m_chunk_cnt,m_total_chunks_recvd,m_chunk_total,src->pipeline ? src->window : src->adaptive_chunksize,m_nsrc);
 
 #ifdef _WIN32
       int idx=g_lvrecv.FindItemByParam((int)this);
@@ -1250,11 +2995,121 @@ void XferRecv::onGotMsg(C_FileSendReply *reply)
 #endif
     }
   }
+  else if (lasthdr) // a source we haven't checked yet, someone else will send it
+  {
+  }
   else
   {
     m_err="data with no header";
     debug_printf("xfer_recv: got %s\n",m_err);
-    delete reply;
   }
 }
 
+C_RecvQueue::~C_RecvQueue()
+{
+  int x;
+  for (x = 0; x < m_items.GetSize(); x ++) freeItem(m_items.Get(x));
+}
+
+void C_RecvQueue::freeItem(Item *it)
+{
+  free(it->sources);
+  free(it);
+}
+
+int C_RecvQueue::add(char *guididx, char *sizestr, char *filename, char *path)
+{
+  int x;
+  for (x = 0; x < m_items.GetSize(); x ++)
+  {
+    Item *it=m_items.Get(x);
+    if (!strcmp(it->guididx,guididx) && !strcmp(it->filename,filename)) return 0;
+  }
+  int l1=strlen(guididx)+1, l2=strlen(sizestr)+1, l3=strlen(filename)+1, l4=strlen(path)+1;
+  Item *it=(Item *)malloc(sizeof(Item)+l1+l2+l3+l4);
+  if (!it) return 0;
+  it->id=m_nextid++;
+  if (m_nextid <= 0) m_nextid=1;
+  it->guididx=(char *)(it+1);
+  it->sizestr=it->guididx+l1;
+  it->filename=it->sizestr+l2;
+  it->path=it->filename+l3;
+  memcpy(it->guididx,guididx,l1);
+  memcpy(it->sizestr,sizestr,l2);
+  memcpy(it->filename,filename,l3);
+  memcpy(it->path,path,l4);
+  it->sources=0;
+  it->sources_len=0;
+  m_items.Add(it);
+  return it->id;
+}
+
+int C_RecvQueue::addSource(int id, char *guididx, char *filename)
+{
+  int x;
+  for (x = 0; x < m_items.GetSize(); x ++)
+  {
+    Item *it=m_items.Get(x);
+    if (it->id != id) continue;
+    int l1=strlen(guididx)+1, l2=strlen(filename)+1;
+    char *p=(char *)realloc(it->sources,it->sources_len+l1+l2+1);
+    if (!p) return 0;
+    memcpy(p+it->sources_len,guididx,l1);
+    memcpy(p+it->sources_len+l1,filename,l2);
+    it->sources=p;
+    it->sources_len+=l1+l2;
+    p[it->sources_len]=0;
+    return 1;
+  }
+  return 0;
+}
+
+int C_RecvQueue::remove(int id)
+{
+  int x;
+  for (x = 0; x < m_items.GetSize(); x ++)
+  {
+    if (m_items.Get(x)->id != id) continue;
+    freeItem(m_items.Get(x));
+    m_items.Del(x);
+    return 1;
+  }
+  return 0;
+}
+
+XferRecv *C_RecvQueue::run(C_ItemList<XferRecv> *recvs, C_MessageQueueList *mql, int maxdl, int maxhost)
+{
+  int n=recvs->GetSize();
+  if (!m_items.GetSize() || !mql->GetNumQueues() || (maxdl > 0 && n >= maxdl)) return NULL;
+
+  int x, best=-1, bestcnt=0;
+  for (x = 0; x < m_items.GetSize(); x ++)
+  {
+    Item *it=m_items.Get(x);
+    int y, cnt=0;
+    for (y = 0; y < n; y ++)
+      if (!strncmp(recvs->Get(y)->GetGuidIdx(),it->guididx,32)) cnt++;
+    if (maxhost > 0 && cnt >= maxhost) continue;
+    if (best < 0 || cnt < bestcnt)
+    {
+      best=x;
+      bestcnt=cnt;
+      if (!cnt) break; // an idle host, can't do better than that
+    }
+  }
+  if (best < 0) return NULL;
+
+  Item *it=m_items.Get(best);
+  m_items.Del(best);
+  XferRecv *r=new XferRecv(mql,it->guididx,it->sizestr,it->filename,it->path);
+  r->SetTag(it->id);
+  char *p=it->sources;
+  while (p && *p && !r->GetError())
+  {
+    char *fn=p+strlen(p)+1;
+    r->AddSource(p,fn);
+    p=fn+strlen(fn)+1;
+  }
+  freeItem(it);
+  return r;
+}
@@ -22,29 +22,178 @@
 #define _XFERS_H_
 
 #include "m_file.h"
+#include "chunkset.h"
 
 #define WASTESTATE_SIG1 0xFFFFFEFE 
 #define WASTESTATE_SIG2 0x00000101
+// after the bitmap come journal records: first chunk, count, and the two
+// xored with this. readers that don't know about them stop at the bitmap.
+#define WASTESTATE_JSIG 0x4A524E4C
+
+// how often a download appends what it has written to its state file, and
+// how many records it appends before rewriting the file instead
+#define XFER_JOURNAL_MS 1000
+#define XFER_JOURNAL_MAX 1024
 
 #ifdef _WIN32
 #define XFER_WIN32_FILEIO
 #endif
 
+// most chunks a pipelining receiver keeps in flight, and a sender keeps queued
+#define XFER_MAX_WINDOW 2048
+#define XFER_MIN_WINDOW 8
+#define XFER_MAX_OUTREQ (XFER_MAX_WINDOW/FILE_MAX_CHUNKS_PER_REQ)
+
+// hosts a download pulls from at once
+#define XFER_MAX_SOURCES 8
+
+// chunks an upload reads from disk at a time
+#define XFER_READAHEAD 128
+
+// bytes of consecutive chunks a download collects before writing them out
+#define XFER_WRITEBEHIND (64*FILE_CHUNKSIZE)
+
+// uploads share the bandwidth by deficit round robin, see XferSend::RunAll().
+// each round a send with a slot gets XFER_DRR_QUANTUM bytes of credit per
+// unit of weight. sends waiting for a slot get one message every
+// XFER_QUEUED_MS so the receiver doesn't give up on them. a slot whose send
+// has had nothing asked of it for XFER_SLOT_IDLE_MS goes to one that's waiting.
+#define XFER_DRR_QUANTUM (FILE_MAX_MULTICHUNK*FILE_CHUNKSIZE)
+#define XFER_DRR_ROUNDS 64
+#define XFER_QUEUED_MS 10000
+#define XFER_SLOT_IDLE_MS 5000
+
+// chunks recently read for uploads, shared by every upload so a file that
+// several people are getting is read once rather than once each. a file is
+// known by its path, size and modification time. main thread only.
+class C_ChunkCache
+{
+  public:
+    C_ChunkCache(int maxbytes);
+    ~C_ChunkCache();
+
+    int addFile(char *fn, unsigned int len_l, unsigned int len_h, unsigned int mtime); // -1 if caching is off
+    void releaseFile(int f);
+
+    // data is FILE_CHUNKSIZE, except at the end of a file
+    unsigned char *get(int f, unsigned int idx, unsigned int *len);
+    int has(int f, unsigned int idx) { return find(f,idx) >= 0; }
+    void put(int f, unsigned int idx, unsigned char *data, unsigned int len);
+
+  protected:
+    typedef struct
+    {
+      char *fn;
+      unsigned int len_l, len_h, mtime;
+      int refs, nchunks; // slot is free when both are 0
+    } FileEnt;
+    typedef struct
+    {
+      int file; // -1 if unused
+      unsigned int idx, len;
+      int hnext; // hash chain
+      int prev, next; // lru list, most recent first
+    } ChunkEnt;
+
+    int find(int f, unsigned int idx);
+    unsigned int hashslot(int f, unsigned int idx) { return (idx*2654435761u ^ (unsigned int)f*40503u) & m_hash_mask; }
+    void unlink(int e);
+    void pushFront(int e);
+    void drop(int e); // takes e out of the hash and its file's count
+
+    int m_max; // chunks
+    unsigned char *m_data; // m_max*FILE_CHUNKSIZE, allocated on first put()
+    ChunkEnt *m_ents;
+    int *m_hash;
+    unsigned int m_hash_mask;
+    int m_head, m_tail, m_used;
+    FileEnt *m_files;
+    int m_files_used, m_files_size;
+};
+
+// transfers by the guid their messages come in on, so a message finds its
+// transfer without walking g_sends/g_recvs. open addressing, linear probing.
+class C_XferGuidMap
+{
+  public:
+    C_XferGuidMap();
+    ~C_XferGuidMap();
+
+    void add(T_GUID *guid, void *item);
+    void del(T_GUID *guid, void *item); // only if it's item's
+    void *find(T_GUID *guid);
+
+  protected:
+    typedef struct
+    {
+      T_GUID guid;
+      void *item; // NULL if empty
+    } Ent;
+    Ent *m_tab;
+    unsigned int m_mask, m_used, m_seed;
+    unsigned int slot(T_GUID *guid);
+    void grow();
+};
+
+// the one thread that does the disk work the main thread shouldn't wait on:
+// read-ahead for uploads, syncing and journaling for downloads. jobs run in
+// the order they're added, and an owner has at most one queued at a time.
+class C_XferIO
+{
+  public:
+    C_XferIO();
+    ~C_XferIO();
+
+    // runs func(owner) on the thread, or right here if it can't be started
+    void add(void (*func)(void *), void *owner);
+    int busy(void *owner); // 1 while owner's job is queued or running
+    void cancel(void *owner); // drops owner's queued job, waits if it's running
+
+  protected:
+    typedef struct
+    {
+      void (*func)(void *);
+      void *owner;
+    } Job;
+    C_ItemList<Job> m_jobs;
+    void *m_running;
+    int m_thread_ok;
+    volatile int m_thread_kill;
+    void lock();
+    void unlock();
+#ifdef _WIN32
+    CRITICAL_SECTION m_cs;
+    HANDLE m_event, m_thread;
+    static unsigned long WINAPI _threadfunc(LPVOID _d);
+#else
+    pthread_mutex_t m_mutex;
+    pthread_cond_t m_cond, m_donecond;
+    pthread_t m_thread;
+    static void *_threadfunc(void *_d);
+#endif
+};
+
 class XferSend
 {
   public:    
    XferSend(C_MessageQueueList *mql, T_GUID *guid, C_FileSendRequest *req, char *fn);
    ~XferSend();
 
-    void set_guid(T_GUID *guid) { m_guid = *guid; }
+    void set_guid(T_GUID *guid); // the guid of the latest request, what the next one has as its prev guid
     T_GUID *get_guid() { return &m_guid; }
+    static XferSend *Find(T_GUID *guid);
 
     int get_idx() { return m_idx; }
 
     int run_hdr(C_MessageQueueList *mql);
-    void run(C_MessageQueueList *mql);
+    int run(C_MessageQueueList *mql, int budget=0x7fffffff); // returns bytes queued
     void onGotMsg(C_FileSendRequest *req);
 
+    // runs every send in the list, giving out ul_slots slots (0 for no limit)
+    // first come first served and sharing the bandwidth between them by weight.
+    static void RunAll(C_ItemList<XferSend> *sends, C_MessageQueueList *mql);
+    int IsQueued() { return !m_slot; } // waiting for an upload slot
+
     void Abort(C_MessageQueueList *mql);
 
     char *GetError() { return m_err; }
@@ -54,6 +203,10 @@ class XferSend
 
     int GetIdx() { return m_idx; }
 
+    // opening, sizing and hashing the file happens on a worker thread, the
+    // header goes out from run_hdr() once that is done.
+    int IsPreparing() { return m_prep_state != 0; }
+
     // Progress getters for TUI
     unsigned int getChunksSent() const { return m_chunks_sent_total; }
     unsigned int getChunksTotal() const { return m_filelen_chunks; }
@@ -62,6 +215,30 @@ class XferSend
 
   private:
     void updateStatusText();
+    void sendError(C_MessageQueueList *mql);
+
+    void prepFile(); // worker thread
+    void prepDone(C_MessageQueueList *mql);
+    volatile int m_prep_state; // 0=ready, 1=worker running, 2=worker done
+    volatile int m_prep_kill;
+    char *m_prep_fn;
+    char *m_prep_err;
+    C_FileSendRequest *m_prep_req; // latest request, answered when ready
+    unsigned int m_prep_maxsha; // 0 to not hash
+    int m_prep_havesha; // m_prep_hash is from the db and good for m_prep_sha_*
+    int m_prep_sha_l, m_prep_sha_h, m_prep_sha_time;
+    int m_prep_newsha; // worker computed m_prep_hash
+    unsigned char m_prep_hash[SHA_OUTSIZE];
+    unsigned char *m_prep_tree; // leaves that go with m_prep_hash
+    int m_prep_tree_n;
+    unsigned int m_prep_len_l, m_prep_len_h, m_prep_create_date, m_prep_mod_date;
+#ifdef _WIN32
+    HANDLE m_prep_thread;
+    static unsigned long WINAPI _prepthread(LPVOID _d);
+#else
+    pthread_t m_prep_thread;
+    static void *_prepthread(void *_d);
+#endif
 
     time_t m_last_talktime;
     unsigned int m_lastsendtime;
@@ -77,17 +254,42 @@ class XferSend
 #endif
     int m_idx;
     int m_need_reply;
+    int m_peer_caps; // FILE_CAP_* from the latest request
+    unsigned char *m_tree; // hash tree leaves, NULL if we didn't hash the file
+    int m_tree_n;
     unsigned int m_filelen_bytes_l, m_filelen_bytes_h;
     unsigned int m_filelen_chunks;
-    unsigned int m_lastpos_l, m_lastpos_h;
-
-    unsigned int chunks_to_send[FILE_MAX_CHUNKS_PER_REQ];
+    int m_cache_file; // in g_chunkcache, or -1
+
+    // read-ahead: chunks are sent out of window 0 while the C_XferIO thread
+    // fills window 1 with one big read, sized to what's queued from there.
+    unsigned char *m_ra_buf[2]; // min(XFER_READAHEAD,m_filelen_chunks) chunks each
+    unsigned int m_ra_idx[2], m_ra_n[2], m_ra_len[2]; // first chunk, chunks, bytes read
+    int m_ra_state; // 0=idle, 1=window 1 handed to the io thread
+    int takeWindow();
+    int allocWindow(int w);
+    int readChunk(unsigned int x);
+    unsigned int queuedSpan(unsigned int x);
+    int fromCache(unsigned int x);
+    void toCache(int w);
+    void startRead(unsigned int x);
+    void prefetch();
+    void readAhead(); // io thread
+    static void _readahead(void *_d);
+
+    unsigned int chunks_to_send[XFER_MAX_WINDOW];
     unsigned int chunks_to_send_pos,chunks_to_send_len;
 
     unsigned int m_starttime, m_lastchunkcnt;
     unsigned int m_chunks_sent_total,m_max_chunksent;
     int m_last_cps;
 
+    int m_weight; // share of the upload bandwidth, from ul_weight_<nick>
+    int m_slot;
+    int m_deficit; // drr credit, in bytes
+    unsigned int m_queued_sendtime;
+    unsigned int m_busytime; // last time it had chunks to send
+
     C_FileSendReply m_reply;
 };
 
@@ -98,12 +300,22 @@ class XferRecv
     ~XferRecv();
 
     int run(C_MessageQueueList *mql);
-    void onGotMsg(C_FileSendReply *reply);
+    void onGotMsg(C_FileSendReply *reply, T_GUID *guid); // reply is only borrowed
 
     char *GetError() { return m_err; }
     void Abort(C_MessageQueueList *mql);
 
-    T_GUID *get_guid() { return &m_guid; }
+    // another host with the same file. it's only used once its header shows
+    // the same size and hash, chunks are then spread across all sources.
+    int AddSource(char *guididx, char *filename); // 0 if added
+    int GetNumSources() { return m_nsrc; }
+
+    char *GetGuidIdx() { return m_guididx; } // of the first source, the host is its first 32 chars
+    void SetTag(int tag) { m_tag=tag; } // for front ends
+    int GetTag() { return m_tag; }
+
+    int has_guid(T_GUID *guid) { return findSource(guid) != NULL; } // replies can still come in on guids of earlier requests
+    static XferRecv *Find(T_GUID *guid); // whichever has_guid(guid)
     char *getActualOutputFile() { return m_outfile_fn; }
     char *getOutputFileCopy(); // returns a filename of a copy of the file
 
@@ -116,15 +328,14 @@ class XferRecv
     bool isDone() const { return m_done != 0; }
 
   private:
+    char m_guididx[64];
+    int m_tag;
     char *m_statfile_fn;
     char *m_outfile_fn;
     int m_outfile_fn_ll;
-    time_t last_msg_time;
     char *m_err;
     char m_errbuf[256];
     C_FileSendReply *lasthdr;
-    int chunks_coming;
-    T_GUID m_guid;
     char *m_tmpcopyfn;
 
 #ifdef XFER_WIN32_FILEIO
@@ -143,20 +354,162 @@ class XferRecv
 
     int m_path_len;
 
-    unsigned int m_outfile_lastpos_l,m_outfile_lastpos_h;
-    unsigned char *m_validbf;
+    unsigned int m_outfile_lastpos_l,m_outfile_lastpos_h; // XFER_WIN32_FILEIO, elsewhere it's all pread/pwrite
+
+    // chunks that carry on from each other are written in one go. this is
+    // flushed before anything reads the file back, and before the state is.
+    unsigned char *m_wb;
+    unsigned int m_wb_idx; // chunk at m_wb
+    int m_wb_len;
+    int writeData(unsigned int idx, unsigned char *data, int len);
+    int flushWrites();
+    unsigned int readData(unsigned int idx, unsigned char *buf, unsigned int len);
+    void flushState(); // rewrites the whole state file, emptying the journal
+    void journalState();
+    // the state file is written on the C_XferIO thread, so the main thread
+    // never waits on the disk: it hands over a snapshot of what to write in m_st_buf.
+    unsigned char *m_st_buf; // the bitmap for a rewrite, or records to append
+    int m_st_len, m_st_size, m_st_rewrite;
+    int m_st_queued; // m_st_buf went to the io thread, ours again once it isn't busy
+    int snapState(int rewrite);
+    void writeState(); // io thread
+    static void _writestate(void *_d);
+    void noteWritten(unsigned int idx, unsigned int n);
+    unsigned int *m_jr; // start,count pairs written since they were last journaled
+    int m_jr_n, m_jr_size;
+    int m_journal_n; // records in the state file
+    int m_state_compact; // the state file needs rewriting before anything is appended
+    unsigned int m_last_journal_time;
+    C_ChunkSet m_valid; // chunks we have
     unsigned char m_hash[SHA_OUTSIZE];
-    C_FileSendRequest request;
     unsigned int m_chunk_cnt, m_chunk_total,m_chunk_startcnt;
     unsigned int m_first_chunkilack;
     unsigned int m_create_date, m_mod_date;
     unsigned int m_bytes_total_l,m_bytes_total_h;
     unsigned int m_total_chunks_recvd;
     int m_done;
-    int m_hasgotchunks;
-    time_t m_next_stateflush_time;
 
-    int m_adaptive_chunksize;
+    // hash tree of the file (FILE_CAP_TREE). once the leaves add up to the
+    // root, each block is checked as soon as all its chunks are in, a bad
+    // one is just fetched again and the file isn't reread at the end.
+    unsigned char m_tree_root[SHA_OUTSIZE];
+    unsigned char *m_tree; // leaves, NULL if no source has a tree
+    int m_tree_n, m_tree_ok;
+    int m_tree_pages;
+    unsigned char *m_tree_pgot;
+    time_t *m_tree_ptime; // when each page was last asked for
+    unsigned char *m_blockstate; // per leaf: 0=incomplete, 1=to check, 2=good
+    int m_blocks_ok, m_blocks_pending, m_blocks_bad, m_block_scan;
+    void freeTree();
+    void gotTree();
+    void blockFilled(unsigned int b);
+    int checkBlocks(unsigned int maxms);
+    void checkDone();
+
+    // without a tree, the file's hash is fed as the file fills in from the
+    // start, mostly straight from the replies. whatever came in out of order
+    // and isn't in it by the end is hashed on a worker thread.
+    SHAify m_stream_ctx;
+    unsigned int m_stream_next; // first chunk not in m_stream_ctx
+    int m_stream_on;
+    void streamChunks(unsigned char *data, unsigned int idx, int len);
+    void streamFile(unsigned int maxms);
+
+    volatile int m_hash_state; // 0=idle, 1=worker running, 2=worker done
+    volatile int m_hash_kill;
+    int m_hash_ok;
+    unsigned char m_stream_hash[SHA_OUTSIZE];
+    void hashRest(); // worker thread
+    void joinHashThread();
+#ifdef _WIN32
+    HANDLE m_hash_thread;
+    static unsigned long WINAPI _hashthread(LPVOID _d);
+#else
+    pthread_t m_hash_thread;
+    static void *_hashthread(void *_d);
+#endif
+
+    // pipelined requests, once the sender has said it queues them (FILE_CAP_PIPELINE).
+    // the window is grown additively while the request->first chunk time stays
+    // near the best we've seen, and halved when a request's chunks don't show.
+    typedef struct
+    {
+      T_GUID guid;
+      unsigned int sent; // GetTickCount()
+      int n, left, sampled;
+      unsigned int chunks[FILE_MAX_CHUNKS_PER_REQ]; // ascending
+    } OutReq;
+
+    // one per host we download from. the first starts out one request at a
+    // time, the others only join once pipelining is up (m_req).
+    typedef struct
+    {
+      C_FileSendRequest *request;
+      T_GUID guid; // of our latest request
+      int started, verified; // verified: sent a header for our file
+      int caps; // of its latest header
+      time_t last_msg_time;
+      int chunks_coming;
+      int hasgotchunks;
+      int adaptive_chunksize;
+      int pipeline;
+      int inflight;
+      int window;
+      unsigned int srtt, minrtt, lastloss;
+      OutReq outreq[XFER_MAX_OUTREQ];
+      int outreq_used;
+    } Source;
+    Source *m_src[XFER_MAX_SOURCES];
+    int m_nsrc;
+    C_ChunkSet m_req; // chunks asked for and not yet received
+
+    Source *newSource(char *filename);
+    Source *findSource(T_GUID *guid);
+    void dropSource(int i);
+    int runSource(C_MessageQueueList *mql, Source *s); // nonzero if it timed out
+    void sendRequest(C_MessageQueueList *mql, Source *s, int maxchunks);
+    void sendAbort(C_MessageQueueList *mql, Source *s, int abort);
+    int findOutReq(Source *s, unsigned int idx);
+    void resetPipeline(Source *s);
+    void forgetOutReqs(Source *s);
+    void retireGuid(T_GUID *guid);
+    void expireRequests(Source *s);
+    void gotChunk(Source *from, unsigned int idx);
+};
+
+// downloads waiting to be started. whenever there's room the next one is
+// the oldest from whichever host has the fewest downloads running, so one
+// host with a long queue doesn't hold up the rest.
+class C_RecvQueue
+{
+  public:
+    C_RecvQueue() { m_nextid=1; }
+    ~C_RecvQueue();
+
+    // returns an id for the item, the XferRecv gets it as its tag once started.
+    // 0 if the same file from the same host is already queued.
+    int add(char *guididx, char *sizestr, char *filename, char *path);
+    // another host to fetch item id from, added to the XferRecv when it's created
+    int addSource(int id, char *guididx, char *filename);
+    int remove(int id); // 1 if it was still queued
+    int GetSize() { return m_items.GetSize(); }
+
+    // creates the next download if fewer than maxdl are running in recvs and
+    // fewer than maxhost from its host (0 for no limit). the caller adds it to
+    // recvs (or deletes it, if it has an error). NULL if there's no room.
+    XferRecv *run(C_ItemList<XferRecv> *recvs, C_MessageQueueList *mql, int maxdl, int maxhost);
+
+  private:
+    typedef struct
+    {
+      int id;
+      char *guididx, *sizestr, *filename, *path; // in the same block
+      char *sources; // guididx,filename pairs, ended by an empty string
+      int sources_len;
+    } Item;
+    void freeItem(Item *it);
+    C_ItemList<Item> m_items;
+    int m_nextid;
 };
 
 #endif//_XFERS_H_
\ No newline at end of file
@@ -226,13 +226,7 @@ static void RunSends(void)
       needrefresh++;
     }
   }
-  static int runoffs;
-  int s=g_sends.GetSize();
-  for (x = 0; x < s; x ++)
-  {
-    g_sends.Get((x+runoffs)%s)->run(g_mql);
-  }
-  runoffs++; // round robin
+  XferSend::RunAll(&g_sends,g_mql);
 #ifdef _WIN32
   if (needrefresh) PostMessage(g_xferwnd,WM_USER_TITLEUPDATE,0,0);
 #endif